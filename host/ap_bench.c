@@ -0,0 +1,324 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Throughput and latency of the protocol core with the fake AP. The AP
+ * either replays superframes from a file or sends a synthetic mix of
+ * FW_VERSION requests and UART writes, while UART RX data keeps the H7
+ * side of the link busy.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_ap.h"
+#include "fake_uart.h"
+#include "firmware.h"
+
+#include "system.h"
+#include "opcodes.h"
+#include "peripherals.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+#define BENCH_MAX_FRAMES    (4096)
+#define BENCH_MAX_PENDING   (4096)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct frame
+{
+  uint16_t size;
+  uint8_t * data;
+};
+
+struct samples
+{
+  char const * name;
+  uint64_t * ns;
+  uint32_t num;
+  uint32_t max_num;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+static struct frame frames[BENCH_MAX_FRAMES];
+static uint32_t frames_num = 0;
+
+static struct samples transfer_ns = { "transfer" };
+static struct samples dispatch_ns = { "dispatch" };
+static struct samples request_ns  = { "request" };
+
+/* Send times of the FW_VERSION requests waiting for their response. */
+static uint64_t pending[BENCH_MAX_PENDING];
+static uint32_t pending_head = 0;
+static uint32_t pending_tail = 0;
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sample(struct samples * s, uint64_t const ns)
+{
+  if (s->num == s->max_num)
+  {
+    s->max_num = s->max_num ? (2 * s->max_num) : 4096;
+    s->ns = realloc(s->ns, s->max_num * sizeof(s->ns[0]));
+  }
+  s->ns[s->num++] = ns;
+}
+
+static int compare(void const * a, void const * b)
+{
+  uint64_t const x = *(uint64_t const *)a;
+  uint64_t const y = *(uint64_t const *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(struct samples * s)
+{
+  if (s->num == 0)
+    return;
+
+  qsort(s->ns, s->num, sizeof(s->ns[0]), compare);
+  printf("%-10s %10u %10lu %10lu %10lu %10lu\n", s->name, s->num,
+         (unsigned long)s->ns[s->num / 2], (unsigned long)s->ns[s->num * 9 / 10],
+         (unsigned long)s->ns[s->num * 99 / 100], (unsigned long)s->ns[s->num - 1]);
+}
+
+static void on_subpacket(uint8_t const peripheral, uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  if (peripheral == PERIPH_H7 && opcode == FW_VERSION && pending_tail != pending_head)
+    sample(&request_ns, now_ns() - pending[pending_tail++ % BENCH_MAX_PENDING]);
+}
+
+static void add_frame(uint8_t const * data, uint16_t const size)
+{
+  if (frames_num == BENCH_MAX_FRAMES)
+    return;
+  frames[frames_num].data = malloc(size ? size : 1);
+  memcpy(frames[frames_num].data, data, size);
+  frames[frames_num].size = size;
+  frames_num++;
+}
+
+/* A capture holds the superframes as sent by the AP, header included. */
+static int load_frames(char const * path)
+{
+  FILE * f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return -1;
+  }
+
+  static uint8_t buf[SPI_DMA_BUFFER_SIZE];
+  uint8_t header[4];
+  while (fread(header, sizeof(header), 1, f) == 1)
+  {
+    uint16_t const size = header[0] | (header[1] << 8);
+    uint16_t const checksum = header[2] | (header[3] << 8);
+    if (size > RX_SUPERFRAME_MAX_SIZE || (size && (size ^ 0x5555) != checksum) ||
+        fread(buf, size, 1, f) != (size ? 1 : 0))
+    {
+      fprintf(stderr, "%s: invalid superframe #%u\n", path, frames_num);
+      fclose(f);
+      return -1;
+    }
+    add_frame(buf, size);
+  }
+
+  fclose(f);
+  return 0;
+}
+
+static void make_frames(uint8_t const subpackets, uint16_t const payload)
+{
+  static uint8_t buf[SPI_DMA_BUFFER_SIZE];
+  uint32_t size = 0;
+
+  buf[size++] = PERIPH_H7;
+  buf[size++] = FW_VERSION;
+  buf[size++] = 0;
+  buf[size++] = 0;
+
+  for (uint8_t i = 0; i < subpackets && (size + 4 + payload) <= RX_SUPERFRAME_MAX_SIZE; i++)
+  {
+    buf[size++] = PERIPH_UART;
+    buf[size++] = DATA;
+    buf[size++] = payload & 0xFF;
+    buf[size++] = payload >> 8;
+    for (uint16_t j = 0; j < payload; j++)
+      buf[size++] = i + j;
+  }
+
+  add_frame(buf, size);
+}
+
+static uint32_t count_requests(struct frame const * frame)
+{
+  uint32_t num = 0;
+  for (uint32_t offset = 0; offset + 4 <= frame->size; )
+  {
+    uint8_t const * subpkt = frame->data + offset;
+    if (subpkt[0] == PERIPH_H7 && subpkt[1] == FW_VERSION)
+      num++;
+    offset += 4 + (subpkt[2] | (subpkt[3] << 8));
+  }
+  return num;
+}
+
+static void dispatch()
+{
+  struct rx_queue_stats stats;
+  do {
+    firmware_poll();
+    dma_get_rx_queue_stats(&stats);
+  } while (stats.used > 0);
+}
+
+int main(int argc, char ** argv)
+{
+  uint32_t transfers = 10000;
+  uint8_t subpackets = 4;
+  uint16_t payload = 64;
+  uint16_t uart_rx = 256;
+  char const * replay = NULL;
+  bool is_single_phase = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:p:u:r:1")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': transfers = strtoul(optarg, NULL, 0); break;
+      case 's': subpackets = strtoul(optarg, NULL, 0); break;
+      case 'p': payload = strtoul(optarg, NULL, 0); break;
+      case 'u': uart_rx = strtoul(optarg, NULL, 0); break;
+      case 'r': replay = optarg; break;
+      case '1': is_single_phase = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-n transfers] [-s subpackets] [-p payload] [-u uart rx bytes] [-r replay file] [-1 single-phase]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  if (replay) {
+    if (load_frames(replay) < 0 || frames_num == 0)
+      return 1;
+  }
+  else
+    make_frames(subpackets, payload);
+
+  firmware_init();
+  fake_ap_init(on_subpacket);
+
+  if (is_single_phase)
+  {
+    uint8_t const request[] = {PERIPH_H7, H7_SPI_TRANSFER_MODE, 1, 0, SPI_TRANSFER_SINGLE_PHASE};
+    fake_ap_transfer(request, sizeof(request));
+    while (!fake_ap_is_single_phase())
+    {
+      dispatch();
+      fake_ap_transfer(NULL, 0);
+    }
+  }
+
+  uint8_t * uart_data = malloc(uart_rx ? uart_rx : 1);
+  for (uint16_t i = 0; i < uart_rx; i++)
+    uart_data[i] = i;
+
+  struct fake_ap_stats start;
+  fake_ap_get_stats(&start);
+  struct fake_uart_stats uart_start;
+  fake_uart_get_stats(&uart_start);
+  uint64_t const t_start = now_ns();
+
+  for (uint32_t i = 0; i < transfers; i++)
+  {
+    struct frame const * frame = &frames[i % frames_num];
+
+    fake_uart_receive(uart_data, uart_rx, 0);
+    firmware_poll();
+
+    uint64_t const t0 = now_ns();
+    for (uint32_t n = count_requests(frame); n > 0 && (pending_head - pending_tail) < BENCH_MAX_PENDING; n--)
+      pending[pending_head++ % BENCH_MAX_PENDING] = t0;
+    fake_ap_transfer(frame->data, frame->size);
+    uint64_t const t1 = now_ns();
+    dispatch();
+    uint64_t const t2 = now_ns();
+
+    sample(&transfer_ns, t1 - t0);
+    sample(&dispatch_ns, t2 - t1);
+  }
+
+  /* Collect the outstanding responses. */
+  for (uint32_t i = 0; i < 16 && (fake_ap_is_irq_asserted() || pending_tail != pending_head); i++)
+  {
+    fake_ap_transfer(NULL, 0);
+    dispatch();
+  }
+
+  uint64_t const t_end = now_ns();
+  struct fake_ap_stats stats;
+  fake_ap_get_stats(&stats);
+  struct fake_uart_stats uart_stats;
+  fake_uart_get_stats(&uart_stats);
+
+  double const seconds = (t_end - t_start) / 1e9;
+  uint64_t const bytes_tx = stats.bytes_tx - start.bytes_tx;
+  uint64_t const bytes_rx = stats.bytes_rx - start.bytes_rx;
+  uint32_t const cs_cycles = stats.cs_cycles - start.cs_cycles;
+  uint32_t const num = stats.transfers - start.transfers;
+
+  printf("transfers  %u (%s, %.2f CS cycles per transfer), %.3f s\n", num,
+         fake_ap_is_single_phase() ? "single-phase" : "two-phase", num ? (double)cs_cycles / num : 0.0, seconds);
+  printf("AP -> H7   %12lu bytes %10.2f MB/s (UART TX %lu bytes)\n", (unsigned long)bytes_tx, bytes_tx / seconds / 1e6,
+         (unsigned long)(uart_stats.bytes_tx - uart_start.bytes_tx));
+  printf("H7 -> AP   %12lu bytes %10.2f MB/s (%u subpackets)\n", (unsigned long)bytes_rx, bytes_rx / seconds / 1e6,
+         stats.subpackets_rx - start.subpackets_rx);
+  printf("%-10s %10s %10s %10s %10s %10s\n", "ns", "samples", "p50", "p90", "p99", "max");
+  report(&transfer_ns);
+  report(&dispatch_ns);
+  report(&request_ns);
+
+  if (stats.checksum_errors || stats.framing_errors) {
+    printf("checksum errors %u, framing errors %u\n", stats.checksum_errors, stats.framing_errors);
+    return 1;
+  }
+  return 0;
+}
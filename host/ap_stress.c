@@ -0,0 +1,349 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Stress test of the TX superframe: producers in the main loop and in
+ * interrupts of different priorities append subpackets while the fake AP
+ * keeps swapping the TX buffers out at random preemption points. Every
+ * subpacket has to arrive exactly once and intact, unless it is accounted
+ * for as dropped by the spill queue.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fake_ap.h"
+#include "firmware.h"
+
+#include "system.h"
+#include "opcodes.h"
+#include "peripherals.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+#define STRESS_PRODUCERS        (4)
+#define STRESS_MAX_SEQ          (1 << 20)
+#define STRESS_MAX_PAYLOAD      (96)
+#define STRESS_DRAIN_ITERATIONS (100000)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+__attribute__((packed)) struct stress_payload {
+  uint8_t  producer;
+  uint8_t  len;
+  uint16_t reserved;
+  uint32_t seq;
+  uint8_t  data[];
+};
+
+struct producer
+{
+  char const * name;
+  uint8_t peripheral;
+  uint8_t opcode;
+  uint32_t seq;      /* Number of subpackets handed to the firmware. */
+  uint32_t dropped;  /* ... refused by enqueue_packet(). */
+  uint32_t rejected; /* Reservations which did not fit, not counted in seq. */
+  uint32_t received;
+  uint8_t * seen;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+static struct producer producers[STRESS_PRODUCERS] =
+{
+  /* Main loop, enqueue_packet(). */
+  { "main/enqueue",  PERIPH_UART,         DATA,         0, 0, 0, 0, NULL },
+  /* Main loop, tx_reserve() serializing in place. */
+  { "main/reserve",  PERIPH_VIRTUAL_UART, DATA,         0, 0, 0, 0, NULL },
+  /* GPIO IRQ, enqueue_packet() into the high priority lane. */
+  { "isr2/enqueue",  PERIPH_GPIO,         IRQ_SIGNAL,   0, 0, 0, 0, NULL },
+  /* Above EXTI15_10, tx_reserve() into the high priority lane. */
+  { "isr1/reserve",  PERIPH_FDCAN1,       CAN_STATUS,   0, 0, 0, 0, NULL },
+};
+
+static uint32_t seq_limit = 200000;
+static unsigned int preempt_rate = 8;
+static bool is_producing = true;
+static uint32_t errors = 0;
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+static uint8_t pattern(uint32_t const seq, uint8_t const i)
+{
+  return (seq * 31 + i * 7 + 1) & 0xFF;
+}
+
+static void error(char const * fmt, uint8_t const producer, uint32_t const seq)
+{
+  if (errors++ < 10) {
+    fprintf(stderr, fmt, producer, seq);
+    fputc('\n', stderr);
+  }
+}
+
+static uint8_t fill(struct stress_payload * payload, uint8_t const producer, bool const is_preemptible)
+{
+  uint8_t const len = rand() % (STRESS_MAX_PAYLOAD - sizeof(*payload));
+
+  payload->producer = producer;
+  payload->len = len;
+  payload->reserved = 0;
+  payload->seq = producers[producer].seq;
+  for (uint8_t i = 0; i < len; i++)
+  {
+    payload->data[i] = pattern(payload->seq, i);
+    /* An interrupt may hit while the subpacket is being serialized. */
+    if (is_preemptible && (i % 16) == 0)
+      host_preempt();
+  }
+  return sizeof(*payload) + len;
+}
+
+static void produce_enqueue(uint8_t const producer)
+{
+  struct producer * p = &producers[producer];
+  uint8_t buf[STRESS_MAX_PAYLOAD];
+
+  if (!is_producing || p->seq >= seq_limit)
+    return;
+
+  uint8_t const size = fill((struct stress_payload *)buf, producer, false);
+  if (enqueue_packet(p->peripheral, p->opcode, size, buf) <= 0)
+    p->dropped++;
+  p->seq++;
+}
+
+static void produce_reserve(uint8_t const producer)
+{
+  struct producer * p = &producers[producer];
+
+  if (!is_producing || p->seq >= seq_limit)
+    return;
+
+  struct tx_handle const handle = tx_reserve(p->peripheral, p->opcode, STRESS_MAX_PAYLOAD);
+  if (!handle.data) {
+    p->rejected++;
+    return;
+  }
+
+  /* Commit less than reserved to exercise shrinking behind preempting producers. */
+  uint8_t const size = fill((struct stress_payload *)handle.data, producer, true);
+  tx_commit(&handle, size);
+  p->seq++;
+}
+
+static void isr_gpio()
+{
+  produce_enqueue(2);
+}
+
+static void isr_fdcan()
+{
+  produce_reserve(3);
+}
+
+static void on_subpacket(uint8_t const peripheral, uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  struct stress_payload const * payload = (struct stress_payload const *)data;
+
+  uint8_t producer;
+  for (producer = 0; producer < STRESS_PRODUCERS; producer++)
+  {
+    if (producers[producer].peripheral == peripheral && producers[producer].opcode == opcode)
+      break;
+  }
+  if (producer == STRESS_PRODUCERS)
+    return;
+
+  if (size < sizeof(*payload) || payload->producer != producer ||
+      size != sizeof(*payload) + payload->len || payload->seq >= STRESS_MAX_SEQ)
+  {
+    error("producer %d: torn subpacket header (seq %u)", producer, (size >= sizeof(*payload)) ? payload->seq : 0);
+    return;
+  }
+
+  for (uint16_t i = 0; i < payload->len; i++)
+  {
+    if (payload->data[i] != pattern(payload->seq, i)) {
+      error("producer %d: torn payload (seq %u)", producer, payload->seq);
+      return;
+    }
+  }
+
+  struct producer * p = &producers[producer];
+  if (p->seen[payload->seq / 8] & (1 << (payload->seq % 8))) {
+    error("producer %d: duplicate subpacket (seq %u)", producer, payload->seq);
+    return;
+  }
+  p->seen[payload->seq / 8] |= (1 << (payload->seq % 8));
+  p->received++;
+}
+
+static void ap_poll()
+{
+  if (!fake_ap_is_busy())
+  {
+    /* Transfers are started by nIRQ, or by the AP having data of its own. */
+    if (fake_ap_is_irq_asserted() || (rand() % 32) == 0)
+      fake_ap_start(NULL, 0);
+  }
+  else
+  {
+    fake_ap_step();
+  }
+}
+
+/* Runs at every preemption point: the AP advances and the interrupt
+ * producers fire at random.
+ */
+static void preempt_hook()
+{
+  if ((unsigned int)(rand() % preempt_rate) != 0)
+    return;
+
+  switch (rand() % 4)
+  {
+    case 0:
+    case 1:
+      ap_poll();
+      break;
+    case 2:
+      host_irq_set_pending(2, isr_gpio);
+      break;
+    case 3:
+      host_irq_set_pending(1, isr_fdcan);
+      break;
+  }
+}
+
+static bool is_drained()
+{
+  for (uint8_t i = 0; i < STRESS_PRODUCERS; i++)
+  {
+    if (producers[i].received + producers[i].dropped < producers[i].seq)
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned int seed = 1;
+  bool is_single_phase = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:s:1")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': seq_limit = strtoul(optarg, NULL, 0); break;
+      case 'r': preempt_rate = strtoul(optarg, NULL, 0); break;
+      case 's': seed = strtoul(optarg, NULL, 0); break;
+      case '1': is_single_phase = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-n subpackets per producer] [-r preemption rate] [-s seed] [-1 single-phase]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (seq_limit > STRESS_MAX_SEQ)
+    seq_limit = STRESS_MAX_SEQ;
+  if (preempt_rate == 0)
+    preempt_rate = 1;
+  srand(seed);
+
+  for (uint8_t i = 0; i < STRESS_PRODUCERS; i++)
+    producers[i].seen = calloc(STRESS_MAX_SEQ / 8, 1);
+
+  firmware_init();
+  fake_ap_init(on_subpacket);
+
+  if (is_single_phase)
+  {
+    uint8_t const request[] = {PERIPH_H7, H7_SPI_TRANSFER_MODE, 1, 0, SPI_TRANSFER_SINGLE_PHASE};
+    fake_ap_transfer(request, sizeof(request));
+    while (!fake_ap_is_single_phase())
+    {
+      firmware_poll();
+      fake_ap_transfer(NULL, 0);
+    }
+  }
+
+  host_set_preempt_hook(preempt_hook);
+
+  bool is_done = false;
+  while (!is_done)
+  {
+    switch (rand() % 3)
+    {
+      case 0: produce_enqueue(0); break;
+      case 1: produce_reserve(1); break;
+      case 2: firmware_poll(); break;
+    }
+    host_preempt();
+
+    is_done = true;
+    for (uint8_t i = 0; i < STRESS_PRODUCERS; i++)
+      is_done = is_done && (producers[i].seq >= seq_limit);
+  }
+
+  is_producing = false;
+  for (uint32_t i = 0; i < STRESS_DRAIN_ITERATIONS && !is_drained(); i++)
+  {
+    firmware_poll();
+    ap_poll();
+    host_preempt();
+  }
+
+  struct tx_drop_stats drop_stats;
+  tx_get_drop_stats(&drop_stats);
+  struct fake_ap_stats ap_stats;
+  fake_ap_get_stats(&ap_stats);
+
+  printf("%-14s %10s %10s %10s %10s\n", "producer", "sent", "received", "dropped", "rejected");
+  for (uint8_t i = 0; i < STRESS_PRODUCERS; i++)
+  {
+    struct producer const * p = &producers[i];
+    printf("%-14s %10u %10u %10u %10u\n", p->name, p->seq, p->received, p->dropped, p->rejected);
+
+    if (p->received + p->dropped != p->seq)
+      error("producer %d: %u subpackets lost", i, p->seq - p->received - p->dropped);
+    if (p->dropped != drop_stats.dropped[p->peripheral])
+      error("producer %d: drop statistics mismatch (%u)", i, drop_stats.dropped[p->peripheral]);
+  }
+  printf("transfers %u, mode %s, checksum errors %u, framing errors %u\n",
+         ap_stats.transfers, fake_ap_is_single_phase() ? "single-phase" : "two-phase",
+         ap_stats.checksum_errors, ap_stats.framing_errors);
+
+  errors += ap_stats.checksum_errors + ap_stats.framing_errors;
+  printf("%s\n", errors ? "FAIL" : "PASS");
+  return errors ? 1 : 0;
+}
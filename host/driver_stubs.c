@@ -0,0 +1,342 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "firmware.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "adc.h"
+#include "can.h"
+#include "gpio.h"
+#include "m4_util.h"
+#include "pwm.h"
+#include "rpc.h"
+#include "rtc.h"
+#include "virtual_uart.h"
+#include "ringbuffer.h"
+#include "system.h"
+#include "opcodes.h"
+#include "peripherals.h"
+#include "error_handler.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Same depth as RxFifo0ElmtsNbr in can_init(). */
+#define HOST_CAN_RX_FIFO_SIZE (64)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct host_can_frame
+{
+  uint32_t id;
+  uint8_t len;
+  uint8_t flags;
+  uint32_t timestamp;
+  uint8_t data[X8H7_CANFD_FRAME_MAX_DATA_LEN];
+};
+
+struct host_can
+{
+  struct host_can_frame fifo[HOST_CAN_RX_FIFO_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t bytes;
+  bool is_loopback;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+/* The drivers below the *_handler.c files are not part of the host build,
+ * they are replaced by the minimum the protocol core needs to run.
+ */
+
+FDCAN_HandleTypeDef fdcan_1;
+FDCAN_HandleTypeDef fdcan_2;
+
+struct GPIO_numbers GPIO_pinmap[] = {
+  // GPIOs
+  { GPIOF, GPIO_PIN_8 },
+  { GPIOF, GPIO_PIN_6 },
+  { GPIOF, GPIO_PIN_3 },
+  { GPIOF, GPIO_PIN_4 },
+  { GPIOF, GPIO_PIN_12 },
+  { GPIOE, GPIO_PIN_10 },
+  { GPIOE, GPIO_PIN_11 },
+  // ADCs
+  { GPIOF, GPIO_PIN_11 },
+  { GPIOA, GPIO_PIN_6 },
+  { GPIOF, GPIO_PIN_13 },
+  { GPIOB, GPIO_PIN_1 },
+  { GPIOC, GPIO_PIN_4 },
+  { GPIOF, GPIO_PIN_7 },
+  { GPIOF, GPIO_PIN_9 },
+  { GPIOF, GPIO_PIN_5 },
+  // FDCAN1
+  { GPIOD, GPIO_PIN_1 },
+  { GPIOD, GPIO_PIN_0 },
+  // FDCAN1
+  { GPIOB, GPIO_PIN_6 },
+  { GPIOB, GPIO_PIN_5 },
+  // USART2
+  { GPIOD, GPIO_PIN_5 },
+  { GPIOD, GPIO_PIN_6 },
+  { GPIOD, GPIO_PIN_4 },
+  { GPIOD, GPIO_PIN_3 },
+  // PWM
+  { GPIOC, GPIO_PIN_7 },
+  { GPIOA, GPIO_PIN_9 },
+  { GPIOA, GPIO_PIN_10 },
+  { GPIOB, GPIO_PIN_10 },
+  { GPIOA, GPIO_PIN_11 },
+  { GPIOD, GPIO_PIN_15 },
+  { GPIOA, GPIO_PIN_8 },
+  { GPIOC, GPIO_PIN_6 },
+  { GPIOA, GPIO_PIN_12 },
+  { GPIOC, GPIO_PIN_8 },
+};
+
+struct IRQ_numbers IRQ_pinmap[16];
+
+static struct host_can host_can[2];
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+void Error_Handler_Func(const char * func, const char * fmt, ...)
+{
+  fprintf(stderr, "%s: ", func);
+
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+
+  abort();
+}
+
+/**************************************************************************************
+ * VIRTUAL UART
+ **************************************************************************************/
+
+int virtual_uart_data_available()
+{
+  return 0;
+}
+
+int virtual_uart_handle_data(uint16_t const max_bytes)
+{
+  return 0;
+}
+
+void serial_rpc_write(uint8_t const * buf, size_t len)
+{
+}
+
+/**************************************************************************************
+ * FDCAN
+ **************************************************************************************/
+
+/* FDCAN in internal loopback: written frames end up in a software RX FIFO. */
+
+void HAL_FDCAN_IRQHandler(FDCAN_HandleTypeDef *hfdcan)
+{
+}
+
+static inline uint8_t host_can_index(FDCAN_HandleTypeDef * handle)
+{
+  return (handle == &fdcan_1) ? 0 : 1;
+}
+
+int can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+             uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width,
+             struct can_ram_profile const * profile)
+{
+  struct host_can * can = &host_can[host_can_index(handle)];
+  can->head = can->tail = 0;
+  can->bytes = 0;
+  can->is_loopback = false;
+  return 1;
+}
+
+void can_deinit(FDCAN_HandleTypeDef * handle)
+{
+}
+
+int can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+                      uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width)
+{
+  return 1;
+}
+
+int can_set_loopback(FDCAN_HandleTypeDef * handle, bool const is_loopback)
+{
+  host_can[host_can_index(handle)].is_loopback = is_loopback;
+  return 1;
+}
+
+int can_filter(FDCAN_HandleTypeDef * handle, uint32_t const filter_index, uint32_t const id, uint32_t const mask, bool const is_extended_id)
+{
+  return 1;
+}
+
+uint32_t can_tx_fifo_available(FDCAN_HandleTypeDef * handle)
+{
+  return 32;
+}
+
+/* Bytes, as counted by the RX ring buffer of can.c. */
+uint32_t can_rx_fifo_available(FDCAN_HandleTypeDef * handle)
+{
+  return host_can[host_can_index(handle)].bytes;
+}
+
+bool can_rx_overrun(FDCAN_HandleTypeDef * handle)
+{
+  return false;
+}
+
+int can_rx_peek(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags)
+{
+  struct host_can const * can = &host_can[host_can_index(handle)];
+  if (can->head == can->tail)
+    return 0;
+
+  struct host_can_frame const * frame = &can->fifo[can->tail % HOST_CAN_RX_FIFO_SIZE];
+  *id = frame->id;
+  *len = frame->len;
+  *flags = frame->flags;
+  return 1;
+}
+
+bool host_can_receive(uint8_t const bus, uint32_t const id, uint8_t const len, uint8_t const flags, uint32_t const timestamp, uint8_t const * data)
+{
+  struct host_can * can = &host_can[bus ? 1 : 0];
+  if ((can->head - can->tail) == HOST_CAN_RX_FIFO_SIZE)
+    return false;
+
+  struct host_can_frame * frame = &can->fifo[can->head++ % HOST_CAN_RX_FIFO_SIZE];
+  uint8_t const max_len = (flags & CANFD_FDF) ? X8H7_CANFD_FRAME_MAX_DATA_LEN : X8H7_CAN_FRAME_MAX_DATA_LEN;
+  frame->id = id;
+  frame->len = (len > max_len) ? max_len : len;
+  frame->flags = flags;
+  frame->timestamp = timestamp;
+  memcpy(frame->data, data, frame->len);
+  can->bytes += CAN_RX_FRAME_OVERHEAD + frame->len;
+  return true;
+}
+
+int can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const flags, uint8_t const * data)
+{
+  if (host_can[host_can_index(handle)].is_loopback)
+    host_can_receive(host_can_index(handle), id, len, flags, cycle_counter_get(), data);
+  return 0;
+}
+
+int can_read(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags, uint32_t * timestamp, uint8_t * data)
+{
+  struct host_can * can = &host_can[host_can_index(handle)];
+  if (can->head == can->tail)
+    return 0;
+
+  struct host_can_frame const * frame = &can->fifo[can->tail++ % HOST_CAN_RX_FIFO_SIZE];
+  *id = frame->id;
+  *len = frame->len;
+  *flags = frame->flags;
+  *timestamp = frame->timestamp;
+  memcpy(data, frame->data, frame->len);
+  can->bytes -= CAN_RX_FRAME_OVERHEAD + frame->len;
+  return 1;
+}
+
+/**************************************************************************************
+ * GPIO, ADC, PWM, RTC, M4
+ **************************************************************************************/
+
+uint8_t GPIO_PIN_to_index(uint32_t pin)
+{
+  uint8_t index = 0;
+  while (pin >>= 1) {
+    index++;
+  }
+  return index;
+}
+
+int gpio_handle_data()
+{
+  return 0;
+}
+
+void gpio_enable_irq(uint8_t pin)
+{
+}
+
+void gpio_disable_irq(uint8_t pin)
+{
+}
+
+void gpio_set_handler(uint8_t pin)
+{
+}
+
+int get_adc_value(enum AnalogPins name)
+{
+  return 0;
+}
+
+void configurePwm(uint8_t channel, bool enable, bool polarity, uint32_t duty_ns, uint32_t period_ns)
+{
+}
+
+void capturePwm(uint8_t channel)
+{
+}
+
+bool isValidPwmChannelNumber(unsigned int const channel_number)
+{
+  return channel_number < 10;
+}
+
+int rtc_set_date(uint8_t const * data)
+{
+  return 0;
+}
+
+int rtc_get_date()
+{
+  struct rtc_time t = {0};
+  return enqueue_packet(PERIPH_RTC, GET_DATE, sizeof(t), &t);
+}
+
+int is_m4_booted_correctly()
+{
+  return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "fake_ap.h"
+
+#include <string.h>
+
+#include "spi.h"
+#include "system.h"
+#include "opcodes.h"
+#include "peripherals.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Priority of DMA1_Stream0/1, see MX_DMA_Init(). */
+#define FAKE_AP_DMA_PRIORITY  (0)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+typedef enum
+{
+  AP_Idle, AP_HeaderSelect, AP_HeaderClock, AP_HeaderDone, AP_DataSelect, AP_DataClock, AP_SingleSelect, AP_SingleClock, AP_SingleDone
+} eApState;
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+static uint8_t ap_tx[SPI_DMA_BUFFER_SIZE];
+static uint8_t ap_rx[SPI_DMA_BUFFER_SIZE];
+static uint16_t ap_tx_size = 0;
+static uint16_t ap_h7_size = 0;
+static uint16_t ap_len = 0;
+static eApState ap_state = AP_Idle;
+static bool ap_is_single_phase = false;
+
+static FakeApSubpacketFunc ap_on_subpacket = NULL;
+static struct fake_ap_stats ap_stats;
+
+/* Referenced by stm32h7xx_it.c, the SPI interrupts are raised here instead. */
+SPI_HandleTypeDef hspi3;
+DMA_HandleTypeDef hdma_spi3_tx;
+DMA_HandleTypeDef hdma_spi3_rx;
+
+/* DMA as armed by the H7 via spi_transmit_receive(). */
+static uint8_t * dma_tx = NULL;
+static uint8_t * dma_rx = NULL;
+static uint16_t dma_size = 0;
+static uint16_t dma_remaining = 0;
+static bool dma_is_armed = false;
+
+/**************************************************************************************
+ * SPI
+ **************************************************************************************/
+
+void spi_init()
+{
+}
+
+void spi_end()
+{
+  dma_is_armed = false;
+}
+
+void spi_transmit_receive(uint8_t * tx_buf, uint8_t * rx_buf, uint16_t size)
+{
+  dma_tx = tx_buf;
+  dma_rx = rx_buf;
+  dma_size = size;
+  dma_remaining = size;
+  dma_is_armed = true;
+}
+
+uint16_t spi_rx_remaining()
+{
+  return dma_remaining;
+}
+
+void HAL_SPI_IRQHandler(SPI_HandleTypeDef *hspi)
+{
+}
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+static void fake_ap_dma_isr()
+{
+  HAL_SPI_TxRxCpltCallback(NULL);
+}
+
+static void fake_ap_cs(GPIO_PinState const state)
+{
+  if (state == GPIO_PIN_RESET)
+    ap_stats.cs_cycles++;
+  host_gpio_drive(GPIOA, GPIO_PIN_15, state);
+}
+
+/* Clocks bytes full duplex, ap_offset is the position within the AP buffers. */
+static void fake_ap_clock(uint16_t const ap_offset, uint16_t const bytes, bool const is_dma_complete)
+{
+  memcpy(dma_rx, ap_tx + ap_offset, bytes);
+  memcpy(ap_rx + ap_offset, dma_tx, bytes);
+  dma_remaining -= bytes;
+  if (is_dma_complete) {
+    dma_is_armed = false;
+    host_irq_set_pending(FAKE_AP_DMA_PRIORITY, fake_ap_dma_isr);
+    host_irq_dispatch();
+  }
+}
+
+static uint16_t fake_ap_h7_size()
+{
+  uint16_t const size = ap_rx[0] | (ap_rx[1] << 8);
+  uint16_t const checksum = ap_rx[2] | (ap_rx[3] << 8);
+
+  if (size != 0 && (size ^ 0x5555) != checksum) {
+    ap_stats.checksum_errors++;
+    return 0;
+  }
+  return (size > TX_SUPERFRAME_MAX_SIZE) ? TX_SUPERFRAME_MAX_SIZE : size;
+}
+
+static void fake_ap_parse(uint16_t const size)
+{
+  ap_stats.bytes_rx += 4 + size;
+
+  for (uint16_t offset = 0; offset < size; )
+  {
+    uint8_t const * subpkt = ap_rx + 4 + offset;
+    uint16_t const subpkt_size = subpkt[2] | (subpkt[3] << 8);
+
+    if (offset + 4 + subpkt_size > size) {
+      ap_stats.framing_errors++;
+      return;
+    }
+
+    /* The kernel driver switches once the H7 has acknowledged. */
+    if (subpkt[0] == PERIPH_H7 && subpkt[1] == H7_SPI_TRANSFER_MODE && subpkt_size >= 1)
+      ap_is_single_phase = (subpkt[4] == SPI_TRANSFER_SINGLE_PHASE);
+
+    /* Peripheral 0x00 ends a superframe, the H7 must not send it. */
+    if (subpkt[0] == PERIPH_Reserved_0) {
+      ap_stats.framing_errors++;
+      return;
+    }
+
+    ap_stats.subpackets_rx++;
+    if (ap_on_subpacket)
+      ap_on_subpacket(subpkt[0], subpkt[1], subpkt + 4, subpkt_size);
+
+    offset += 4 + subpkt_size;
+  }
+}
+
+void fake_ap_init(FakeApSubpacketFunc const on_subpacket)
+{
+  ap_on_subpacket = on_subpacket;
+  memset(&ap_stats, 0, sizeof(ap_stats));
+
+  /* CS idles high, the H7 listens for its falling edge. */
+  host_gpio_drive(GPIOA, GPIO_PIN_15, GPIO_PIN_SET);
+  EXTI->FTSR1 |= EXTI_FTSR1_TR15;
+}
+
+void fake_ap_start(uint8_t const * data, uint16_t const size)
+{
+  ap_tx_size = (size > RX_SUPERFRAME_MAX_SIZE) ? RX_SUPERFRAME_MAX_SIZE : size;
+  ap_tx[0] = ap_tx_size & 0xFF;
+  ap_tx[1] = ap_tx_size >> 8;
+  uint16_t const checksum = ap_tx_size ? (ap_tx_size ^ 0x5555) : 0;
+  ap_tx[2] = checksum & 0xFF;
+  ap_tx[3] = checksum >> 8;
+  memcpy(ap_tx + 4, data, ap_tx_size);
+  memset(ap_tx + 4 + ap_tx_size, 0, sizeof(ap_tx) - 4 - ap_tx_size);
+
+  ap_stats.bytes_tx += 4 + ap_tx_size;
+  ap_state = ap_is_single_phase ? AP_SingleSelect : AP_HeaderSelect;
+}
+
+bool fake_ap_step()
+{
+  switch (ap_state)
+  {
+    case AP_Idle:
+      return true;
+
+    case AP_HeaderSelect:
+      fake_ap_cs(GPIO_PIN_RESET);
+      ap_state = AP_HeaderClock;
+      break;
+
+    case AP_HeaderClock:
+      if (!dma_is_armed)
+        break;
+      fake_ap_clock(0, 4, true);
+      fake_ap_cs(GPIO_PIN_SET);
+      ap_state = AP_HeaderDone;
+      break;
+
+    case AP_HeaderDone:
+    {
+      ap_h7_size = fake_ap_h7_size();
+      ap_len = max(ap_tx_size, ap_h7_size);
+      if (ap_len == 0) {
+        fake_ap_parse(0);
+        ap_state = AP_Idle;
+      }
+      else
+        ap_state = AP_DataSelect;
+      break;
+    }
+
+    case AP_DataSelect:
+      fake_ap_cs(GPIO_PIN_RESET);
+      ap_state = AP_DataClock;
+      break;
+
+    case AP_DataClock:
+      /* The data phase may be held back by a producer still writing into
+       * the TX buffer, the kernel driver relies on the CS-to-SCK delay.
+       */
+      if (!dma_is_armed)
+        break;
+      fake_ap_clock(4, (ap_len < dma_size) ? ap_len : dma_size, true);
+      fake_ap_cs(GPIO_PIN_SET);
+      fake_ap_parse(ap_h7_size);
+      ap_state = AP_Idle;
+      break;
+
+    case AP_SingleSelect:
+      fake_ap_cs(GPIO_PIN_RESET);
+      ap_state = AP_SingleClock;
+      break;
+
+    case AP_SingleClock:
+    {
+      if (!dma_is_armed)
+        break;
+      /* Clocking the first chunk yields the H7 header, the rest follows
+       * within the same CS cycle.
+       */
+      memcpy(ap_rx, dma_tx, 4);
+      uint16_t const h7_size = fake_ap_h7_size();
+      uint32_t bytes = 4 + max(ap_tx_size, h7_size);
+      if (bytes < FAKE_AP_SINGLE_PHASE_CHUNK)
+        bytes = FAKE_AP_SINGLE_PHASE_CHUNK;
+      if (bytes > dma_size)
+        bytes = dma_size;
+      fake_ap_clock(0, bytes, false);
+      fake_ap_cs(GPIO_PIN_SET);
+      fake_ap_parse(h7_size);
+      ap_state = AP_SingleDone;
+      break;
+    }
+
+    case AP_SingleDone:
+      /* CS stays released until the H7 has taken the rising edge, a new
+       * falling edge before that would be merged with it.
+       */
+      if (dma_is_armed)
+        break;
+      ap_state = AP_Idle;
+      break;
+  }
+
+  if (ap_state == AP_Idle)
+  {
+    ap_stats.transfers++;
+    return true;
+  }
+  return false;
+}
+
+bool fake_ap_is_busy()
+{
+  return ap_state != AP_Idle;
+}
+
+void fake_ap_transfer(uint8_t const * data, uint16_t const size)
+{
+  fake_ap_start(data, size);
+  while (!fake_ap_step()) { }
+}
+
+bool fake_ap_is_irq_asserted()
+{
+  return host_gpio_read(GPIOC, GPIO_PIN_1) == GPIO_PIN_RESET;
+}
+
+bool fake_ap_is_single_phase()
+{
+  return ap_is_single_phase;
+}
+
+void fake_ap_get_stats(struct fake_ap_stats * stats)
+{
+  *stats = ap_stats;
+}
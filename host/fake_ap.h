@@ -0,0 +1,82 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAKE_AP_H
+#define FAKE_AP_H
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Bytes clocked by the AP before it knows the H7 superframe length in
+ * single-phase mode.
+ */
+#define FAKE_AP_SINGLE_PHASE_CHUNK  (64)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+/* Invoked for every subpacket of a superframe received from the H7. */
+typedef void(*FakeApSubpacketFunc)(uint8_t const peripheral, uint8_t const opcode, uint8_t const * data, uint16_t const size);
+
+struct fake_ap_stats {
+  uint32_t transfers;
+  uint32_t cs_cycles;
+  uint64_t bytes_tx;        /* Superframe bytes sent to the H7, headers included. */
+  uint64_t bytes_rx;        /* Superframe bytes received from the H7, headers included. */
+  uint32_t subpackets_rx;
+  uint32_t checksum_errors; /* Superframe headers with a bad checksum. */
+  uint32_t framing_errors;  /* Subpackets exceeding the announced superframe length or of peripheral 0x00. */
+};
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+/* The fake i.MX8 takes the place of spi.c: it drives CS and clocks the
+ * buffers handed to spi_transmit_receive() exactly as the kernel driver
+ * does, raising the DMA completion interrupt afterwards.
+ */
+void fake_ap_init(FakeApSubpacketFunc const on_subpacket);
+
+/* Queues a superframe (subpackets only, the header is added) to be sent
+ * with the next transfer.
+ */
+void fake_ap_start(uint8_t const * data, uint16_t const size);
+/* Advances the transfer by one step, e.g. one CS edge or one DMA transfer,
+ * returns true once it is complete. Steps needing the H7 to arm its DMA
+ * first are retried on the next call.
+ */
+bool fake_ap_step();
+bool fake_ap_is_busy();
+/* fake_ap_start() + fake_ap_step() until done. */
+void fake_ap_transfer(uint8_t const * data, uint16_t const size);
+
+bool fake_ap_is_irq_asserted();
+bool fake_ap_is_single_phase();
+void fake_ap_get_stats(struct fake_ap_stats * stats);
+
+#endif //FAKE_AP_H
@@ -0,0 +1,448 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "fake_uart.h"
+
+#include <string.h>
+
+#include "stm32h7xx_it.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Priority of USART2_IRQn and DMA1_Stream2/3, see HAL_UART_MspInit(). */
+#define FAKE_UART_IRQ_PRIORITY    (2)
+/* Runs of USART2_IRQHandler() after which an interrupt it does not clear
+ * is considered stuck.
+ */
+#define FAKE_UART_IRQ_STORM       (100)
+#define FAKE_UART_TX_CAPTURE_SIZE (64 * 1024)
+
+#define FAKE_UART_DMA_HT          (1 << 0)
+#define FAKE_UART_DMA_TC          (1 << 1)
+
+/* The ICR bits which clear the ISR flag at the same position. */
+#define FAKE_UART_ICR_MASK        (USART_ICR_PECF | USART_ICR_FECF | USART_ICR_NECF | USART_ICR_ORECF | \
+                                   USART_ICR_IDLECF | USART_ICR_TCCF | USART_ICR_RTOCF)
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+USART_TypeDef      host_usart2;
+DMA_Stream_TypeDef host_dma1_stream2;
+DMA_Stream_TypeDef host_dma1_stream3;
+
+const uint16_t UARTPrescTable[12] = {1U, 2U, 4U, 6U, 8U, 10U, 12U, 16U, 32U, 64U, 128U, 256U};
+
+extern UART_HandleTypeDef huart2;
+
+static struct fake_uart_stats uart_stats;
+/* Events of the RX DMA not yet taken by HAL_DMA_IRQHandler(). */
+static uint32_t uart_dma_rx_events = 0;
+/* Consecutive runs of USART2_IRQHandler() which left the interrupt asserted. */
+static uint32_t uart_irq_runs = 0;
+
+static uint8_t uart_tx_capture[FAKE_UART_TX_CAPTURE_SIZE];
+static uint32_t uart_tx_capture_head = 0;
+static uint32_t uart_tx_capture_tail = 0;
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+void host_usart_clear_flag(USART_TypeDef * usart, uint32_t const flags)
+{
+  usart->ISR &= ~(flags & FAKE_UART_ICR_MASK);
+}
+
+static bool fake_uart_is_irq_asserted()
+{
+  uint32_t const isr = host_usart2.ISR;
+  uint32_t const cr1 = host_usart2.CR1;
+  uint32_t const cr3 = host_usart2.CR3;
+
+  return ((isr & USART_ISR_IDLE) && (cr1 & USART_CR1_IDLEIE)) ||
+         ((isr & USART_ISR_RTOF) && (cr1 & USART_CR1_RTOIE)) ||
+         ((isr & USART_ISR_TC) && (cr1 & USART_CR1_TCIE)) ||
+         ((isr & USART_ISR_PE) && (cr1 & USART_CR1_PEIE)) ||
+         ((isr & (USART_ISR_FE | USART_ISR_NE | USART_ISR_ORE)) && (cr3 & USART_CR3_EIE));
+}
+
+static void fake_uart_isr()
+{
+  uart_stats.irqs++;
+  USART2_IRQHandler();
+
+  if (!fake_uart_is_irq_asserted()) {
+    uart_irq_runs = 0;
+    return;
+  }
+
+  /* The interrupt is level triggered, its cause has not been cleared. */
+  if (++uart_irq_runs < FAKE_UART_IRQ_STORM) {
+    host_irq_set_pending(FAKE_UART_IRQ_PRIORITY, fake_uart_isr);
+    return;
+  }
+  uart_stats.irq_storms++;
+  uart_irq_runs = 0;
+}
+
+static void fake_uart_raise()
+{
+  if (!fake_uart_is_irq_asserted())
+    return;
+  host_irq_set_pending(FAKE_UART_IRQ_PRIORITY, fake_uart_isr);
+  host_irq_dispatch();
+}
+
+static void fake_uart_dma_rx_isr()
+{
+  DMA1_Stream2_IRQHandler();
+}
+
+static void fake_uart_dma_tx_isr()
+{
+  DMA1_Stream3_IRQHandler();
+}
+
+static void fake_uart_dma_rx_event(uint32_t const event)
+{
+  uart_dma_rx_events |= event;
+  host_irq_set_pending(FAKE_UART_IRQ_PRIORITY, fake_uart_dma_rx_isr);
+  host_irq_dispatch();
+}
+
+void fake_uart_receive(uint8_t const * data, uint16_t const size, uint32_t const errors)
+{
+  UART_HandleTypeDef * const huart = &huart2;
+  DMA_Stream_TypeDef * const dma = &host_dma1_stream2;
+
+  uart_stats.bytes_rx += size;
+  for (uint16_t i = 0; i < size; i++)
+  {
+    bool const is_enabled = (host_usart2.CR1 & (USART_CR1_UE | USART_CR1_RE)) == (USART_CR1_UE | USART_CR1_RE);
+    if (!is_enabled || !(host_usart2.CR3 & USART_CR3_DMAR) || !(dma->CR & DMA_SxCR_EN) || dma->NDTR == 0) {
+      uart_stats.bytes_lost++;
+      if (is_enabled)
+        host_usart2.ISR |= USART_ISR_ORE;
+      continue;
+    }
+
+    huart->pRxBuffPtr[huart->RxXferSize - dma->NDTR] = data[i];
+    dma->NDTR--;
+    if (dma->NDTR == huart->RxXferSize / 2) {
+      fake_uart_dma_rx_event(FAKE_UART_DMA_HT);
+    }
+    else if (dma->NDTR == 0) {
+      if (huart->hdmarx->Init.Mode == DMA_CIRCULAR)
+        dma->NDTR = huart->RxXferSize;
+      else
+        dma->CR &= ~DMA_SxCR_EN;
+      fake_uart_dma_rx_event(FAKE_UART_DMA_TC);
+    }
+  }
+
+  host_usart2.ISR |= errors | USART_ISR_IDLE;
+  if (host_usart2.CR2 & USART_CR2_RTOEN)
+    host_usart2.ISR |= USART_ISR_RTOF;
+  fake_uart_raise();
+}
+
+uint32_t fake_uart_take_tx(uint8_t * data, uint32_t const size)
+{
+  uint32_t cnt = 0;
+  for (; cnt < size && uart_tx_capture_tail != uart_tx_capture_head; cnt++)
+    data[cnt] = uart_tx_capture[uart_tx_capture_tail++ % FAKE_UART_TX_CAPTURE_SIZE];
+  return cnt;
+}
+
+void fake_uart_get_stats(struct fake_uart_stats * stats)
+{
+  memcpy(stats, &uart_stats, sizeof(uart_stats));
+}
+
+/**************************************************************************************
+ * HAL
+ **************************************************************************************/
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+  hdma->State = HAL_DMA_STATE_READY;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma)
+{
+  ((DMA_Stream_TypeDef *)hdma->Instance)->CR &= ~DMA_SxCR_EN;
+  hdma->State = HAL_DMA_STATE_RESET;
+  return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+  UART_HandleTypeDef * const huart = (UART_HandleTypeDef *)hdma->Parent;
+
+  if (hdma->Instance == DMA1_Stream2)
+  {
+    uint32_t const events = uart_dma_rx_events;
+    uart_dma_rx_events = 0;
+
+    /* As UART_DMARxHalfCplt() and UART_DMAReceiveCplt() do for a
+     * reception to idle in circular mode.
+     */
+    if (huart->ReceptionType != HAL_UART_RECEPTION_TOIDLE)
+      return;
+    if (events & FAKE_UART_DMA_HT)
+      HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize / 2);
+    if (events & FAKE_UART_DMA_TC)
+      HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize);
+  }
+  else if (hdma->Instance == DMA1_Stream3)
+  {
+    /* As UART_DMATransmitCplt(), the transfer ends with the TC interrupt. */
+    huart->TxXferCount = 0;
+    ATOMIC_CLEAR_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+    ATOMIC_SET_BIT(huart->Instance->CR1, USART_CR1_TCIE);
+    fake_uart_raise();
+  }
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+  if (huart->gState == HAL_UART_STATE_RESET) {
+    huart->Lock = HAL_UNLOCKED;
+    HAL_UART_MspInit(huart);
+  }
+
+  USART_TypeDef * const usart = huart->Instance;
+  usart->CR1 = huart->Init.WordLength | huart->Init.Parity | huart->Init.Mode | huart->Init.OverSampling;
+  usart->CR2 = huart->Init.StopBits;
+  usart->CR3 = huart->Init.HwFlowCtl | huart->Init.OneBitSampling;
+  usart->BRR = UART_DIV_SAMPLING16(HAL_RCC_GetPCLK1Freq(), huart->Init.BaudRate, huart->Init.ClockPrescaler);
+  usart->ISR = USART_ISR_TC | USART_ISR_TXE_TXFNF | USART_ISR_TEACK | USART_ISR_REACK;
+  usart->CR1 |= USART_CR1_UE;
+
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_READY;
+  huart->RxState = HAL_UART_STATE_READY;
+  huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RS485Ex_Init(UART_HandleTypeDef *huart, uint32_t Polarity, uint32_t AssertionTime, uint32_t DeassertionTime)
+{
+  HAL_StatusTypeDef const status = HAL_UART_Init(huart);
+  huart->Instance->CR3 |= USART_CR3_DEM;
+  return status;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+  huart->gState = HAL_UART_STATE_BUSY;
+  huart->Instance->CR1 = 0;
+  huart->Instance->CR2 = 0;
+  huart->Instance->CR3 = 0;
+
+  HAL_UART_MspDeInit(huart);
+
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_RESET;
+  huart->RxState = HAL_UART_STATE_RESET;
+  huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_SetTxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_SetRxFifoThreshold(UART_HandleTypeDef *huart, uint32_t Threshold)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_EnableFifoMode(UART_HandleTypeDef *huart)
+{
+  huart->FifoMode = UART_FIFOMODE_ENABLE;
+  return HAL_OK;
+}
+
+void HAL_UART_ReceiverTimeout_Config(UART_HandleTypeDef *huart, uint32_t TimeoutValue)
+{
+  MODIFY_REG(huart->Instance->RTOR, USART_RTOR_RTO, TimeoutValue);
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+  if (huart->RxState != HAL_UART_STATE_READY)
+    return HAL_BUSY;
+  if (pData == NULL || Size == 0)
+    return HAL_ERROR;
+
+  huart->ReceptionType = HAL_UART_RECEPTION_TOIDLE;
+  huart->pRxBuffPtr = pData;
+  huart->RxXferSize = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->RxState = HAL_UART_STATE_BUSY_RX;
+
+  DMA_Stream_TypeDef * const dma = (DMA_Stream_TypeDef *)huart->hdmarx->Instance;
+  dma->NDTR = Size;
+  dma->CR |= DMA_SxCR_EN;
+
+  /* As UART_Start_Receive_DMA(). */
+  __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF);
+  if (huart->Init.Parity != UART_PARITY_NONE)
+    ATOMIC_SET_BIT(huart->Instance->CR1, USART_CR1_PEIE);
+  ATOMIC_SET_BIT(huart->Instance->CR3, USART_CR3_EIE);
+  ATOMIC_SET_BIT(huart->Instance->CR3, USART_CR3_DMAR);
+
+  __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_IDLEF);
+  ATOMIC_SET_BIT(huart->Instance->CR1, USART_CR1_IDLEIE);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+  ATOMIC_CLEAR_BIT(huart->Instance->CR1, USART_CR1_RXNEIE_RXFNEIE | USART_CR1_PEIE);
+  ATOMIC_CLEAR_BIT(huart->Instance->CR3, USART_CR3_EIE | USART_CR3_RXFTIE);
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE)
+    ATOMIC_CLEAR_BIT(huart->Instance->CR1, USART_CR1_IDLEIE);
+
+  /* The stream keeps its counter once disabled. */
+  if (huart->Instance->CR3 & USART_CR3_DMAR) {
+    ATOMIC_CLEAR_BIT(huart->Instance->CR3, USART_CR3_DMAR);
+    ((DMA_Stream_TypeDef *)huart->hdmarx->Instance)->CR &= ~DMA_SxCR_EN;
+  }
+
+  __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_PEF | UART_CLEAR_FEF);
+  huart->RxState = HAL_UART_STATE_READY;
+  huart->ReceptionType = HAL_UART_RECEPTION_STANDARD;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size)
+{
+  if (huart->gState != HAL_UART_STATE_READY)
+    return HAL_BUSY;
+  if (pData == NULL || Size == 0)
+    return HAL_ERROR;
+
+  huart->pTxBuffPtr = pData;
+  huart->TxXferSize = Size;
+  huart->TxXferCount = Size;
+  huart->ErrorCode = HAL_UART_ERROR_NONE;
+  huart->gState = HAL_UART_STATE_BUSY_TX;
+
+  __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_TCF);
+  ATOMIC_SET_BIT(huart->Instance->CR3, USART_CR3_DMAT);
+
+  /* The line is not timed, the DMA hands over everything at once. */
+  for (uint16_t i = 0; i < Size; i++) {
+    if (uart_tx_capture_head - uart_tx_capture_tail < FAKE_UART_TX_CAPTURE_SIZE)
+      uart_tx_capture[uart_tx_capture_head++ % FAKE_UART_TX_CAPTURE_SIZE] = pData[i];
+  }
+  uart_stats.bytes_tx += Size;
+  huart->Instance->ISR |= USART_ISR_TC;
+
+  host_irq_set_pending(FAKE_UART_IRQ_PRIORITY, fake_uart_dma_tx_isr);
+  host_irq_dispatch();
+  return HAL_OK;
+}
+
+__weak void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+}
+
+/* The paths of the HAL which uart.c relies on, including that any error
+ * flag takes the error path as soon as one of the listed interrupts is
+ * enabled, and that only the flags of enabled error interrupts are
+ * cleared there.
+ */
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+  uint32_t const isrflags = huart->Instance->ISR;
+  uint32_t const cr1its = huart->Instance->CR1;
+  uint32_t const cr3its = huart->Instance->CR3;
+  uint32_t const errorflags = isrflags & (USART_ISR_PE | USART_ISR_FE | USART_ISR_ORE | USART_ISR_NE | USART_ISR_RTOF);
+
+  if (errorflags != 0U &&
+      ((cr3its & (USART_CR3_RXFTIE | USART_CR3_EIE)) || (cr1its & (USART_CR1_RXNEIE_RXFNEIE | USART_CR1_PEIE | USART_CR1_RTOIE))))
+  {
+    if ((isrflags & USART_ISR_PE) && (cr1its & USART_CR1_PEIE)) {
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_PEF);
+      huart->ErrorCode |= HAL_UART_ERROR_PE;
+    }
+    if ((isrflags & USART_ISR_FE) && (cr3its & USART_CR3_EIE)) {
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_FEF);
+      huart->ErrorCode |= HAL_UART_ERROR_FE;
+    }
+    if ((isrflags & USART_ISR_NE) && (cr3its & USART_CR3_EIE)) {
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_NEF);
+      huart->ErrorCode |= HAL_UART_ERROR_NE;
+    }
+    if ((isrflags & USART_ISR_ORE) && ((cr1its & USART_CR1_RXNEIE_RXFNEIE) || (cr3its & (USART_CR3_RXFTIE | USART_CR3_EIE)))) {
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_OREF);
+      huart->ErrorCode |= HAL_UART_ERROR_ORE;
+    }
+    if ((isrflags & USART_ISR_RTOF) && (cr1its & USART_CR1_RTOIE)) {
+      __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_RTOF);
+      huart->ErrorCode |= HAL_UART_ERROR_RTO;
+    }
+
+    if (huart->ErrorCode != HAL_UART_ERROR_NONE)
+    {
+      /* Errors in DMA reception, receiver timeouts and overruns abort the reception. */
+      if ((huart->Instance->CR3 & USART_CR3_DMAR) || (huart->ErrorCode & (HAL_UART_ERROR_RTO | HAL_UART_ERROR_ORE))) {
+        HAL_UART_AbortReceive(huart);
+        HAL_UART_ErrorCallback(huart);
+      }
+      else {
+        HAL_UART_ErrorCallback(huart);
+        huart->ErrorCode = HAL_UART_ERROR_NONE;
+      }
+    }
+    return;
+  }
+
+  if (huart->ReceptionType == HAL_UART_RECEPTION_TOIDLE && (isrflags & USART_ISR_IDLE) && (cr1its & USART_CR1_IDLEIE))
+  {
+    __HAL_UART_CLEAR_FLAG(huart, UART_CLEAR_IDLEF);
+
+    uint16_t const remaining = ((DMA_Stream_TypeDef *)huart->hdmarx->Instance)->NDTR;
+    if ((huart->Instance->CR3 & USART_CR3_DMAR) && remaining > 0U && remaining < huart->RxXferSize) {
+      huart->RxXferCount = remaining;
+      HAL_UARTEx_RxEventCallback(huart, huart->RxXferSize - huart->RxXferCount);
+    }
+    return;
+  }
+
+  if ((isrflags & USART_ISR_TC) && (cr1its & USART_CR1_TCIE))
+  {
+    /* As UART_EndTransmit_IT(). */
+    ATOMIC_CLEAR_BIT(huart->Instance->CR1, USART_CR1_TCIE);
+    huart->gState = HAL_UART_STATE_READY;
+    HAL_UART_TxCpltCallback(huart);
+  }
+}
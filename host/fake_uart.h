@@ -0,0 +1,61 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FAKE_UART_H
+#define FAKE_UART_H
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct fake_uart_stats {
+  uint64_t bytes_tx;    /* Bytes sent by the transmitter. */
+  uint64_t bytes_rx;    /* Bytes received on the line. */
+  uint32_t bytes_lost;  /* ... of which the RX DMA was not armed for. */
+  uint32_t irqs;        /* USART2 interrupts taken. */
+  uint32_t irq_storms;  /* USART2 interrupts still asserted after 100 runs of their handler. */
+};
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+/* USART2 with its RX and TX DMA streams, modelled at the register level
+ * below the UART HAL, so that uart.c runs unchanged. USART2_IRQHandler()
+ * is the one of stm32h7xx_it.c, HAL_UART_IRQHandler() follows the HAL
+ * closely enough to take the same paths on errors.
+ */
+
+/* Receives bytes on the line. The RX DMA writes them into the buffer armed
+ * with HAL_UARTEx_ReceiveToIdle_DMA(), raising its half and full transfer
+ * events. The ISR flags in errors (USART_ISR_PE, _FE, _NE, _ORE) are set
+ * with the last byte. The line goes idle afterwards.
+ */
+void fake_uart_receive(uint8_t const * data, uint16_t const size, uint32_t const errors);
+/* Takes up to size of the bytes sent by the transmitter. */
+uint32_t fake_uart_take_tx(uint8_t * data, uint32_t const size);
+void fake_uart_get_stats(struct fake_uart_stats * stats);
+
+#endif //FAKE_UART_H
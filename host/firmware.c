@@ -0,0 +1,77 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "firmware.h"
+
+#include "peripherals.h"
+#include "can_handler.h"
+#include "adc_handler.h"
+#include "uart.h"
+#include "uart_handler.h"
+#include "virtual_uart.h"
+#include "virtual_uart_handler.h"
+#include "pwm_handler.h"
+#include "gpio.h"
+#include "gpio_handler.h"
+#include "rtc_handler.h"
+#include "system.h"
+#include "h7_handler.h"
+#include "tx_scheduler.h"
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+void firmware_init()
+{
+  cycle_counter_init();
+  uart_init();
+
+  /* nIRQ idles high. */
+  HAL_GPIO_WritePin(GPIOC, GPIO_PIN_1, GPIO_PIN_SET);
+
+  peripheral_register_callback(PERIPH_H7, &h7_handler);
+  peripheral_register_callback(PERIPH_UART, &uart_handler);
+  peripheral_register_callback(PERIPH_VIRTUAL_UART, &virtual_uart_handler);
+  peripheral_register_callback(PERIPH_GPIO, &gpio_handler);
+  peripheral_register_callback(PERIPH_PWM, &pwm_handler);
+  peripheral_register_callback(PERIPH_RTC, &rtc_handler);
+  peripheral_register_callback(PERIPH_ADC, &adc_handler);
+  peripheral_register_callback(PERIPH_FDCAN1, &fdcan1_handler);
+  peripheral_register_callback(PERIPH_FDCAN2, &fdcan2_handler);
+
+  tx_scheduler_register(PERIPH_UART, &uart_data_available, &uart_handle_data);
+  tx_scheduler_register(PERIPH_VIRTUAL_UART, &virtual_uart_data_available, &virtual_uart_handle_data);
+  tx_scheduler_register(PERIPH_FDCAN1, &fdcan1_data_available, &fdcan1_handle_data);
+  tx_scheduler_register(PERIPH_FDCAN2, &fdcan2_data_available, &fdcan2_handle_data);
+}
+
+void firmware_poll()
+{
+  tx_spill_handle_data();
+  tx_scheduler_run();
+  gpio_handle_data();
+  dma_handle_data();
+
+  if (is_dma_transfer_complete() && is_tx_packet_due())
+    set_nirq_low();
+}
@@ -0,0 +1,42 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+/* Host counterparts of peripheral_init() and handle_data() in main.c. */
+void firmware_init();
+void firmware_poll();
+
+/* A frame received on the bus by FDCAN1 (bus 0) or FDCAN2 (bus 1), with the
+ * cycle counter at its reception. Returns false if the RX FIFO is full.
+ */
+bool host_can_receive(uint8_t const bus, uint32_t const id, uint8_t const len, uint8_t const flags, uint32_t const timestamp, uint8_t const * data);
+
+#endif //FIRMWARE_H
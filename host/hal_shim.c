@@ -0,0 +1,323 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "hal_shim.h"
+
+#include <time.h>
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+#define HOST_IRQ_MAX        (8)
+#define HOST_THREAD_LEVEL   (0x100)
+#define HOST_GPIO_PORTS     (11)
+
+/* Priority of EXTI15_10, see gpio_init(). */
+#define HOST_EXTI15_10_PRIORITY  (3)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct host_irq
+{
+  void(*isr)();
+  uint8_t priority;
+  bool is_pending;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+uint32_t SystemCoreClock = 480000000;
+
+CoreDebug_Type host_core_debug;
+EXTI_TypeDef   host_exti;
+RCC_TypeDef    host_rcc;
+uint32_t       host_uid[3] = {0x00480038, 0x33385115, 0x31363432};
+
+static DWT_Type host_dwt_regs;
+static uint64_t host_time_skipped_ns = 0;
+
+static uint32_t host_primask = 0;
+static volatile uint32_t * host_exclusive = NULL;
+/* Priority of the running context, HOST_THREAD_LEVEL outside any isr. */
+static uint16_t host_level = HOST_THREAD_LEVEL;
+
+static struct host_irq host_irqs[HOST_IRQ_MAX];
+static uint8_t host_irqs_num = 0;
+
+static HostPreemptHook host_hook = NULL;
+static bool host_is_in_hook = false;
+
+static uint16_t host_gpio[HOST_GPIO_PORTS];
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+void EXTI15_10_IRQHandler(void);
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+void host_set_preempt_hook(HostPreemptHook const hook)
+{
+  host_hook = hook;
+}
+
+void host_irq_set_pending(uint8_t const priority, void(*isr)())
+{
+  for (uint8_t i = 0; i < host_irqs_num; i++)
+  {
+    if (host_irqs[i].isr == isr) {
+      host_irqs[i].is_pending = true;
+      return;
+    }
+  }
+
+  if (host_irqs_num < HOST_IRQ_MAX)
+    host_irqs[host_irqs_num++] = (struct host_irq){isr, priority, true};
+}
+
+void host_irq_dispatch()
+{
+  for (;;)
+  {
+    /* Interrupts raised by the hook are taken once it has returned. */
+    if (host_primask || host_is_in_hook)
+      return;
+
+    struct host_irq * next = NULL;
+    for (uint8_t i = 0; i < host_irqs_num; i++)
+    {
+      if (host_irqs[i].is_pending && host_irqs[i].priority < host_level &&
+          (!next || host_irqs[i].priority < next->priority))
+        next = &host_irqs[i];
+    }
+    if (!next)
+      return;
+
+    /* Exception entry and return clear the local exclusive monitor. */
+    uint16_t const level = host_level;
+    next->is_pending = false;
+    host_exclusive = NULL;
+    host_level = next->priority;
+    next->isr();
+    host_level = level;
+    host_exclusive = NULL;
+  }
+}
+
+bool host_irq_is_active()
+{
+  return host_level != HOST_THREAD_LEVEL;
+}
+
+void host_preempt()
+{
+  if (host_hook && !host_is_in_hook)
+  {
+    host_is_in_hook = true;
+    host_hook();
+    host_is_in_hook = false;
+  }
+  host_irq_dispatch();
+}
+
+uint32_t host_get_primask()
+{
+  return host_primask;
+}
+
+void host_set_primask(uint32_t const primask)
+{
+  host_primask = primask & 1;
+  if (!host_primask)
+    host_irq_dispatch();
+}
+
+uint32_t host_ldrexw(volatile uint32_t * addr)
+{
+  host_preempt();
+  uint32_t const value = *addr;
+  host_exclusive = addr;
+  /* The window which matters: an exception between LDREX and STREX. */
+  host_preempt();
+  return value;
+}
+
+uint32_t host_strexw(uint32_t const value, volatile uint32_t * addr)
+{
+  if (host_exclusive != addr)
+    return 1;
+  *addr = value;
+  host_exclusive = NULL;
+  return 0;
+}
+
+void host_clrex()
+{
+  host_exclusive = NULL;
+}
+
+DWT_Type * host_dwt()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t const ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + host_time_skipped_ns;
+  host_dwt_regs.CYCCNT = (uint32_t)(ns * (SystemCoreClock / 1000000) / 1000);
+  return &host_dwt_regs;
+}
+
+void host_time_skip(uint64_t const ns)
+{
+  host_time_skipped_ns += ns;
+}
+
+static uint8_t host_gpio_port(GPIO_TypeDef const * port)
+{
+  return ((uintptr_t)port - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE);
+}
+
+GPIO_PinState host_gpio_read(GPIO_TypeDef const * port, uint16_t const pin)
+{
+  return (host_gpio[host_gpio_port(port)] & pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void host_gpio_drive(GPIO_TypeDef const * port, uint16_t const pin, GPIO_PinState const state)
+{
+  GPIO_PinState const old_state = host_gpio_read(port, pin);
+  if (state == old_state)
+    return;
+
+  if (state == GPIO_PIN_SET)
+    host_gpio[host_gpio_port(port)] |= pin;
+  else
+    host_gpio[host_gpio_port(port)] &= ~pin;
+
+  uint32_t const trigger = (state == GPIO_PIN_SET) ? host_exti.RTSR1 : host_exti.FTSR1;
+  if ((trigger & pin) && pin >= GPIO_PIN_10)
+  {
+    host_exti.PR1 |= pin;
+    host_irq_set_pending(HOST_EXTI15_10_PRIORITY, EXTI15_10_IRQHandler);
+    host_irq_dispatch();
+  }
+}
+
+/**************************************************************************************
+ * HAL
+ **************************************************************************************/
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+  return HAL_OK;
+}
+
+void HAL_IncTick(void)
+{
+}
+
+uint32_t HAL_GetTick(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec + host_time_skipped_ns) / 1000000);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+}
+
+void HAL_MPU_Enable(uint32_t MPU_Control)
+{
+}
+
+void HAL_MPU_Disable(void)
+{
+}
+
+void HAL_MPU_ConfigRegion(MPU_Region_InitTypeDef *MPU_Init)
+{
+}
+
+HAL_StatusTypeDef HAL_PWREx_ConfigSupply(uint32_t SupplySource)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *PeriphClkInit)
+{
+  return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void)
+{
+  return SystemCoreClock / 4;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+  return host_gpio_read(GPIOx, GPIO_Pin);
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+  if (PinState == GPIO_PIN_SET)
+    host_gpio[host_gpio_port(GPIOx)] |= GPIO_Pin;
+  else
+    host_gpio[host_gpio_port(GPIOx)] &= ~GPIO_Pin;
+}
+
+void HAL_GPIO_EXTI_IRQHandler(uint16_t GPIO_Pin)
+{
+  host_exti.PR1 &= ~GPIO_Pin;
+}
@@ -0,0 +1,161 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HAL_SHIM_H
+#define HAL_SHIM_H
+
+/* Force-included into every translation unit of the host build. The types
+ * and constants are taken from the real CMSIS/HAL headers, only the core
+ * intrinsics and the few registers touched at runtime by the protocol core
+ * are replaced by host state.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**************************************************************************************
+ * CMSIS CORE
+ **************************************************************************************/
+
+/* Skip cmsis_gcc.h, its inline assembly is ARM only. */
+#define __CMSIS_GCC_H
+
+#define __ASM                     __asm
+#define __INLINE                  inline
+#define __STATIC_INLINE           static inline
+#define __STATIC_FORCEINLINE      __attribute__((always_inline)) static inline
+#define __NO_RETURN               __attribute__((__noreturn__))
+#define __USED                    __attribute__((used))
+#define __WEAK                    __attribute__((weak))
+#define __PACKED                  __attribute__((packed, aligned(1)))
+#define __PACKED_STRUCT           struct __attribute__((packed, aligned(1)))
+#define __PACKED_UNION            union __attribute__((packed, aligned(1)))
+#define __ALIGNED(x)              __attribute__((aligned(x)))
+#define __RESTRICT                __restrict
+#define __COMPILER_BARRIER()      __asm volatile("":::"memory")
+
+/* Interrupt masking and the exclusive monitor are emulated, see hal_shim.c.
+ * Every exclusive access is a preemption point at which the simulated
+ * interrupts may run, exception entry clears the monitor as on the M7.
+ */
+void     host_preempt();
+
+uint32_t host_get_primask();
+void     host_set_primask(uint32_t const primask);
+uint32_t host_ldrexw(volatile uint32_t * addr);
+uint32_t host_strexw(uint32_t const value, volatile uint32_t * addr);
+void     host_clrex();
+
+#define __get_PRIMASK()           host_get_primask()
+#define __set_PRIMASK(x)          host_set_primask(x)
+#define __disable_irq()           host_set_primask(1)
+#define __enable_irq()            host_set_primask(0)
+#define __LDREXW(addr)            host_ldrexw(addr)
+#define __STREXW(value, addr)     host_strexw(value, addr)
+#define __CLREX()                 host_clrex()
+
+#define __NOP()                   do {} while (0)
+#define __WFI()                   do {} while (0)
+#define __DSB()                   __sync_synchronize()
+#define __ISB()                   __sync_synchronize()
+#define __DMB()                   __sync_synchronize()
+
+#define __CLZ(x)                  ((uint8_t)((x) ? __builtin_clz(x) : 32))
+
+static inline uint32_t __RBIT(uint32_t value)
+{
+  uint32_t result = 0;
+  for (uint8_t i = 0; i < 32; i++, value >>= 1)
+    result = (result << 1) | (value & 1);
+  return result;
+}
+
+/**************************************************************************************
+ * HAL
+ **************************************************************************************/
+
+#include "stm32h7xx_hal.h"
+
+/**************************************************************************************
+ * REGISTERS
+ **************************************************************************************/
+
+/* The cycle counter follows the host monotonic clock scaled to SystemCoreClock. */
+DWT_Type * host_dwt();
+/* Moves the cycle counter and HAL_GetTick() ahead, as if time had passed. */
+void host_time_skip(uint64_t const ns);
+
+extern CoreDebug_Type     host_core_debug;
+extern EXTI_TypeDef       host_exti;
+extern RCC_TypeDef        host_rcc;
+extern uint32_t           host_uid[3];
+/* USART2 and its DMA streams, modelled in fake_uart.c. */
+extern USART_TypeDef      host_usart2;
+extern DMA_Stream_TypeDef host_dma1_stream2;
+extern DMA_Stream_TypeDef host_dma1_stream3;
+
+#undef  DWT
+#define DWT          (host_dwt())
+#undef  CoreDebug
+#define CoreDebug    (&host_core_debug)
+#undef  EXTI
+#define EXTI         (&host_exti)
+#undef  RCC
+#define RCC          (&host_rcc)
+#undef  UID_BASE
+#define UID_BASE     ((uintptr_t)host_uid)
+#undef  USART2
+#define USART2       (&host_usart2)
+#undef  DMA1_Stream2
+#define DMA1_Stream2 (&host_dma1_stream2)
+#undef  DMA1_Stream3
+#define DMA1_Stream3 (&host_dma1_stream3)
+
+/* ICR is write 1 to clear, which a plain register block cannot do. */
+void host_usart_clear_flag(USART_TypeDef * usart, uint32_t const flags);
+
+#undef  __HAL_UART_CLEAR_FLAG
+#define __HAL_UART_CLEAR_FLAG(__HANDLE__, __FLAG__) host_usart_clear_flag((__HANDLE__)->Instance, (__FLAG__))
+
+/**************************************************************************************
+ * SIMULATION
+ **************************************************************************************/
+
+/* Called at every preemption point, lets a simulation raise interrupts
+ * in the middle of the code under test.
+ */
+typedef void(*HostPreemptHook)();
+
+void host_set_preempt_hook(HostPreemptHook const hook);
+
+/* Minimal NVIC: a pending isr is taken as soon as PRIMASK is clear and its
+ * priority is higher than the one of the running context.
+ */
+void host_irq_set_pending(uint8_t const priority, void(*isr)());
+void host_irq_dispatch();
+bool host_irq_is_active();
+
+GPIO_PinState host_gpio_read(GPIO_TypeDef const * port, uint16_t const pin);
+/* Drives an input pin and raises its EXTI line on an enabled edge. */
+void host_gpio_drive(GPIO_TypeDef const * port, uint16_t const pin, GPIO_PinState const state);
+
+#endif //HAL_SHIM_H
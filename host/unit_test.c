@@ -0,0 +1,748 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Unit checks of the drivers which run unchanged on the host: the ring
+ * buffers of ringbuffer.c on their own, uart.c on top of the USART2 model
+ * of fake_uart.c, and the CAN batches of can_handler.c on top of the FDCAN
+ * stubs, talking to the fake AP.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fake_ap.h"
+#include "fake_uart.h"
+#include "firmware.h"
+
+#include "can.h"
+#include "uart.h"
+#include "system.h"
+#include "opcodes.h"
+#include "ringbuffer.h"
+#include "peripherals.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+#define CHECK(cond)  check((cond), #cond, __LINE__)
+
+#define TEST_RING_SIZE      (16)
+#define TEST_UART_RX_SIZE   (3 * UART_RX_RING_BUFFER_SIZE)
+#define TEST_PUMP_TRANSFERS (4096)
+#define TEST_CAN_FRAMES     (32)
+
+/* CAN_RX_CONFIG and the per frame header of CAN_RX_BATCH, see PROTOCOL.md. */
+#define TEST_CAN_RX_FORMAT_BATCH    (1)
+#define TEST_CAN_RX_FLG_TIMESTAMP   (0x01)
+#define TEST_CAN_TX_BATCH_FLG_NO_ACK (0x01)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct test_can_frame {
+  uint32_t id;
+  uint8_t len;
+  uint8_t flags;
+  uint16_t delta_us;
+  uint8_t data[X8H7_CANFD_FRAME_MAX_DATA_LEN];
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+static uint32_t errors = 0;
+
+/* Collected from the superframes received by the fake AP. */
+static uint8_t uart_rx[TEST_UART_RX_SIZE];
+static uint32_t uart_rx_len = 0;
+#define TEST_UART_TX_STATUS_LOG (8)
+static uint16_t uart_tx_refused[TEST_UART_TX_STATUS_LOG];
+static uint32_t uart_tx_status_num = 0;
+static uint32_t uart_tx_status_rx_len = 0; /* uart_rx_len when the last status arrived. */
+static struct uart_linestate uart_linestate;
+static uint32_t uart_linestate_num = 0;
+
+/* Decoded from CAN_RX_BATCH of FDCAN1. */
+static bool can_rx_has_timestamp = false;
+static struct test_can_frame can_rx[TEST_CAN_FRAMES];
+static uint32_t can_rx_num = 0;
+static uint32_t can_rx_bad_batches = 0;
+static uint8_t can_rx_config[2];
+static uint32_t can_rx_config_num = 0;
+static uint8_t can_tx_batch_status[3 + 8];
+static uint32_t can_tx_batch_status_num = 0;
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+static void check(bool const is_ok, char const * expr, int const line)
+{
+  if (is_ok)
+    return;
+  errors++;
+  fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, line, expr);
+}
+
+static uint8_t pattern(uint32_t const i)
+{
+  return (i * 7 + (i >> 8) + 1) & 0xFF;
+}
+
+static void fill(char * data, uint32_t const start, uint32_t const size)
+{
+  for (uint32_t i = 0; i < size; i++)
+    data[i] = pattern(start + i);
+}
+
+static bool is_pattern(uint8_t const * data, uint32_t const start, uint32_t const size)
+{
+  for (uint32_t i = 0; i < size; i++) {
+    if (data[i] != pattern(start + i))
+      return false;
+  }
+  return true;
+}
+
+/**************************************************************************************
+ * RING BUFFER
+ **************************************************************************************/
+
+static void test_ring_drop_new()
+{
+  char memory[TEST_RING_SIZE];
+  char data[2 * TEST_RING_SIZE];
+  spsc_ring_buffer_t ring;
+  spsc_ring_buffer_init(&ring, memory, sizeof(memory), SPSC_RING_BUFFER_DROP_NEW);
+
+  /* All bytes of the memory are usable, the rest is refused. */
+  fill(data, 0, 20);
+  CHECK(spsc_ring_buffer_queue_arr(&ring, data, 10) == 10);
+  CHECK(spsc_ring_buffer_queue_arr(&ring, data + 10, 10) == 6);
+  CHECK(ring.dropped == 4);
+  CHECK(spsc_ring_buffer_num_items(&ring) == TEST_RING_SIZE);
+
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == TEST_RING_SIZE);
+  CHECK(is_pattern((uint8_t *)data, 0, TEST_RING_SIZE));
+  CHECK(spsc_ring_buffer_is_empty(&ring));
+  CHECK(ring.overwritten == 0);
+}
+
+static void test_ring_wraparound()
+{
+  char memory[TEST_RING_SIZE];
+  char data[TEST_RING_SIZE];
+  char const * span;
+  spsc_ring_buffer_t ring;
+  spsc_ring_buffer_init(&ring, memory, sizeof(memory), SPSC_RING_BUFFER_DROP_NEW);
+
+  fill(data, 0, 12);
+  spsc_ring_buffer_queue_arr(&ring, data, 12);
+  spsc_ring_buffer_dequeue_arr(&ring, data, 12);
+
+  /* Written in two blocks, the span ends where the memory wraps around. */
+  fill(data, 12, 10);
+  CHECK(spsc_ring_buffer_queue_arr(&ring, data, 10) == 10);
+  CHECK(spsc_ring_buffer_peek_span(&ring, &span) == 4);
+  CHECK(span == memory + 12 && is_pattern((uint8_t const *)span, 12, 4));
+  CHECK(spsc_ring_buffer_discard(&ring, 4) == 4);
+  CHECK(spsc_ring_buffer_peek_span(&ring, &span) == 6);
+  CHECK(span == memory && is_pattern((uint8_t const *)span, 16, 6));
+  CHECK(spsc_ring_buffer_discard(&ring, 6) == 6);
+
+  /* Read in two blocks. */
+  fill(data, 22, 14);
+  CHECK(spsc_ring_buffer_queue_arr(&ring, data, 14) == 14);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == 14);
+  CHECK(is_pattern((uint8_t *)data, 22, 14));
+}
+
+static void test_ring_overwrite()
+{
+  char memory[TEST_RING_SIZE];
+  char data[3 * TEST_RING_SIZE];
+  spsc_ring_buffer_t ring;
+  spsc_ring_buffer_init(&ring, memory, sizeof(memory), SPSC_RING_BUFFER_OVERWRITE);
+
+  /* The producer laps the consumer, which skips to the newest bytes. */
+  for (uint32_t i = 0; i < 6; i++) {
+    fill(data, i * 7, 7);
+    CHECK(spsc_ring_buffer_queue_arr(&ring, data, 7) == 7);
+  }
+  CHECK(spsc_ring_buffer_num_items(&ring) == TEST_RING_SIZE);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == TEST_RING_SIZE);
+  CHECK(is_pattern((uint8_t *)data, 42 - TEST_RING_SIZE, TEST_RING_SIZE));
+  CHECK(ring.overwritten == 42 - TEST_RING_SIZE);
+
+  /* More than the memory holds at once. */
+  fill(data, 100, 40);
+  CHECK(spsc_ring_buffer_queue_arr(&ring, data, 40) == 40);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == TEST_RING_SIZE);
+  CHECK(is_pattern((uint8_t *)data, 140 - TEST_RING_SIZE, TEST_RING_SIZE));
+  CHECK(ring.overwritten == (42 - TEST_RING_SIZE) + (40 - TEST_RING_SIZE));
+  CHECK(ring.dropped == 0);
+}
+
+static void test_ring_lead()
+{
+  char memory[TEST_RING_SIZE];
+  char data[2 * TEST_RING_SIZE];
+  char const * span;
+  spsc_ring_buffer_t ring;
+  spsc_ring_buffer_init(&ring, memory, sizeof(memory), SPSC_RING_BUFFER_OVERWRITE);
+  spsc_ring_buffer_set_lead(&ring, 4);
+
+  /* The producer may be writing 4 bytes ahead of head, those about to be
+   * overwritten count as such already.
+   */
+  fill(data, 0, 20);
+  spsc_ring_buffer_queue_arr(&ring, data, 20);
+  CHECK(spsc_ring_buffer_num_items(&ring) == TEST_RING_SIZE - 4);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, 5) == 5);
+  CHECK(is_pattern((uint8_t *)data, 8, 5));
+  CHECK(ring.overwritten == 8);
+
+  /* Lapped again, peek_span() and discard() skip ahead as well. */
+  fill(data, 20, 15);
+  spsc_ring_buffer_queue_arr(&ring, data, 15);
+  CHECK(spsc_ring_buffer_peek_span(&ring, &span) == TEST_RING_SIZE - (23 & (TEST_RING_SIZE - 1)));
+  CHECK(span == memory + (23 & (TEST_RING_SIZE - 1)) && is_pattern((uint8_t const *)span, 23, 1));
+  CHECK(ring.overwritten == 8 + 10);
+  CHECK(spsc_ring_buffer_discard(&ring, sizeof(data)) == TEST_RING_SIZE - 4);
+  CHECK(spsc_ring_buffer_is_empty(&ring));
+
+  /* The lead cannot exceed the buffer. */
+  spsc_ring_buffer_set_lead(&ring, 2 * TEST_RING_SIZE);
+  CHECK(ring.lead == TEST_RING_SIZE - 1);
+}
+
+static void test_ring_align_head()
+{
+  char memory[TEST_RING_SIZE];
+  char data[2 * TEST_RING_SIZE];
+  spsc_ring_buffer_t ring;
+  spsc_ring_buffer_init(&ring, memory, sizeof(memory), SPSC_RING_BUFFER_OVERWRITE);
+
+  /* Already aligned, nothing moves. */
+  spsc_ring_buffer_align_head(&ring);
+  CHECK(ring.head == 0 && ring.tail == 0);
+
+  /* The queued bytes move up against the end of the memory. */
+  fill(data, 0, 5);
+  spsc_ring_buffer_queue_arr(&ring, data, 5);
+  spsc_ring_buffer_dequeue_arr(&ring, data, 2);
+  spsc_ring_buffer_align_head(&ring);
+  CHECK(ring.head == TEST_RING_SIZE && ring.tail == TEST_RING_SIZE - 3);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == 3);
+  CHECK(is_pattern((uint8_t *)data, 2, 3));
+  CHECK(ring.overwritten == 0);
+
+  /* After a lap only the newest bytes fit in front of the new head. */
+  fill(data, 5, 21);
+  spsc_ring_buffer_queue_arr(&ring, data, 21);
+  uint32_t const shift = TEST_RING_SIZE - (ring.head & (TEST_RING_SIZE - 1));
+  spsc_ring_buffer_align_head(&ring);
+  CHECK((ring.head & (TEST_RING_SIZE - 1)) == 0);
+  CHECK(spsc_ring_buffer_dequeue_arr(&ring, data, sizeof(data)) == TEST_RING_SIZE - shift);
+  CHECK(is_pattern((uint8_t *)data, 26 - (TEST_RING_SIZE - shift), TEST_RING_SIZE - shift));
+  CHECK(ring.overwritten == 21 - (TEST_RING_SIZE - shift));
+}
+
+/**************************************************************************************
+ * UART
+ **************************************************************************************/
+
+/* Decodes a CAN_RX_BATCH following PROTOCOL.md rather than can_handler.c. */
+static bool can_rx_decode_batch(uint8_t const * data, uint16_t const size)
+{
+  static uint8_t const DLC_TO_LEN[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+  if (size < 1)
+    return false;
+  uint16_t offset = 1;
+  for (uint8_t n = 0; n < data[0]; n++)
+  {
+    if (offset + 3 > size || can_rx_num == TEST_CAN_FRAMES)
+      return false;
+    struct test_can_frame * frame = &can_rx[can_rx_num++];
+    uint8_t const info = data[offset++];
+    bool const is_fd = (info & 0x40);
+
+    frame->id = 0;
+    if (info & 0x80) {
+      memcpy(&frame->id, data + offset, sizeof(uint32_t));
+      frame->id |= CAN_EFF_FLAG;
+      offset += sizeof(uint32_t);
+    } else {
+      memcpy(&frame->id, data + offset, sizeof(uint16_t));
+      offset += sizeof(uint16_t);
+    }
+    if (!is_fd && (info & 0x10))
+      frame->id |= CAN_RTR_FLAG;
+
+    frame->flags = is_fd ? (CANFD_FDF | ((info & 0x10) ? CANFD_BRS : 0) | ((info & 0x20) ? CANFD_ESI : 0)) : 0;
+
+    frame->delta_us = 0;
+    if (can_rx_has_timestamp) {
+      memcpy(&frame->delta_us, data + offset, sizeof(uint16_t));
+      offset += sizeof(uint16_t);
+    }
+
+    frame->len = DLC_TO_LEN[info & 0x0F];
+    if (offset + frame->len > size)
+      return false;
+    memcpy(frame->data, data + offset, frame->len);
+    offset += frame->len;
+  }
+  return offset == size;
+}
+
+static void on_subpacket_can(uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  switch (opcode)
+  {
+    case CAN_RX_BATCH:
+      if (!can_rx_decode_batch(data, size))
+        can_rx_bad_batches++;
+      break;
+    case CAN_RX_CONFIG:
+      if (size == sizeof(can_rx_config)) {
+        memcpy(can_rx_config, data, size);
+        can_rx_config_num++;
+      }
+      break;
+    case CAN_TX_BATCH_STATUS:
+      if (size == sizeof(can_tx_batch_status)) {
+        memcpy(can_tx_batch_status, data, size);
+        can_tx_batch_status_num++;
+      }
+      break;
+  }
+}
+
+static void on_subpacket(uint8_t const peripheral, uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  if (peripheral == PERIPH_FDCAN1) {
+    on_subpacket_can(opcode, data, size);
+    return;
+  }
+  if (peripheral != PERIPH_UART)
+    return;
+
+  switch (opcode)
+  {
+    case DATA:
+      if (uart_rx_len + size <= sizeof(uart_rx)) {
+        memcpy(uart_rx + uart_rx_len, data, size);
+        uart_rx_len += size;
+      }
+      break;
+    case UART_TX_STATUS:
+      /* struct uart_tx_status: refused, free */
+      if (size == 2 * sizeof(uint16_t)) {
+        memcpy(&uart_tx_refused[uart_tx_status_num % TEST_UART_TX_STATUS_LOG], data, sizeof(uint16_t));
+        uart_tx_status_num++;
+        uart_tx_status_rx_len = uart_rx_len;
+      }
+      break;
+    case GET_LINESTATE:
+      if (size == sizeof(uart_linestate)) {
+        memcpy(&uart_linestate, data, size);
+        uart_linestate_num++;
+      }
+      break;
+  }
+}
+
+/* Lets the firmware forward what it has to the fake AP, for as long as
+ * it asks for transfers.
+ */
+static void pump()
+{
+  firmware_poll();
+  for (uint32_t i = 0; i < TEST_PUMP_TRANSFERS && fake_ap_is_irq_asserted(); i++) {
+    fake_ap_transfer(NULL, 0);
+    firmware_poll();
+  }
+  CHECK(!fake_ap_is_irq_asserted());
+}
+
+static void ap_send(uint8_t const peripheral, uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  static uint8_t buf[4 + UINT16_MAX];
+  buf[0] = peripheral;
+  buf[1] = opcode;
+  buf[2] = size & 0xFF;
+  buf[3] = size >> 8;
+  memcpy(buf + 4, data, size);
+  fake_ap_transfer(buf, 4 + size);
+  pump();
+}
+
+static struct uart_linestate const * uart_get_linestate_from_ap()
+{
+  uint32_t const num = uart_linestate_num;
+  ap_send(PERIPH_UART, GET_LINESTATE, NULL, 0);
+  CHECK(uart_linestate_num == num + 1);
+  return &uart_linestate;
+}
+
+static void test_uart_rx()
+{
+  static char data[TEST_UART_RX_SIZE];
+  fill(data, 0, sizeof(data));
+  uint32_t const dropped = uart_get_linestate_from_ap()->dropped;
+
+  /* Across several laps of the RX DMA, with the half and full transfer
+   * events as well as the idle line publishing the data.
+   */
+  uart_rx_len = 0;
+  for (uint32_t offset = 0; offset < sizeof(data); offset += 1000) {
+    uint16_t const size = (sizeof(data) - offset < 1000) ? (sizeof(data) - offset) : 1000;
+    fake_uart_receive((uint8_t *)data + offset, size, 0);
+    pump();
+  }
+  CHECK(uart_rx_len == sizeof(data));
+  CHECK(is_pattern(uart_rx, 0, uart_rx_len));
+  CHECK(uart_get_linestate_from_ap()->dropped == dropped);
+}
+
+static void test_uart_rx_overwrite()
+{
+  static char data[40000];
+  fill(data, 0, sizeof(data));
+  uint32_t const dropped = uart_get_linestate_from_ap()->dropped;
+
+  /* The AP does not keep up, the newest bytes are kept and the older ones
+   * accounted for as dropped.
+   */
+  uart_rx_len = 0;
+  fake_uart_receive((uint8_t *)data, sizeof(data), 0);
+  pump();
+  uint32_t const lost = uart_get_linestate_from_ap()->dropped - dropped;
+  CHECK(lost > 0);
+  CHECK(uart_rx_len + lost == sizeof(data));
+  CHECK(is_pattern(uart_rx, lost, uart_rx_len));
+}
+
+static void test_uart_tx()
+{
+  static uint8_t data[3000];
+  static uint8_t sent[sizeof(data)];
+  for (uint32_t i = 0; i < sizeof(data); i++)
+    data[i] = pattern(i);
+  uint32_t const status_num = uart_tx_status_num;
+
+  ap_send(PERIPH_UART, DATA, data, 1500);
+  CHECK(fake_uart_take_tx(sent, sizeof(sent)) == 1500);
+  CHECK(memcmp(sent, data, 1500) == 0);
+  CHECK(uart_tx_status_num == status_num);
+
+  /* Beyond the TX ring buffer the rest is refused and reported, once it
+   * has been sent the AP is told to go on.
+   */
+  ap_send(PERIPH_UART, DATA, data, sizeof(data));
+  CHECK(fake_uart_take_tx(sent, sizeof(sent)) == UART_TX_RING_BUFFER_SIZE);
+  CHECK(memcmp(sent, data, UART_TX_RING_BUFFER_SIZE) == 0);
+  CHECK(uart_tx_status_num == status_num + 2);
+  CHECK(uart_tx_refused[status_num % TEST_UART_TX_STATUS_LOG] == sizeof(data) - UART_TX_RING_BUFFER_SIZE);
+  CHECK(uart_tx_refused[(status_num + 1) % TEST_UART_TX_STATUS_LOG] == 0);
+
+  /* The AP resends the rest. */
+  ap_send(PERIPH_UART, DATA, data + UART_TX_RING_BUFFER_SIZE, sizeof(data) - UART_TX_RING_BUFFER_SIZE);
+  CHECK(fake_uart_take_tx(sent, sizeof(sent)) == sizeof(data) - UART_TX_RING_BUFFER_SIZE);
+  CHECK(memcmp(sent, data + UART_TX_RING_BUFFER_SIZE, sizeof(data) - UART_TX_RING_BUFFER_SIZE) == 0);
+  CHECK(uart_tx_status_num == status_num + 2);
+}
+
+/* CONFIGURE for 8N1 without flow control, see struct uartPacket. */
+static void uart_configure_from_ap(uint32_t const baud)
+{
+  uint32_t const config = 8 | (1 << 4) | (PARITY_NONE << 6) | (baud << 9);
+  ap_send(PERIPH_UART, CONFIGURE, (uint8_t const *)&config, sizeof(config));
+}
+
+static void test_uart_set_line()
+{
+  static char data[2000];
+  static uint8_t sent[100];
+  fill(data, 0, sizeof(data));
+  uint32_t const brr = USART2->BRR;
+  uint32_t const dropped = uart_get_linestate_from_ap()->dropped;
+
+  /* The line changes with received data still in the ring buffer, the RX
+   * DMA starts over and what it receives afterwards follows in order.
+   */
+  uart_rx_len = 0;
+  fake_uart_receive((uint8_t *)data, 1000, 0);
+  uart_configure_from_ap(57600);
+  CHECK(USART2->BRR != brr && (USART2->CR1 & USART_CR1_UE));
+  fake_uart_receive((uint8_t *)data + 1000, 1000, 0);
+  pump();
+  CHECK(uart_rx_len == sizeof(data));
+  CHECK(is_pattern(uart_rx, 0, uart_rx_len));
+  CHECK(uart_get_linestate_from_ap()->dropped == dropped);
+
+  ap_send(PERIPH_UART, DATA, (uint8_t const *)data, sizeof(sent));
+  CHECK(fake_uart_take_tx(sent, sizeof(sent)) == sizeof(sent));
+  CHECK(memcmp(sent, data, sizeof(sent)) == 0);
+
+  uart_configure_from_ap(115200);
+  CHECK(USART2->BRR == brr);
+}
+
+static void test_uart_framing_error()
+{
+  static char frame[64];
+  struct fake_uart_stats stats;
+  fake_uart_get_stats(&stats);
+  uint32_t const irq_storms = stats.irq_storms;
+  uint32_t const framing = uart_get_linestate_from_ap()->framing;
+
+  struct uart_framing_config const config = { FRAMING_IDLE, 0, 0 };
+  ap_send(PERIPH_UART, UART_FRAMING_CONFIG, (uint8_t const *)&config, sizeof(config));
+
+  /* Reception errors are not enabled as interrupts, but the receiver
+   * timeout is. Neither must keep the interrupt asserted.
+   */
+  uart_rx_len = 0;
+  fill(frame, 0, sizeof(frame));
+  fake_uart_receive((uint8_t *)frame, sizeof(frame), USART_ISR_FE);
+  pump();
+  fake_uart_get_stats(&stats);
+  CHECK(stats.irq_storms == irq_storms);
+  CHECK(uart_get_linestate_from_ap()->framing == framing + 1);
+
+  /* Later frames are received all the same. */
+  fill(frame, sizeof(frame), sizeof(frame));
+  fake_uart_receive((uint8_t *)frame, sizeof(frame), 0);
+  pump();
+  CHECK(uart_rx_len == 2 * sizeof(frame));
+  CHECK(is_pattern(uart_rx, 0, uart_rx_len));
+
+  struct uart_framing_config const none = { FRAMING_NONE, 0, 0 };
+  ap_send(PERIPH_UART, UART_FRAMING_CONFIG, (uint8_t const *)&none, sizeof(none));
+}
+
+static void test_uart_spill_order()
+{
+  static uint8_t filler[512];
+  char data[16];
+  uint16_t const status[2] = {0x1234, 0};
+  uint32_t const status_num = uart_tx_status_num;
+
+  /* Fill the superframe up to 64 bytes, then have a subpacket of another
+   * peripheral which doesn't fit block the spill queue ahead of a status.
+   */
+  pump();
+  uint16_t const free = TX_SUPERFRAME_MAX_SIZE - TX_HIGH_PRIORITY_LANE_SIZE - get_tx_packet_size();
+  struct tx_handle const handle = tx_reserve(PERIPH_ADC, DATA, free - 4 - 64);
+  CHECK(handle.data != NULL);
+  tx_commit(&handle, free - 4 - 64);
+  CHECK(enqueue_packet(PERIPH_ADC, DATA, sizeof(filler), filler) > 0);
+  CHECK(enqueue_packet(PERIPH_UART, UART_TX_STATUS, sizeof(status), (void *)status) > 0);
+
+  /* The data received afterwards would fit, yet it has to follow the status. */
+  uart_rx_len = 0;
+  fill(data, 0, sizeof(data));
+  fake_uart_receive((uint8_t *)data, sizeof(data), 0);
+  pump();
+  CHECK(uart_tx_status_num == status_num + 1);
+  CHECK(uart_tx_refused[status_num % TEST_UART_TX_STATUS_LOG] == status[0]);
+  CHECK(uart_tx_status_rx_len == 0);
+  CHECK(uart_rx_len == sizeof(data));
+  CHECK(is_pattern(uart_rx, 0, uart_rx_len));
+}
+
+/**************************************************************************************
+ * CAN
+ **************************************************************************************/
+
+static void test_can_init()
+{
+  /* 500 kbit/s nominal, 2 Mbit/s data phase. */
+  uint32_t const bittiming[8] = {10, 13, 2, 2, 2, 15, 4, 4};
+  ap_send(PERIPH_FDCAN1, CAN_INIT, (uint8_t const *)bittiming, sizeof(bittiming));
+
+  uint8_t const config[2] = {TEST_CAN_RX_FORMAT_BATCH, TEST_CAN_RX_FLG_TIMESTAMP};
+  uint32_t const num = can_rx_config_num;
+  ap_send(PERIPH_FDCAN1, CAN_RX_CONFIG, config, sizeof(config));
+  CHECK(can_rx_config_num == num + 1);
+  CHECK(memcmp(can_rx_config, config, sizeof(config)) == 0);
+  can_rx_has_timestamp = true;
+}
+
+static void test_can_rx_batch()
+{
+  /* Classic and CAN FD frames, standard and extended ids, every DLC
+   * class, and pauses of the time base.
+   */
+  static struct {
+    uint32_t id;
+    uint8_t len;
+    uint8_t flags;
+    uint32_t after_us;
+    uint16_t delta_us;
+  } const FRAMES[] = {
+    { 0x123,                     8, 0,                               0, 0xFFFF },
+    { CAN_EFF_FLAG | 0x1ABCDEF,  0, 0,                             100,    100 },
+    { CAN_RTR_FLAG | 0x7FF,      0, 0,                             250,    250 },
+    { 0x456,                    12, CANFD_FDF | CANFD_BRS,       70000, 0xFFFF },
+    { CAN_EFF_FLAG | 0x1234567, 64, CANFD_FDF | CANFD_ESI,          10,     10 },
+    { 0x001,                    20, CANFD_FDF,                       0,      0 },
+    { 0x002,                    48, CANFD_FDF | CANFD_BRS | CANFD_ESI,
+                                                                 65534,  65534 },
+    { 0x003,                     5, 0,                               1,      1 },
+  };
+  uint32_t const N = sizeof(FRAMES) / sizeof(FRAMES[0]);
+  uint32_t const cycles_per_us = SystemCoreClock / 1000000;
+
+  /* Close to the wrap of the cycle counter. */
+  uint32_t timestamp = 0xFFFFFFFF - 1000 * cycles_per_us;
+  for (uint32_t i = 0; i < N; i++) {
+    char data[X8H7_CANFD_FRAME_MAX_DATA_LEN];
+    fill(data, i * X8H7_CANFD_FRAME_MAX_DATA_LEN, FRAMES[i].len);
+    timestamp += FRAMES[i].after_us * cycles_per_us;
+    CHECK(host_can_receive(0, FRAMES[i].id, FRAMES[i].len, FRAMES[i].flags, timestamp, (uint8_t *)data));
+  }
+
+  can_rx_num = 0;
+  pump();
+  CHECK(can_rx_bad_batches == 0);
+  CHECK(can_rx_num == N);
+  for (uint32_t i = 0; i < N && i < can_rx_num; i++) {
+    CHECK(can_rx[i].id == FRAMES[i].id);
+    CHECK(can_rx[i].len == FRAMES[i].len);
+    CHECK(can_rx[i].flags == FRAMES[i].flags);
+    CHECK(can_rx[i].delta_us == FRAMES[i].delta_us);
+    CHECK(is_pattern(can_rx[i].data, i * X8H7_CANFD_FRAME_MAX_DATA_LEN, can_rx[i].len));
+  }
+}
+
+static void test_can_rx_batch_pause()
+{
+  char data[8];
+  fill(data, 0, sizeof(data));
+
+  /* One period of the cycle counter and 100 us later, which the cycle
+   * counter alone takes for 100 us.
+   */
+  can_rx_num = 0;
+  CHECK(host_can_receive(0, 0x010, sizeof(data), 0, cycle_counter_get(), (uint8_t *)data));
+  pump();
+  host_time_skip((((uint64_t)UINT32_MAX + 1) * 1000000000ULL) / SystemCoreClock + 100000);
+  CHECK(host_can_receive(0, 0x011, sizeof(data), 0, cycle_counter_get(), (uint8_t *)data));
+  pump();
+  CHECK(can_rx_bad_batches == 0);
+  CHECK(can_rx_num == 2);
+  CHECK(can_rx[1].id == 0x011 && can_rx[1].delta_us == 0xFFFF);
+}
+
+/* Appends a frame to a CAN_TX_BATCH, with the header of CAN_TX_FD_FRAME. */
+static uint16_t can_tx_batch_add(uint8_t * batch, uint16_t size, uint32_t const id, uint8_t const len, uint8_t const flags)
+{
+  memcpy(batch + size, &id, sizeof(id));
+  batch[size + 4] = len;
+  batch[size + 5] = flags;
+  for (uint8_t i = 0; i < len; i++)
+    batch[size + X8H7_CANFD_HEADER_SIZE + i] = pattern(i);
+  return size + X8H7_CANFD_HEADER_SIZE + len;
+}
+
+static void test_can_tx_batch()
+{
+  static uint8_t batch[1 + 4 * (X8H7_CANFD_HEADER_SIZE + X8H7_CANFD_FRAME_MAX_DATA_LEN)];
+  uint32_t const num = can_tx_batch_status_num;
+  uint16_t size;
+
+  /* Queued completely, nothing to acknowledge. */
+  batch[0] = TEST_CAN_TX_BATCH_FLG_NO_ACK;
+  size = can_tx_batch_add(batch, 1, 0x100, 8, 0);
+  size = can_tx_batch_add(batch, size, CAN_EFF_FLAG | 0x200, 64, CANFD_FDF | CANFD_BRS);
+  ap_send(PERIPH_FDCAN1, CAN_TX_BATCH, batch, size);
+  CHECK(can_tx_batch_status_num == num);
+
+  /* A classic frame of 12 bytes is refused, the status says which. */
+  size = can_tx_batch_add(batch, 1, 0x100, 8, 0);
+  size = can_tx_batch_add(batch, size, 0x101, 12, 0);
+  size = can_tx_batch_add(batch, size, 0x102, 12, CANFD_FDF);
+  ap_send(PERIPH_FDCAN1, CAN_TX_BATCH, batch, size);
+  CHECK(can_tx_batch_status_num == num + 1);
+  CHECK(can_tx_batch_status[0] == 3 && can_tx_batch_status[1] == 2 && can_tx_batch_status[2] == 1);
+  CHECK(can_tx_batch_status[3] == 0x05);
+
+  /* A frame cut short is not accepted, the status says where to go on. */
+  size = can_tx_batch_add(batch, 1, 0x100, 8, 0);
+  size = can_tx_batch_add(batch, size, 0x101, 8, 0) - 1;
+  ap_send(PERIPH_FDCAN1, CAN_TX_BATCH, batch, size);
+  CHECK(can_tx_batch_status_num == num + 2);
+  CHECK(can_tx_batch_status[0] == 1 && can_tx_batch_status[1] == 1 && can_tx_batch_status[2] == 0);
+
+  /* Without NO_ACK every batch is acknowledged. */
+  batch[0] = 0;
+  size = can_tx_batch_add(batch, 1, 0x100, 8, 0);
+  size = can_tx_batch_add(batch, size, 0x101, 0, 0);
+  ap_send(PERIPH_FDCAN1, CAN_TX_BATCH, batch, size);
+  CHECK(can_tx_batch_status_num == num + 3);
+  CHECK(can_tx_batch_status[0] == 2 && can_tx_batch_status[1] == 2 && can_tx_batch_status[2] == 0);
+  CHECK(can_tx_batch_status[3] == 0x03);
+}
+
+/**************************************************************************************
+ * MAIN
+ **************************************************************************************/
+
+int main()
+{
+  test_ring_drop_new();
+  test_ring_wraparound();
+  test_ring_overwrite();
+  test_ring_lead();
+  test_ring_align_head();
+
+  firmware_init();
+  fake_ap_init(on_subpacket);
+
+  test_uart_rx();
+  test_uart_rx_overwrite();
+  test_uart_tx();
+  test_uart_set_line();
+  test_uart_framing_error();
+  test_uart_spill_order();
+
+  test_can_init();
+  test_can_rx_batch();
+  test_can_rx_batch_pause();
+  test_can_tx_batch();
+
+  struct fake_uart_stats stats;
+  fake_uart_get_stats(&stats);
+  printf("uart: %lu bytes received, %lu sent, %u interrupts, %u interrupt storms\n",
+         (unsigned long)stats.bytes_rx, (unsigned long)stats.bytes_tx, stats.irqs, stats.irq_storms);
+  errors += stats.irq_storms;
+
+  printf("%s\n", errors ? "FAIL" : "PASS");
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,41 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Operations timed per primitive and payload size. */
+#ifndef BENCH_ITERATIONS
+#define BENCH_ITERATIONS (1000)
+#endif
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+/* Times the hot-path primitives with the DWT cycle counter and prints
+ * cycles/op, ns/op and MB/s for each of them. Runs without an AP, the
+ * firmware has to be initialized and no SPI transfer may be in progress.
+ */
+void bench_run();
+
+#endif //BENCH_H
@@ -37,6 +37,19 @@
 #define X8H7_CAN_HEADER_SIZE        5
 #define X8H7_CAN_FRAME_MAX_DATA_LEN	8
 
+#define X8H7_CANFD_HEADER_SIZE        6
+#define X8H7_CANFD_FRAME_MAX_DATA_LEN 64
+
+/* CAN FD flags of a frame, as in struct canfd_frame */
+#define CANFD_BRS 0x01 /* bit rate switch (second bitrate for payload data) */
+#define CANFD_ESI 0x02 /* error state indicator of the transmitting node */
+#define CANFD_FDF 0x04 /* CAN FD frame format */
+
+/* Bytes can_rx_fifo_available() counts for a received frame on top of its
+ * data: id, length, flags and the cycle counter at reception.
+ */
+#define CAN_RX_FRAME_OVERHEAD (X8H7_CANFD_HEADER_SIZE + 4)
+
 /* Special address description flags for the CAN_ID */
 #define CAN_EFF_FLAG 0x80000000U /* EFF/SFF is set in the MSB */
 #define CAN_RTR_FLAG 0x40000000U /* remote transmission request */
@@ -56,17 +69,35 @@ typedef enum {
     CAN_2 = (int)FDCAN2_BASE
 } CANName;
 
+/* Number of message RAM elements of a bus. */
+__attribute__((packed)) struct can_ram_profile
+{
+  uint8_t std_filters;  // 1 - 128
+  uint8_t ext_filters;  // 1 - 64
+  uint8_t rx_fifo0;     // 1 - 64
+  uint8_t rx_fifo1;     // 0 - 64, receives the frames with extended ids if not 0
+  uint8_t tx_events;    // 0 - 32
+  uint8_t tx_fifo;      // 1 - 32
+};
+
 /**************************************************************************************
  * FUNCTION DECLARATION
  **************************************************************************************/
 
-void          can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width);
+int           can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+                       uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width,
+                       struct can_ram_profile const * profile);
 void          can_deinit(FDCAN_HandleTypeDef * handle);
-int           can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width);
+int           can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+                                uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width);
+int           can_set_loopback(FDCAN_HandleTypeDef * handle, bool const is_loopback);
 
 uint32_t      can_tx_fifo_available(FDCAN_HandleTypeDef * handle);
-int           can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const * data);
-int           can_read(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * data);
+uint32_t      can_rx_fifo_available(FDCAN_HandleTypeDef * handle);
+bool          can_rx_overrun(FDCAN_HandleTypeDef * handle);
+int           can_rx_peek(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags);
+int           can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const flags, uint8_t const * data);
+int           can_read(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags, uint32_t * timestamp, uint8_t * data);
 int           can_filter(FDCAN_HandleTypeDef * handle, uint32_t const filter_index, uint32_t const id, uint32_t const mask, bool const is_extended_id);
 unsigned char can_rderror(FDCAN_HandleTypeDef * handle);
 unsigned char can_tderror(FDCAN_HandleTypeDef * handle);
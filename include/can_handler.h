@@ -29,7 +29,10 @@
  * FUNCTION DECLARATION
  **************************************************************************************/
 
-int can_handle_data();
+int fdcan1_data_available();
+int fdcan2_data_available();
+int fdcan1_handle_data(uint16_t const max_bytes);
+int fdcan2_handle_data(uint16_t const max_bytes);
 
 int fdcan1_handler(uint8_t const opcode, uint8_t const * data, uint16_t const size);
 int fdcan2_handler(uint8_t const opcode, uint8_t const * data, uint16_t const size);
@@ -32,6 +32,16 @@ enum Opcodes
 enum Opcodes_H7
 {
   FW_VERSION     = 0x10,
+  H7_DISPATCH_CONFIG = 0x20,
+  H7_DISPATCH_STATS  = 0x21,
+  H7_RX_QUEUE_STATS  = 0x22,
+  H7_IRQ_COALESCE_CONFIG = 0x23,
+  H7_IRQ_COALESCE_STATS  = 0x24,
+  H7_TX_LANE_STATS       = 0x25,
+  H7_TX_SCHED_CONFIG     = 0x26,
+  H7_TX_SCHED_STATS      = 0x27,
+  H7_TX_DROP_STATS       = 0x28,
+  H7_SPI_TRANSFER_MODE   = 0x29,
   BOOT_M4        = 0x77,
   H7_GET_UID_REQ = 0x78,
   H7_GET_UID_RSP = 0x78,
@@ -40,6 +50,8 @@ enum Opcodes_H7
 enum Opcodes_UART
 {
   GET_LINESTATE = 0x20,
+  UART_FRAMING_CONFIG = 0x30,
+  UART_TX_STATUS = 0x40,
 };
 
 enum Opcodes_RTC
@@ -55,9 +67,15 @@ enum Opcodes_CAN
   CAN_INIT          = 0x10,
   CAN_DEINIT        = 0x11,
   CAN_SET_BITTIMING = 0x12,
+  CAN_RX_CONFIG     = 0x13,
   CAN_TX_FRAME      = 0x01,
   CAN_RX_FRAME      = 0x01,
+  CAN_TX_FD_FRAME   = 0x02,
+  CAN_RX_FD_FRAME   = 0x02,
+  CAN_TX_BATCH      = 0x03,
+  CAN_RX_BATCH      = 0x03,
   CAN_STATUS        = 0x40,
+  CAN_TX_BATCH_STATUS = 0x41,
   CAN_FILTER        = 0x50,
 };
 
@@ -26,32 +26,20 @@
 
 #include <inttypes.h>
 
-/**
- * The size of a ring buffer.
- * Due to the design only <tt> RING_BUFFER_SIZE-1 </tt> items
- * can be contained in the buffer.
- * The buffer size must be a power of two.
-*/
-#define RING_BUFFER_SIZE 4096
-
-#if (RING_BUFFER_SIZE & (RING_BUFFER_SIZE - 1)) != 0
-#error "RING_BUFFER_SIZE must be a power of two"
-#endif
-
 /**
  * The type which is used to hold the size
  * and the indices of the buffer.
- * Must be able to fit \c RING_BUFFER_SIZE .
  */
-typedef uint16_t ring_buffer_size_t;
+typedef uint32_t ring_buffer_size_t;
 
 /**
- * Used as a modulo operator
- * as <tt> a % b = (a & (b − 1)) </tt>
- * where \c a is a positive index in the buffer and
- * \c b is the (power of two) size of the buffer.
+ * Defines the memory of a ring buffer holding <em>size</em> bytes,
+ * to be passed to ring_buffer_init() or spsc_ring_buffer_init().
+ * The size must be a power of two.
  */
-#define RING_BUFFER_MASK (RING_BUFFER_SIZE-1)
+#define RING_BUFFER_MEMORY(name, size) \
+  _Static_assert((size) > 1 && ((size) & ((size) - 1)) == 0, #name " size must be a power of two"); \
+  static char name[size]
 
 /**
  * Simplifies the use of <tt>struct ring_buffer_t</tt>.
@@ -65,7 +53,15 @@ typedef struct ring_buffer_t ring_buffer_t;
  */
 struct ring_buffer_t {
   /** Buffer memory. */
-  char buffer[RING_BUFFER_SIZE];
+  char *buffer;
+  /**
+   * Used as a modulo operator
+   * as <tt> a % b = (a & (b − 1)) </tt>
+   * where \c a is a positive index in the buffer and
+   * \c b is the (power of two) size of the buffer.
+   * Due to the design only \c mask items can be contained in the buffer.
+   */
+  ring_buffer_size_t mask;
   /** Index of tail. */
   ring_buffer_size_t tail_index;
   /** Index of head. */
@@ -76,8 +72,10 @@ struct ring_buffer_t {
  * Initializes the ring buffer pointed to by <em>buffer</em>.
  * This function can also be used to empty/reset the buffer.
  * @param buffer The ring buffer to initialize.
+ * @param memory The buffer memory, e.g. defined with RING_BUFFER_MEMORY().
+ * @param size The size of <em>memory</em>, rounded down to a power of two.
  */
-void ring_buffer_init(ring_buffer_t *buffer);
+void ring_buffer_init(ring_buffer_t *buffer, char *memory, ring_buffer_size_t size);
 
 /**
  * Adds a byte to a ring buffer.
@@ -88,6 +86,7 @@ void ring_buffer_queue(ring_buffer_t *buffer, char data);
 
 /**
  * Adds an array of bytes to a ring buffer.
+ * If there is not enough room the oldest bytes are overwritten.
  * @param buffer The buffer in which the data should be placed.
  * @param data A pointer to the array of bytes to place in the queue.
  * @param size The size of the array.
@@ -119,6 +118,25 @@ ring_buffer_size_t ring_buffer_dequeue_arr(ring_buffer_t *buffer, char *data, ri
  */
 uint8_t ring_buffer_peek(ring_buffer_t *buffer, char *data, ring_buffer_size_t index);
 
+/**
+ * Returns the oldest bytes of a ring buffer in place, without removing them.
+ * The span ends where the buffer memory wraps around, the remaining bytes
+ * are returned by the next call once the span has been discarded.
+ * @param buffer The buffer from which the data should be returned.
+ * @param data A pointer to the location at which the start of the span should be placed.
+ * @return The number of contiguous bytes at <em>data</em>.
+ */
+ring_buffer_size_t ring_buffer_peek_span(ring_buffer_t *buffer, const char **data);
+
+/**
+ * Removes the <em>len</em> oldest bytes from a ring buffer, e.g. once a span
+ * obtained by ring_buffer_peek_span() has been consumed.
+ * @param buffer The buffer from which the data should be removed.
+ * @param len The maximum number of bytes to remove.
+ * @return The number of bytes removed.
+ */
+ring_buffer_size_t ring_buffer_discard(ring_buffer_t *buffer, ring_buffer_size_t len);
+
 
 /**
  * Returns whether a ring buffer is empty.
@@ -135,7 +153,7 @@ inline uint8_t ring_buffer_is_empty(ring_buffer_t *buffer) {
  * @return 1 if full; 0 otherwise.
  */
 inline uint8_t ring_buffer_is_full(ring_buffer_t *buffer) {
-  return ((buffer->head_index - buffer->tail_index) & RING_BUFFER_MASK) == RING_BUFFER_MASK;
+  return ((buffer->head_index - buffer->tail_index) & buffer->mask) == buffer->mask;
 }
 
 /**
@@ -144,7 +162,157 @@ inline uint8_t ring_buffer_is_full(ring_buffer_t *buffer) {
  * @return The number of items in the ring buffer.
  */
 inline ring_buffer_size_t ring_buffer_num_items(ring_buffer_t *buffer) {
-  return ((buffer->head_index - buffer->tail_index) & RING_BUFFER_MASK);
+  return ((buffer->head_index - buffer->tail_index) & buffer->mask);
+}
+
+/**
+ * What a single-producer/single-consumer ring buffer does with
+ * bytes which do not fit anymore.
+ */
+enum spsc_ring_buffer_overflow {
+  /** The oldest bytes are overwritten, counted in \c overwritten . */
+  SPSC_RING_BUFFER_OVERWRITE,
+  /** The new bytes which do not fit are dropped, counted in \c dropped . */
+  SPSC_RING_BUFFER_DROP_NEW,
+};
+
+/**
+ * Simplifies the use of <tt>struct spsc_ring_buffer_t</tt>.
+ */
+typedef struct spsc_ring_buffer_t spsc_ring_buffer_t;
+
+/**
+ * Ring buffer shared between exactly one producer and one consumer,
+ * e.g. an interrupt handler and the main loop, without masking interrupts.
+ * The producer only writes \c head and the consumer only writes \c tail ,
+ * both are free-running byte counts published with release semantics.
+ * Unlike <tt>ring_buffer_t</tt> all bytes of the buffer memory can be used.
+ *
+ * With \c SPSC_RING_BUFFER_OVERWRITE the producer never waits for the
+ * consumer, the consumer skips whatever has been overwritten instead. This
+ * requires that the consumer cannot interrupt the producer.
+ */
+struct spsc_ring_buffer_t {
+  /** Buffer memory. */
+  char *buffer;
+  /** Size of the buffer memory minus one, see <tt>ring_buffer_t</tt>. */
+  ring_buffer_size_t mask;
+  /** Number of bytes ever queued. */
+  uint32_t head;
+  /** Number of bytes ever dequeued, discarded or overwritten. */
+  uint32_t tail;
+  /** One of <tt>enum spsc_ring_buffer_overflow</tt>. */
+  uint8_t overflow;
+  /** Number of bytes the producer may write beyond \c head before publishing them. */
+  ring_buffer_size_t lead;
+  /** Number of bytes dropped by the producer. */
+  uint32_t dropped;
+  /** Number of bytes overwritten before the consumer got to them. */
+  uint32_t overwritten;
+};
+
+/**
+ * Initializes the ring buffer pointed to by <em>buffer</em>.
+ * Must not be called while the buffer is in use by either side.
+ * @param buffer The ring buffer to initialize.
+ * @param memory The buffer memory, e.g. defined with RING_BUFFER_MEMORY().
+ * @param size The size of <em>memory</em>, rounded down to a power of two.
+ * @param overflow The overflow policy, see <tt>enum spsc_ring_buffer_overflow</tt>.
+ */
+void spsc_ring_buffer_init(spsc_ring_buffer_t *buffer, char *memory, ring_buffer_size_t size, enum spsc_ring_buffer_overflow overflow);
+
+/**
+ * Adds an array of bytes to a ring buffer. Producer side.
+ * @param buffer The buffer in which the data should be placed.
+ * @param data A pointer to the array of bytes to place in the queue.
+ * @param size The size of the array.
+ * @return The number of bytes placed, less than <em>size</em> only if bytes have been dropped.
+ */
+ring_buffer_size_t spsc_ring_buffer_queue_arr(spsc_ring_buffer_t *buffer, const char *data, ring_buffer_size_t size);
+
+/**
+ * Publishes <em>size</em> bytes which the producer has written to the
+ * buffer memory at \c head itself, e.g. by DMA. Producer side.
+ * Only for \c SPSC_RING_BUFFER_OVERWRITE .
+ * @param buffer The buffer in which the data has been placed.
+ * @param size The number of bytes placed.
+ */
+void spsc_ring_buffer_commit(spsc_ring_buffer_t *buffer, ring_buffer_size_t size);
+
+/**
+ * Sets how far the producer may write ahead of \c head before publishing
+ * the data, e.g. a circular DMA between two of its interrupts. The consumer
+ * considers bytes within that distance of being lapped as overwritten.
+ * Must not be called while the buffer is in use by either side.
+ * @param buffer The buffer for which the lead should be set.
+ * @param lead The maximum number of unpublished bytes.
+ */
+void spsc_ring_buffer_set_lead(spsc_ring_buffer_t *buffer, ring_buffer_size_t lead);
+
+/**
+ * Moves the queued bytes so that \c head is at the start of the buffer
+ * memory, e.g. before a circular DMA is restarted there.
+ * Must not be called while the buffer is in use by either side.
+ * @param buffer The buffer which should be realigned.
+ */
+void spsc_ring_buffer_align_head(spsc_ring_buffer_t *buffer);
+
+/**
+ * Returns the <em>len</em> oldest bytes in a ring buffer. Consumer side.
+ * @param buffer The buffer from which the data should be returned.
+ * @param data A pointer to the array at which the data should be placed.
+ * @param len The maximum number of bytes to return.
+ * @return The number of bytes returned.
+ */
+ring_buffer_size_t spsc_ring_buffer_dequeue_arr(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t len);
+
+/**
+ * Peeks a ring buffer, i.e. returns an element without removing it.
+ * Consumer side. Only for \c SPSC_RING_BUFFER_DROP_NEW , otherwise the
+ * producer may overwrite the element while it is read.
+ * @param buffer The buffer from which the data should be returned.
+ * @param data A pointer to the location at which the data should be placed.
+ * @param index The index to peek.
+ * @return 1 if data was returned; 0 otherwise.
+ */
+uint8_t spsc_ring_buffer_peek(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t index);
+
+/**
+ * Returns the oldest bytes of a ring buffer in place, without removing them.
+ * Consumer side. Only for \c SPSC_RING_BUFFER_DROP_NEW , otherwise the
+ * producer may overwrite the span while it is in use.
+ * @param buffer The buffer from which the data should be returned.
+ * @param data A pointer to the location at which the start of the span should be placed.
+ * @return The number of contiguous bytes at <em>data</em>.
+ */
+ring_buffer_size_t spsc_ring_buffer_peek_span(spsc_ring_buffer_t *buffer, const char **data);
+
+/**
+ * Removes the <em>len</em> oldest bytes from a ring buffer. Consumer side.
+ * @param buffer The buffer from which the data should be removed.
+ * @param len The maximum number of bytes to remove.
+ * @return The number of bytes removed.
+ */
+ring_buffer_size_t spsc_ring_buffer_discard(spsc_ring_buffer_t *buffer, ring_buffer_size_t len);
+
+/**
+ * Returns the number of items in a ring buffer.
+ * Exact on the consumer side, a lower bound of the free space on the producer side.
+ * @param buffer The buffer for which the number of items should be returned.
+ * @return The number of items in the ring buffer.
+ */
+inline ring_buffer_size_t spsc_ring_buffer_num_items(spsc_ring_buffer_t *buffer) {
+  uint32_t const num_items = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+  return (num_items <= buffer->mask + 1 - buffer->lead) ? num_items : (buffer->mask + 1 - buffer->lead);
+}
+
+/**
+ * Returns whether a ring buffer is empty.
+ * @param buffer The buffer for which it should be returned whether it is empty.
+ * @return 1 if empty; 0 otherwise.
+ */
+inline uint8_t spsc_ring_buffer_is_empty(spsc_ring_buffer_t *buffer) {
+  return (__atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE));
 }
 
 #endif /* RINGBUFFER_H */
\ No newline at end of file
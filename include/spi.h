@@ -35,4 +35,6 @@ void spi_end();
 
 void spi_transmit_receive(uint8_t * tx_buf, uint8_t * rx_buf, uint16_t size);
 
+uint16_t spi_rx_remaining();
+
 #endif  //SPI_H
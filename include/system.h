@@ -26,12 +26,82 @@
 #include <inttypes.h>
 #include <stdbool.h>
 
+#include "peripherals.h"
+
 /**************************************************************************************
  * DEFINE
  **************************************************************************************/
 
 #define SPI_DMA_BUFFER_SIZE   64 * 1024
 
+/* Number of receive superframe slots. The SPI RX DMA lands directly in the
+ * next free slot while the main loop is still dispatching older ones, which
+ * allows the AP to burst transfers without waiting for the H7.
+ */
+#ifndef RX_SUPERFRAME_QUEUE_DEPTH
+#define RX_SUPERFRAME_QUEUE_DEPTH  3
+#endif
+
+/* MPU_Config() uses regions 0..1 for TX, one per RX slot and three behind
+ * them, out of the 16 regions of the M7.
+ */
+#if (RX_SUPERFRAME_QUEUE_DEPTH < 2) || (RX_SUPERFRAME_QUEUE_DEPTH > 11)
+#error "RX_SUPERFRAME_QUEUE_DEPTH must be within [2, 11] (one MPU region per slot)"
+#endif
+
+/* Maximum payload accepted per receive slot, room is left for the
+ * complete_packet header and the end-of-superframe marker.
+ */
+#define RX_SUPERFRAME_MAX_SIZE     (SPI_DMA_BUFFER_SIZE - 8)
+
+/* Maximum size of all subpackets within one transmit superframe. One byte
+ * is left unused so that header and subpackets of a single-phase transfer
+ * fit into the 16 bit DMA counter.
+ */
+#define TX_SUPERFRAME_MAX_SIZE     (SPI_DMA_BUFFER_SIZE - 5)
+
+/* Room reserved at the front of each TX superframe for latency critical
+ * subpackets (GPIO IRQ_SIGNAL, CAN_STATUS, CAN_TX_BATCH_STATUS). They are
+ * sent ahead of all other subpackets and are not crowded out by bulk data.
+ */
+#ifndef TX_HIGH_PRIORITY_LANE_SIZE
+#define TX_HIGH_PRIORITY_LANE_SIZE 256
+#endif
+
+#if (TX_HIGH_PRIORITY_LANE_SIZE > 511)
+#error "TX_HIGH_PRIORITY_LANE_SIZE must not exceed 511 bytes"
+#endif
+
+/* Subpackets passed to enqueue_packet() while the TX superframe is full
+ * are kept in the spill queue and carried over into the next superframe.
+ */
+#ifndef TX_SPILL_QUEUE_SIZE
+#define TX_SPILL_QUEUE_SIZE        4096
+#endif
+
+#define TX_STATS_NUM_PERIPHERALS   16
+
+/* Budget for a single dma_handle_data() pass over a received superframe.
+ * A value of 0 disables the respective limit, setting the subpacket limit
+ * to 1 restores the legacy behaviour of one subpacket per main loop pass.
+ */
+#define DMA_DISPATCH_MAX_SUBPACKETS_DEFAULT  0
+#define DMA_DISPATCH_MAX_TIME_us_DEFAULT     1000
+
+/* Interrupt moderation of nIRQ. With a byte threshold of 0 nIRQ is asserted
+ * as soon as anything is pending (legacy behaviour). Otherwise it is held
+ * back until the threshold is reached, the oldest pending subpacket has
+ * waited max_delay_us or a subpacket of an urgent peripheral is pending.
+ * By default request/response peripherals are urgent while the streaming
+ * ones (FDCAN, UART) may be coalesced.
+ */
+#define IRQ_COALESCE_THRESHOLD_BYTES_DEFAULT  0
+#define IRQ_COALESCE_MAX_DELAY_us_DEFAULT     1000
+#define IRQ_COALESCE_URGENT_MASK_DEFAULT      ((1 << PERIPH_ADC) | (1 << PERIPH_PWM) | (1 << PERIPH_RTC) | \
+                                               (1 << PERIPH_GPIO) | (1 << PERIPH_H7))
+/* Peripherals which can be marked urgent, one per bit of urgent_mask. */
+#define IRQ_COALESCE_NUM_PERIPHERALS          (8 * sizeof(((struct irq_coalesce_config *)0)->urgent_mask))
+
 __attribute__((packed, aligned(4))) struct subpacket {
   __attribute__((packed, aligned(4))) struct {
     uint8_t peripheral;
@@ -50,6 +120,77 @@ __attribute__((packed, aligned(4))) struct complete_packet {
   // ... other subpackets will follow
 };
 
+__attribute__((packed)) struct dispatch_stats {
+  uint32_t superframes;      /* Number of received superframes which have been fully dispatched. */
+  uint32_t subpackets;       /* Number of subpackets dispatched to the peripheral callbacks. */
+  uint32_t budget_exhausted; /* Number of dispatch passes which were cut short by the budget. */
+  uint32_t latency_last_us;  /* SPI transfer complete -> last subpacket dispatched. */
+  uint32_t latency_max_us;
+  uint32_t latency_avg_us;
+};
+
+__attribute__((packed)) struct rx_queue_stats {
+  uint32_t superframes; /* Number of superframes received from the AP. */
+  uint32_t overflows;   /* Number of received superframes dropped because all slots were occupied. */
+  uint8_t  depth;       /* Number of receive superframe slots. */
+  uint8_t  used;        /* Number of slots currently waiting to be dispatched. */
+  uint8_t  used_max;    /* High watermark of used slots. */
+};
+
+__attribute__((packed)) struct irq_coalesce_config {
+  uint16_t threshold_bytes; /* Pending bytes which trigger nIRQ, 0 = no coalescing. */
+  uint16_t max_delay_us;    /* Maximum time the oldest pending subpacket is held back, 0 = unlimited. */
+  uint16_t urgent_mask;     /* Bit n set: subpackets of peripheral n trigger nIRQ right away. */
+};
+
+__attribute__((packed)) struct irq_coalesce_stats {
+  uint32_t signals;   /* Number of times nIRQ has been asserted. */
+  uint32_t urgent;    /* ... because of a subpacket of an urgent peripheral. */
+  uint32_t threshold; /* ... because the byte threshold has been reached. */
+  uint32_t timeout;   /* ... because the maximum delay has expired. */
+  uint32_t bytes_avg; /* Average number of pending bytes when nIRQ is asserted. */
+};
+
+enum spi_transfer_mode
+{
+  SPI_TRANSFER_TWO_PHASE = 0,    /* Header and payload in two separate CS cycles (default). */
+  SPI_TRANSFER_SINGLE_PHASE = 1, /* Header and payload within a single CS cycle. */
+};
+
+enum tx_lane
+{
+  TX_LANE_HIGH = 0,
+  TX_LANE_NORMAL = 1,
+  TX_LANES
+};
+
+__attribute__((packed)) struct tx_lane_stats {
+  uint32_t superframes;   /* Number of superframes carrying subpackets of this priority class. */
+  uint32_t lane_full;     /* Number of reservations which did not fit into the lane. */
+  uint32_t delay_last_us; /* Oldest subpacket of the class: reservation -> end of SPI transfer. */
+  uint32_t delay_max_us;
+  uint32_t delay_avg_us;
+};
+
+__attribute__((packed)) struct tx_drop_stats {
+  uint16_t spill_used;     /* Bytes currently waiting in the spill queue. */
+  uint16_t spill_used_max; /* High watermark of the spill queue. */
+  uint32_t spilled[TX_STATS_NUM_PERIPHERALS]; /* Subpackets carried over via the spill queue, per peripheral. */
+  uint32_t dropped[TX_STATS_NUM_PERIPHERALS]; /* Subpackets lost because the spill queue was full, per peripheral. */
+};
+
+/* Handle to a subpacket reserved within the active TX superframe, the
+ * payload is serialized directly into the DMA buffer.
+ */
+struct tx_handle {
+  uint8_t * data;            /* Payload area, NULL if the reservation failed. */
+  struct subpacket * subpkt;
+  uint16_t max_size;
+  uint16_t offset;           /* Offset of the subpacket within its lane. */
+  uint8_t  buf;              /* Index of the TX buffer holding the reservation. */
+  uint8_t  lane;
+};
+
 #define max(a, b)                                                              \
   ({                                                                           \
     __typeof__(a) _a = (a);                                                    \
@@ -66,10 +207,32 @@ void system_init();
 void dma_init();
 
 int enqueue_packet(uint8_t const peripheral, uint8_t const opcode, uint16_t const size, void * data);
+struct tx_handle tx_reserve(uint8_t const peripheral, uint8_t const opcode, uint16_t const max_size);
+int tx_commit(struct tx_handle const * handle, uint16_t const actual_size);
+void tx_cancel(struct tx_handle const * handle);
+int tx_spill_handle_data();
+void tx_get_drop_stats(struct tx_drop_stats * stats);
 void set_nirq_low();
 uint16_t get_tx_packet_size();
+bool is_tx_packet_due();
+void irq_coalesce_set_config(struct irq_coalesce_config const * config);
+void irq_coalesce_get_stats(struct irq_coalesce_stats * stats);
+void tx_get_lane_stats(struct tx_lane_stats stats[TX_LANES]);
 bool is_dma_transfer_complete();
+int dma_set_transfer_mode(uint8_t const mode);
 
 void dma_handle_data();
+void dma_set_dispatch_budget(uint16_t const max_subpackets, uint16_t const max_time_us);
+void dma_get_dispatch_stats(struct dispatch_stats * stats);
+void dma_get_rx_queue_stats(struct rx_queue_stats * stats);
+
+#ifdef BENCH
+void dma_bench_discard_tx();
+int  dma_bench_receive(uint8_t const * data, uint16_t const size);
+#endif
+
+void     cycle_counter_init();
+uint32_t cycle_counter_get();
+uint32_t cycle_counter_to_us(uint32_t const cycles);
 
 #endif //SYSTEM_H
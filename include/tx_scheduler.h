@@ -0,0 +1,69 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TX_SCHEDULER_H
+#define TX_SCHEDULER_H
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <inttypes.h>
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+#define TX_SCHEDULER_MAX_SOURCES     (4)
+
+/* Bytes granted to a source per unit of weight and round. */
+#define TX_SCHEDULER_QUANTUM         (256)
+#define TX_SCHEDULER_WEIGHT_DEFAULT  (1)
+/* Bytes tx_scheduler_run() moves at most per call, across as many rounds
+ * as it takes. A lone source at 3 Mbaud needs well below that per pass.
+ */
+#define TX_SCHEDULER_RUN_BUDGET      (16 * 1024)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+/* Returns non-zero if the source has data waiting to be sent to the AP. */
+typedef int(*TxSourcePendingFunc)();
+/* Moves data of the source into the TX superframe, at most max_bytes
+ * including subpacket headers. Returns the number of bytes enqueued.
+ */
+typedef int(*TxSourceDrainFunc)(uint16_t const max_bytes);
+
+__attribute__((packed)) struct tx_scheduler_stats {
+  uint8_t  peripheral;
+  uint8_t  weight;
+  uint32_t bytes;    /* Number of bytes moved into TX superframes. */
+  uint32_t deferred; /* Number of scheduler runs after which data of the source was left waiting. */
+};
+
+/**************************************************************************************
+ * FUNCTION DECLARATION
+ **************************************************************************************/
+
+void tx_scheduler_register(uint8_t const peripheral, TxSourcePendingFunc const pending, TxSourceDrainFunc const drain);
+void tx_scheduler_set_weight(uint8_t const peripheral, uint8_t const weight);
+void tx_scheduler_run();
+int  tx_scheduler_get_stats(struct tx_scheduler_stats stats[TX_SCHEDULER_MAX_SOURCES]);
+
+#endif //TX_SCHEDULER_H
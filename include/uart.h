@@ -25,6 +25,37 @@
 
 #include <inttypes.h>
 
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Sized for a few ms at several Mbaud, the AP collects the data once per
+ * transfer. A power of two, the RX DMA writes straight into it.
+ */
+#define UART_RX_RING_BUFFER_SIZE  (32 * 1024)
+/* A single DATA subpacket may be far larger than this. Whatever does not
+ * fit is refused rather than overwritten and reported to the AP with
+ * UART_TX_STATUS, which then paces itself by the free space reported.
+ * The ring only has to bridge the time until the AP has resent.
+ */
+#define UART_TX_RING_BUFFER_SIZE  (2 * 1024)
+
+/* Received data is forwarded to the AP as soon as it is there, unless the
+ * AP asks for batching via CONFIGURE.
+ */
+#define UART_RX_BATCH_MIN_BYTES_DEFAULT       0
+#define UART_RX_BATCH_TIMEOUT_BITS_DEFAULT    0
+#define UART_RX_BATCH_MAX_LATENCY_us_DEFAULT  1000
+
+#define UART_LINESTATE_RTS  (1 << 0)
+#define UART_LINESTATE_CTS  (1 << 1)
+
+/* Longest frame forwarded with framing enabled, that of Modbus RTU. */
+#define UART_RX_FRAME_MAX_SIZE  (256)
+
+/* struct uart_framing_config flags. */
+#define UART_FRAMING_RS485_DE   (1 << 0)
+
 /**************************************************************************************
  * TYPEDEF
  **************************************************************************************/
@@ -35,13 +66,60 @@ enum UARTParity {
   PARITY_NONE,
 };
 
+enum UARTFraming {
+  FRAMING_NONE = 0,
+  FRAMING_IDLE,
+  FRAMING_MODBUS_RTU,
+};
+
+/* Payload of UART_FRAMING_CONFIG. With framing enabled received data is
+ * forwarded one frame per subpacket, frames being separated by gap_bits
+ * bit times without reception, 0 meaning 3.5 characters.
+ */
+__attribute__((packed)) struct uart_framing_config {
+  uint8_t framing;
+  uint8_t flags;
+  uint16_t gap_bits;
+};
+
+/* Optional tail of the CONFIGURE payload. Received data is held back until
+ * min_bytes have arrived, the line has been quiet for timeout_bits bit
+ * times or the oldest byte has waited max_latency_us, whichever comes first.
+ * 0 disables the respective condition.
+ */
+__attribute__((packed)) struct uart_rx_batch_config {
+  uint16_t min_bytes;
+  uint16_t timeout_bits;
+  uint16_t max_latency_us;
+};
+
+/* Response to GET_LINESTATE, the counters run since startup. */
+__attribute__((packed)) struct uart_linestate {
+  uint8_t lines;
+  uint32_t overrun;
+  uint32_t framing;
+  uint32_t parity;
+  uint32_t dropped;
+  uint32_t bad_frames;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+/* Accessed by the RX and TX DMA, mapped non-cacheable in MPU_Config(). */
+extern char uart_ring_buffer_memory[UART_RX_RING_BUFFER_SIZE];
+extern char uart_tx_ring_buffer_memory[UART_TX_RING_BUFFER_SIZE];
+
 /**************************************************************************************
  * FUNCTION DECLARATION
  **************************************************************************************/
 
 void uart_init();
 
-void uart_configure(uint8_t const * data);
+void uart_configure(uint8_t const * data, uint16_t const size);
+
+void uart_configure_framing(uint8_t const * data, uint16_t const size);
 
 int uart_write(uint8_t const * data, uint16_t size);
 
@@ -49,8 +127,12 @@ int uart_write_with_timeout(uint8_t *data, uint16_t size, uint32_t timeout);
 
 int uart_data_available();
 
-int uart_handle_data();
+int uart_handle_data(uint16_t const max_bytes);
+
+int uart_get_linestate();
 
 void UART2_enable_rx_irq();
 
+void uart_rx_timeout_irq();
+
 #endif /* UART_H */
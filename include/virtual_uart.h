@@ -19,12 +19,18 @@
 #ifndef PORTENTAX8_STM32H7_FW_VIRTUAL_UART_H
 #define PORTENTAX8_STM32H7_FW_VIRTUAL_UART_H
 
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include <stdint.h>
+
 /**************************************************************************************
  * FUNCTION DECLARATION
  **************************************************************************************/
 
 void virtual_uart_init();
 int  virtual_uart_data_available();
-int  virtual_uart_handle_data();
+int  virtual_uart_handle_data(uint16_t const max_bytes);
 
 #endif /* PORTENTAX8_STM32H7_FW_VIRTUAL_UART_H */
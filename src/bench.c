@@ -0,0 +1,354 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks of the hot-path primitives, built with "make bench" on
+ * the target and as build-host/micro_bench on the development machine.
+ * Both time with cycle_counter_get(), on the host the DWT is simulated
+ * from the monotonic clock.
+ */
+
+#ifdef BENCH
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "can.h"
+#include "can_handler.h"
+#include "ringbuffer.h"
+#include "system.h"
+#include "opcodes.h"
+#include "peripherals.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Unused peripheral id whose callback does nothing. */
+#define BENCH_PERIPHERAL        PERIPH_Reserved_1
+
+#define BENCH_SUPERFRAME_SIZE   (8 * 1024)
+
+#define BENCH_RING_BUFFER_SIZE  (4 * 1024)
+
+/* One TX FIFO worth of frames (TxFifoQueueElmtsNbr) is looped back at a time. */
+#define BENCH_CAN_FRAMES        (32)
+#define BENCH_CAN_TIMEOUT_us    (100000)
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct bench_result
+{
+  uint32_t ops;
+  uint64_t cycles;
+  uint64_t bytes;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+extern FDCAN_HandleTypeDef fdcan_1;
+
+static ring_buffer_t bench_ring_buffer;
+static spsc_ring_buffer_t bench_spsc_ring_buffer;
+RING_BUFFER_MEMORY(bench_ring_buffer_memory, BENCH_RING_BUFFER_SIZE);
+static uint8_t bench_data[1024];
+static uint8_t bench_superframe[BENCH_SUPERFRAME_SIZE];
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+static void bench_report(char const * name, uint16_t const size, struct bench_result const * r)
+{
+  if (r->ops == 0 || r->cycles == 0)
+    return;
+
+  uint32_t const mhz = SystemCoreClock / 1000000;
+  uint32_t const cycles_per_op = r->cycles / r->ops;
+  uint32_t const ns_x10 = (r->cycles * 10000 / mhz) / r->ops;
+
+  printf("%-20s %6u %8lu %10lu %8lu.%lu", name, size, (unsigned long)r->ops,
+         (unsigned long)cycles_per_op, (unsigned long)(ns_x10 / 10), (unsigned long)(ns_x10 % 10));
+
+  if (r->bytes) {
+    uint32_t const mbps_x100 = r->bytes * SystemCoreClock / r->cycles / 10000;
+    printf(" %8lu.%02lu\n", (unsigned long)(mbps_x100 / 100), (unsigned long)(mbps_x100 % 100));
+  }
+  else
+    printf(" %11s\n", "-");
+}
+
+static void bench_ring_buffer_arr(uint16_t const size)
+{
+  struct bench_result queue = {0};
+  struct bench_result dequeue = {0};
+  struct bench_result span = {0};
+  /* Batches stay below the capacity, nothing is overwritten. */
+  uint32_t const batch = (BENCH_RING_BUFFER_SIZE - 1) / size;
+
+  ring_buffer_init(&bench_ring_buffer, bench_ring_buffer_memory, sizeof(bench_ring_buffer_memory));
+
+  while (queue.ops < BENCH_ITERATIONS)
+  {
+    uint32_t const num = (BENCH_ITERATIONS - queue.ops < batch) ? (BENCH_ITERATIONS - queue.ops) : batch;
+
+    uint32_t start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+      ring_buffer_queue_arr(&bench_ring_buffer, (char const *)bench_data, size);
+    queue.cycles += cycle_counter_get() - start;
+
+    start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+      ring_buffer_dequeue_arr(&bench_ring_buffer, (char *)bench_data, size);
+    dequeue.cycles += cycle_counter_get() - start;
+
+    /* Consumers reading in place, once the data has been queued again. */
+    for (uint32_t i = 0; i < num; i++)
+      ring_buffer_queue_arr(&bench_ring_buffer, (char const *)bench_data, size);
+
+    start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+    {
+      for (uint16_t left = size; left > 0; )
+      {
+        char const * data;
+        ring_buffer_size_t const len = ring_buffer_peek_span(&bench_ring_buffer, &data);
+        left -= ring_buffer_discard(&bench_ring_buffer, (len < left) ? len : left);
+      }
+    }
+    span.cycles += cycle_counter_get() - start;
+
+    queue.ops += num;
+    queue.bytes += num * size;
+    dequeue.ops += num;
+    dequeue.bytes += num * size;
+    span.ops += num;
+    span.bytes += num * size;
+  }
+
+  bench_report("ring_queue_arr", size, &queue);
+  bench_report("ring_dequeue_arr", size, &dequeue);
+  bench_report("ring_peek_span", size, &span);
+}
+
+static void bench_spsc_ring_buffer_arr(uint16_t const size)
+{
+  struct bench_result queue = {0};
+  struct bench_result dequeue = {0};
+  uint32_t const batch = BENCH_RING_BUFFER_SIZE / size;
+
+  /* The policy with the extra lapping check on the consumer side. */
+  spsc_ring_buffer_init(&bench_spsc_ring_buffer, bench_ring_buffer_memory, sizeof(bench_ring_buffer_memory), SPSC_RING_BUFFER_OVERWRITE);
+
+  while (queue.ops < BENCH_ITERATIONS)
+  {
+    uint32_t const num = (BENCH_ITERATIONS - queue.ops < batch) ? (BENCH_ITERATIONS - queue.ops) : batch;
+
+    uint32_t start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+      spsc_ring_buffer_queue_arr(&bench_spsc_ring_buffer, (char const *)bench_data, size);
+    queue.cycles += cycle_counter_get() - start;
+
+    start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+      spsc_ring_buffer_dequeue_arr(&bench_spsc_ring_buffer, (char *)bench_data, size);
+    dequeue.cycles += cycle_counter_get() - start;
+
+    queue.ops += num;
+    queue.bytes += num * size;
+    dequeue.ops += num;
+    dequeue.bytes += num * size;
+  }
+
+  bench_report("spsc_queue_arr", size, &queue);
+  bench_report("spsc_dequeue_arr", size, &dequeue);
+}
+
+static void bench_enqueue_packet(uint16_t const size)
+{
+  struct bench_result r = {0};
+  uint32_t const batch = (TX_SUPERFRAME_MAX_SIZE - TX_HIGH_PRIORITY_LANE_SIZE) / (4 /* sizeof(subpacket.header) */ + size);
+
+  dma_bench_discard_tx();
+
+  while (r.ops < BENCH_ITERATIONS)
+  {
+    uint32_t const num = (BENCH_ITERATIONS - r.ops < batch) ? (BENCH_ITERATIONS - r.ops) : batch;
+
+    uint32_t const start = cycle_counter_get();
+    for (uint32_t i = 0; i < num; i++)
+      enqueue_packet(PERIPH_UART, DATA, size, bench_data);
+    r.cycles += cycle_counter_get() - start;
+
+    r.ops += num;
+    r.bytes += num * size;
+    dma_bench_discard_tx();
+  }
+
+  bench_report("enqueue_packet", size, &r);
+}
+
+static int bench_callback(uint8_t const opcode, uint8_t const * data, uint16_t const size)
+{
+  return 0;
+}
+
+static void bench_peripheral_invoke_callback()
+{
+  struct bench_result r = {0};
+
+  uint32_t const start = cycle_counter_get();
+  for (uint32_t i = 0; i < BENCH_ITERATIONS; i++)
+    peripheral_invoke_callback(BENCH_PERIPHERAL, 0, bench_data, 0);
+  r.cycles = cycle_counter_get() - start;
+  r.ops = BENCH_ITERATIONS;
+
+  bench_report("invoke_callback", 0, &r);
+}
+
+static void bench_dma_handle_data(uint16_t const size)
+{
+  struct bench_result r = {0};
+  uint16_t const num = BENCH_SUPERFRAME_SIZE / (4 /* sizeof(subpacket.header) */ + size);
+
+  memset(bench_superframe, 0, sizeof(bench_superframe));
+  for (uint16_t i = 0; i < num; i++)
+  {
+    uint8_t * subpkt = bench_superframe + i * (4 + size);
+    subpkt[0] = BENCH_PERIPHERAL;
+    subpkt[1] = 0;
+    subpkt[2] = size & 0xFF;
+    subpkt[3] = size >> 8;
+  }
+
+  while (r.ops < BENCH_ITERATIONS)
+  {
+    dma_bench_receive(bench_superframe, num * (4 + size));
+
+    /* The dispatch budget may split the walk over several calls. */
+    struct rx_queue_stats stats;
+    uint32_t const start = cycle_counter_get();
+    do {
+      dma_handle_data();
+      dma_get_rx_queue_stats(&stats);
+    } while (stats.used > 0);
+    r.cycles += cycle_counter_get() - start;
+
+    r.ops += num;
+    r.bytes += num * size;
+  }
+
+  bench_report("dma_handle_data", size, &r);
+}
+
+static void bench_can_handle_data(uint8_t const len)
+{
+  struct bench_result r = {0};
+  uint32_t const max_cycles = BENCH_CAN_TIMEOUT_us * (SystemCoreClock / 1000000);
+
+  while (r.ops < BENCH_ITERATIONS)
+  {
+    for (uint32_t i = 0; i < BENCH_CAN_FRAMES; i++)
+      can_write(&fdcan_1, i, len, 0, bench_data);
+
+    /* can_rx_fifo_available() counts the bytes in the RX ring buffer. */
+    uint32_t start = cycle_counter_get();
+    while (can_rx_fifo_available(&fdcan_1) < BENCH_CAN_FRAMES * (CAN_RX_FRAME_OVERHEAD + len) && (cycle_counter_get() - start) < max_cycles) { }
+
+    start = cycle_counter_get();
+    int const bytes = fdcan1_handle_data(TX_SUPERFRAME_MAX_SIZE);
+    uint32_t const cycles = cycle_counter_get() - start;
+    uint32_t const frames = bytes / (4 /* sizeof(subpacket.header) */ + X8H7_CAN_HEADER_SIZE + len);
+
+    dma_bench_discard_tx();
+
+    if (frames == 0) {
+      printf("%-20s %6u no frames looped back\n", "can_handle_data", len);
+      return;
+    }
+
+    r.cycles += cycles;
+    r.ops += frames;
+    r.bytes += frames * len;
+  }
+
+  bench_report("can_handle_data", len, &r);
+}
+
+void bench_run()
+{
+  static uint16_t const ring_sizes[] = {1, 16, 64, 256, 1024};
+  static uint16_t const packet_sizes[] = {8, 64, 256, 1024};
+  static uint16_t const subpacket_sizes[] = {0, 8, 64, 256};
+  static uint8_t const can_lens[] = {0, 8};
+
+  for (uint16_t i = 0; i < sizeof(bench_data); i++)
+    bench_data[i] = i;
+
+  printf("bench: %lu MHz, %u iterations\n", (unsigned long)(SystemCoreClock / 1000000), BENCH_ITERATIONS);
+  printf("%-20s %6s %8s %10s %10s %11s\n", "primitive", "size", "ops", "cycles/op", "ns/op", "MB/s");
+
+  for (uint8_t i = 0; i < sizeof(ring_sizes) / sizeof(ring_sizes[0]); i++)
+    bench_ring_buffer_arr(ring_sizes[i]);
+
+  for (uint8_t i = 0; i < sizeof(ring_sizes) / sizeof(ring_sizes[0]); i++)
+    bench_spsc_ring_buffer_arr(ring_sizes[i]);
+
+  for (uint8_t i = 0; i < sizeof(packet_sizes) / sizeof(packet_sizes[0]); i++)
+    bench_enqueue_packet(packet_sizes[i]);
+
+  peripheral_register_callback(BENCH_PERIPHERAL, &bench_callback);
+
+  bench_peripheral_invoke_callback();
+
+  for (uint8_t i = 0; i < sizeof(subpacket_sizes) / sizeof(subpacket_sizes[0]); i++)
+    bench_dma_handle_data(subpacket_sizes[i]);
+
+  peripheral_register_callback(BENCH_PERIPHERAL, NULL);
+
+  /* FDCAN1 in internal loopback, can_read() of the looped back frames is
+   * part of the measurement.
+   */
+  uint32_t const can_config[4] = {
+    4,  /* baud_rate_prescaler */
+    13, /* time_segment_1 */
+    2,  /* time_segment_2 */
+    1,  /* sync_jump_width */
+  };
+  fdcan1_handler(CAN_INIT, (uint8_t const *)can_config, sizeof(can_config));
+  can_set_loopback(&fdcan_1, true);
+
+  for (uint8_t i = 0; i < sizeof(can_lens) / sizeof(can_lens[0]); i++)
+    bench_can_handle_data(can_lens[i]);
+
+  can_set_loopback(&fdcan_1, false);
+  fdcan1_handler(CAN_DEINIT, NULL, 0);
+
+  dma_bench_discard_tx();
+}
+
+#endif /* BENCH */
@@ -31,6 +31,7 @@
 #include "opcodes.h"
 #include "peripherals.h"
 #include "error_handler.h"
+#include "ringbuffer.h"
 
 /**************************************************************************************
  * DEFINE
@@ -40,6 +41,28 @@
 #define CFG_HW_RCC_SEMID    3
 #undef DUAL_CORE
 
+/* Received frames waiting for a superframe, 455 of them at 8 data bytes
+ * or 110 CAN FD frames at 64 data bytes.
+ */
+#define CAN_RX_RING_BUFFER_SIZE  (8 * 1024)
+
+/* Transmitter delay compensation is limited to data phase prescalers of
+ * 1 and 2, with an offset of at most 127 mtq.
+ */
+#define CAN_TDC_MAX_PRESCALER    (2)
+#define CAN_TDC_MAX_OFFSET       (127)
+
+/* The 10 KiB message RAM is shared by both FDCANs. HAL_FDCAN_Init() does
+ * not accept a layout which includes the very last word.
+ */
+#define CAN_MESSAGE_RAM_WORDS    (10 * 1024 / 4 - 1)
+
+#define CAN_MAX_STD_FILTERS      (128)
+#define CAN_MAX_EXT_FILTERS      (64)
+#define CAN_MAX_RX_FIFO_ELEMENTS (64)
+#define CAN_MAX_TX_EVENTS        (32)
+#define CAN_MAX_TX_FIFO_ELEMENTS (32)
+
 /**************************************************************************************
  * GLOBAL VARIABLES
  **************************************************************************************/
@@ -49,6 +72,49 @@ FDCAN_HandleTypeDef fdcan_2;
 
 static uint32_t HAL_RCC_FDCAN_CLK_ENABLED = 0;
 
+static const uint8_t DLCtoBytes[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+
+/* Message RAM elements of a bus if CAN_INIT does not come with a profile,
+ * for classic CAN and for CAN FD. Both buses fit at the same time.
+ */
+static const struct can_ram_profile CAN_RAM_PROFILE_CLASSIC = {
+  .std_filters = 128, .ext_filters = 64, .rx_fifo0 = 64, .rx_fifo1 = 0, .tx_events = 32, .tx_fifo = 32,
+};
+static const struct can_ram_profile CAN_RAM_PROFILE_FD = {
+  .std_filters = 128, .ext_filters = 64, .rx_fifo0 = 32, .rx_fifo1 = 0, .tx_events = 16, .tx_fifo = 16,
+};
+
+/* The profile sent with CAN_INIT, kept for CAN_SET_BITTIMING, and the
+ * words of message RAM each bus occupies.
+ */
+static struct can_ram_profile can_ram_profile[2];
+static bool can_is_default_ram_profile[2] = {true, true};
+static uint32_t can_ram_words[2] = {0};
+
+/* Filled by can_rx_fifo_drain(), emptied by can_read(). A frame is stored
+ * as its 32 bit id, its length, its CANFD_* flags, the cycle counter at its
+ * reception, see can_rx_timestamp(), and its data.
+ */
+static spsc_ring_buffer_t can_rx_ring_buffer[2];
+RING_BUFFER_MEMORY(can1_rx_ring_buffer_memory, CAN_RX_RING_BUFFER_SIZE);
+RING_BUFFER_MEMORY(can2_rx_ring_buffer_memory, CAN_RX_RING_BUFFER_SIZE);
+/* Frames lost in the RX FIFO, and how many of them can_rx_overrun() has
+ * reported.
+ */
+static volatile uint32_t can_rx_lost[2] = {0};
+static uint32_t can_rx_lost_reported[2] = {0};
+/* Set while the new message interrupts are masked because
+ * can_rx_ring_buffer has no room for another frame, see can_rx_resume().
+ */
+static volatile bool can_rx_is_paused[2] = {false};
+/* Cycle counter when the last pause began, and whether the frames drained
+ * on resume get that time instead of their own, see can_rx_resume().
+ */
+static uint32_t can_rx_pause_cycles[2] = {0};
+static bool can_rx_is_timestamp_clamped[2] = {false};
+/* Length of a nominal bit in CPU cycles, as a 16.16 fixed point number. */
+static uint64_t can_rx_cycles_per_bit[2] = {0};
+
 /**************************************************************************************
  * FUNCTION DEFINITION
  **************************************************************************************/
@@ -117,11 +183,45 @@ void HAL_FDCAN_MspDeInit(FDCAN_HandleTypeDef *hfdcan)
   }
 }
 
+static inline uint8_t can_index(FDCAN_HandleTypeDef const * handle)
+{
+  return (handle == &fdcan_1) ? 0 : 1;
+}
+
+/* The interrupt line which drains the RX FIFOs, see can_rx_fifo_drain(). */
+static inline IRQn_Type can_rx_irqn(FDCAN_HandleTypeDef const * handle)
+{
+  return (handle == &fdcan_1) ? FDCAN1_IT0_IRQn : FDCAN2_IT0_IRQn;
+}
+
+/* The largest frame the bus can receive, as stored in can_rx_ring_buffer. */
+static inline uint32_t can_rx_frame_max_size(FDCAN_HandleTypeDef const * handle)
+{
+  return CAN_RX_FRAME_OVERHEAD + ((handle->Init.FrameFormat == FDCAN_FRAME_CLASSIC) ? X8H7_CAN_FRAME_MAX_DATA_LEN : X8H7_CANFD_FRAME_MAX_DATA_LEN);
+}
+
 int can_internal_init(FDCAN_HandleTypeDef * handle)
 {
   if (HAL_FDCAN_Init(handle) != HAL_OK)
     Error_Handler("HAL_FDCAN_Init Error_Handler\n");
 
+  /* At a few Mbit/s the transceiver loop delay is longer than a data phase
+   * bit, so the transmitter checks its own bits at a secondary sample point
+   * placed at the regular sample point of the data phase.
+   */
+  if (handle->Init.FrameFormat == FDCAN_FRAME_FD_BRS && handle->Init.DataPrescaler <= CAN_TDC_MAX_PRESCALER)
+  {
+    uint32_t tdc_offset = handle->Init.DataPrescaler * (1 + handle->Init.DataTimeSeg1);
+    if (tdc_offset > CAN_TDC_MAX_OFFSET)
+      tdc_offset = CAN_TDC_MAX_OFFSET;
+
+    if (HAL_FDCAN_ConfigTxDelayCompensation(handle, tdc_offset, 0) != HAL_OK)
+      Error_Handler("HAL_FDCAN_ConfigTxDelayCompensation Error_Handler\n");
+
+    if (HAL_FDCAN_EnableTxDelayCompensation(handle) != HAL_OK)
+      Error_Handler("HAL_FDCAN_EnableTxDelayCompensation Error_Handler\n");
+  }
+
   if (can_filter(handle, 0, 0, 0, false) == 0)
     Error_Handler("can_filter Error_Handler\n");
 
@@ -131,18 +231,113 @@ int can_internal_init(FDCAN_HandleTypeDef * handle)
   if (HAL_FDCAN_ConfigGlobalFilter(handle, FDCAN_REJECT, FDCAN_REJECT, FDCAN_FILTER_REMOTE, FDCAN_FILTER_REMOTE) != HAL_OK)
     Error_Handler("HAL_FDCAN_ConfigGlobalFilter Error_Handler\n");
 
+  /* Received frames are timestamped in nominal bit times, see can_rx_timestamp(). */
+  if (HAL_FDCAN_ConfigTimestampCounter(handle, FDCAN_TIMESTAMP_PRESC_1) != HAL_OK)
+    Error_Handler("HAL_FDCAN_ConfigTimestampCounter Error_Handler\n");
+
+  if (HAL_FDCAN_EnableTimestampCounter(handle, FDCAN_TIMESTAMP_INTERNAL) != HAL_OK)
+    Error_Handler("HAL_FDCAN_EnableTimestampCounter Error_Handler\n");
+
+  uint32_t const bit_clocks = handle->Init.NominalPrescaler * (1 + handle->Init.NominalTimeSeg1 + handle->Init.NominalTimeSeg2);
+  can_rx_cycles_per_bit[can_index(handle)] = (((uint64_t)bit_clocks * SystemCoreClock) << 16) / HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+
+  /* The RX FIFOs are drained by interrupt, see can_rx_fifo_drain(). */
+  if (HAL_FDCAN_ActivateNotification(handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO0_MESSAGE_LOST |
+                                             FDCAN_IT_RX_FIFO1_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_MESSAGE_LOST, 0) != HAL_OK)
+    Error_Handler("HAL_FDCAN_ActivateNotification Error_Handler\n");
+
   if (HAL_FDCAN_Start(handle) != HAL_OK)
     Error_Handler("HAL_FDCAN_Start Error_Handler\n");
 
   return 1;
 }
 
-void can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width)
+/* A data phase prescaler of 0 selects classic CAN, anything else CAN FD
+ * with bit rate switching.
+ */
+static void can_set_data_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width)
 {
+  bool const is_fd = (baud_rate_prescaler != 0);
+
+  handle->Init.FrameFormat          = is_fd ? FDCAN_FRAME_FD_BRS : FDCAN_FRAME_CLASSIC;
+  handle->Init.DataPrescaler        = is_fd ? baud_rate_prescaler : 1;
+  handle->Init.DataTimeSeg1         = is_fd ? time_segment_1      : 1;
+  handle->Init.DataTimeSeg2         = is_fd ? time_segment_2      : 1;
+  handle->Init.DataSyncJumpWidth    = is_fd ? sync_jump_width     : 1;
+}
+
+/* Places the elements of the profile in the message RAM. FDCAN1 grows
+ * from its start and FDCAN2 from its end, so that whatever one bus does
+ * not use is left to the other one. Fails without changing the layout if
+ * the profile is invalid or does not fit next to the other bus.
+ */
+static bool can_set_message_ram(FDCAN_HandleTypeDef * handle, struct can_ram_profile const * profile, bool const is_fd)
+{
+  if (profile->std_filters < 1 || profile->std_filters > CAN_MAX_STD_FILTERS ||
+      profile->ext_filters < 1 || profile->ext_filters > CAN_MAX_EXT_FILTERS ||
+      profile->rx_fifo0 < 1    || profile->rx_fifo0 > CAN_MAX_RX_FIFO_ELEMENTS ||
+      profile->rx_fifo1 > CAN_MAX_RX_FIFO_ELEMENTS ||
+      profile->tx_events > CAN_MAX_TX_EVENTS ||
+      profile->tx_fifo < 1     || profile->tx_fifo > CAN_MAX_TX_FIFO_ELEMENTS)
+    return false;
+
+  /* FDCAN_DATA_BYTES_x is the size of an element in words. */
+  uint32_t const element_size = is_fd ? FDCAN_DATA_BYTES_64 : FDCAN_DATA_BYTES_8;
+  uint32_t const words = profile->std_filters + 2 * profile->ext_filters +
+                         (profile->rx_fifo0 + profile->rx_fifo1) * element_size +
+                         2 * profile->tx_events + profile->tx_fifo * element_size;
+
+  uint8_t const index = can_index(handle);
+  if (words + can_ram_words[!index] > CAN_MESSAGE_RAM_WORDS)
+    return false;
+
+  can_ram_words[index] = words;
+  handle->Init.MessageRAMOffset = index ? (CAN_MESSAGE_RAM_WORDS - words) : 0;
+
+  handle->Init.StdFiltersNbr       = profile->std_filters;
+  handle->Init.ExtFiltersNbr       = profile->ext_filters;
+  handle->Init.RxFifo0ElmtsNbr     = profile->rx_fifo0;
+  handle->Init.RxFifo0ElmtSize     = element_size;
+  handle->Init.RxFifo1ElmtsNbr     = profile->rx_fifo1;
+  handle->Init.RxFifo1ElmtSize     = element_size;
+  handle->Init.RxBuffersNbr        = 0;
+  handle->Init.RxBufferSize        = element_size;
+  handle->Init.TxEventsNbr         = profile->tx_events;
+  handle->Init.TxBuffersNbr        = 0;
+  handle->Init.TxFifoQueueElmtsNbr = profile->tx_fifo;
+  handle->Init.TxElmtSize          = element_size;
+
+  return true;
+}
+
+static struct can_ram_profile const * can_get_ram_profile(FDCAN_HandleTypeDef const * handle, bool const is_fd)
+{
+  uint8_t const index = can_index(handle);
+  if (!can_is_default_ram_profile[index])
+    return &can_ram_profile[index];
+  return is_fd ? &CAN_RAM_PROFILE_FD : &CAN_RAM_PROFILE_CLASSIC;
+}
+
+/* Without a profile the bus gets CAN_RAM_PROFILE_CLASSIC or _FD. Returns
+ * 0 if the profile does not fit into the message RAM.
+ */
+int can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+             uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width,
+             struct can_ram_profile const * profile)
+{
+    uint8_t const index = can_index(handle);
+    bool const is_fd = (data_baud_rate_prescaler != 0);
+
+    if (!can_set_message_ram(handle, profile ? profile : (is_fd ? &CAN_RAM_PROFILE_FD : &CAN_RAM_PROFILE_CLASSIC), is_fd))
+      return 0;
+
+    can_is_default_ram_profile[index] = !profile;
+    if (profile)
+      can_ram_profile[index] = *profile;
+
     // Default values
     handle->Instance = (FDCAN_GlobalTypeDef *)peripheral;
 
-    handle->Init.FrameFormat = FDCAN_FRAME_CLASSIC;
     handle->Init.Mode = FDCAN_MODE_NORMAL;
     handle->Init.AutoRetransmission = ENABLE;
     handle->Init.TransmitPause = DISABLE;
@@ -151,44 +346,46 @@ void can_init(FDCAN_HandleTypeDef * handle, CANName peripheral, uint32_t const b
     handle->Init.NominalTimeSeg1 = time_segment_1;
     handle->Init.NominalTimeSeg2 = time_segment_2;
     handle->Init.NominalSyncJumpWidth = sync_jump_width;
-    handle->Init.DataPrescaler = 0x1;       // Not used - only in FDCAN
-    handle->Init.DataSyncJumpWidth = 0x1;   // Not used - only in FDCAN
-    handle->Init.DataTimeSeg1 = 0x1;        // Not used - only in FDCAN
-    handle->Init.DataTimeSeg2 = 0x1;        // Not used - only in FDCAN
+    handle->Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION;
 
-    /* Message RAM offset is only supported in STM32H7 platforms of supported FDCAN platforms */
-    handle->Init.MessageRAMOffset = 0;
+    can_set_data_bittiming(handle, data_baud_rate_prescaler, data_time_segment_1, data_time_segment_2, data_sync_jump_width);
 
-    /* The number of Standard and Extended ID filters are initialized to the maximum possible extent
-     * for STM32H7 platforms
+    /* The bus may still be running, keep its interrupt from draining the
+     * RX FIFOs into the ring buffer while it is reset.
      */
-    handle->Init.StdFiltersNbr = 128; // to be aligned with the handle parameter in can_filter
-    handle->Init.ExtFiltersNbr = 64; // to be aligned with the handle parameter in can_filter
-
-    handle->Init.RxFifo0ElmtsNbr = 64;
-    handle->Init.RxFifo0ElmtSize = FDCAN_DATA_BYTES_8;
-    handle->Init.RxFifo1ElmtsNbr =  0;
-    handle->Init.RxFifo1ElmtSize = FDCAN_DATA_BYTES_8;
-    handle->Init.RxBuffersNbr    =  0;
-    handle->Init.RxBufferSize    = FDCAN_DATA_BYTES_8;
-
-    handle->Init.TxEventsNbr         = 32;
-    handle->Init.TxBuffersNbr        =  0;
-    handle->Init.TxFifoQueueElmtsNbr = 32;
-    handle->Init.TxFifoQueueMode     = FDCAN_TX_FIFO_OPERATION;
-    handle->Init.TxElmtSize          = FDCAN_DATA_BYTES_8;
-
-    can_internal_init(handle);
+    IRQn_Type const irqn = can_rx_irqn(handle);
+    uint32_t const is_irq_enabled = NVIC_GetEnableIRQ(irqn);
+    HAL_NVIC_DisableIRQ(irqn);
+
+    spsc_ring_buffer_init(&can_rx_ring_buffer[index],
+                          index ? can2_rx_ring_buffer_memory : can1_rx_ring_buffer_memory,
+                          CAN_RX_RING_BUFFER_SIZE, SPSC_RING_BUFFER_DROP_NEW);
+    can_rx_lost_reported[index] = can_rx_lost[index];
+    /* can_internal_init() activates the new message interrupts again. */
+    can_rx_is_paused[index] = false;
+
+    if (is_irq_enabled)
+      HAL_NVIC_EnableIRQ(irqn);
+
+    return can_internal_init(handle);
 }
 
 void can_deinit(FDCAN_HandleTypeDef * handle)
 {
   HAL_FDCAN_Stop(handle);
   HAL_FDCAN_DeInit(handle);
+
+  can_ram_words[can_index(handle)] = 0;
 }
 
-int can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width)
+int can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width,
+                      uint32_t const data_baud_rate_prescaler, uint32_t const data_time_segment_1, uint32_t const data_time_segment_2, uint32_t const data_sync_jump_width)
 {
+  /* Switching between classic CAN and CAN FD changes the element size. */
+  bool const is_fd = (data_baud_rate_prescaler != 0);
+  if (!can_set_message_ram(handle, can_get_ram_profile(handle, is_fd), is_fd))
+    return 0;
+
   if (HAL_FDCAN_Stop(handle) != HAL_OK)
     Error_Handler("HAL_FDCAN_Stop Error_Handler\n");
 
@@ -197,6 +394,21 @@ int can_set_bittiming(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_pre
   handle->Init.NominalTimeSeg2      = time_segment_2;
   handle->Init.NominalSyncJumpWidth = sync_jump_width;
 
+  can_set_data_bittiming(handle, data_baud_rate_prescaler, data_time_segment_1, data_time_segment_2, data_sync_jump_width);
+
+  return can_internal_init(handle);
+}
+
+/* Internal loopback: transmitted frames are received by the same FDCAN
+ * without going out on the bus.
+ */
+int can_set_loopback(FDCAN_HandleTypeDef * handle, bool const is_loopback)
+{
+  if (HAL_FDCAN_Stop(handle) != HAL_OK)
+    Error_Handler("HAL_FDCAN_Stop Error_Handler\n");
+
+  handle->Init.Mode = is_loopback ? FDCAN_MODE_INTERNAL_LOOPBACK : FDCAN_MODE_NORMAL;
+
   return can_internal_init(handle);
 }
 
@@ -204,10 +416,15 @@ int can_filter(FDCAN_HandleTypeDef * handle, uint32_t const filter_index, uint32
 {
   FDCAN_FilterTypeDef sFilterConfig = {0};
 
+  /* The filter would end up in the message RAM of the next list or bus. */
+  if (filter_index >= (is_extended_id ? handle->Init.ExtFiltersNbr : handle->Init.StdFiltersNbr))
+    return 0;
+
   sFilterConfig.IdType = is_extended_id ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
   sFilterConfig.FilterIndex = filter_index;
   sFilterConfig.FilterType = FDCAN_FILTER_MASK;
-  sFilterConfig.FilterConfig = FDCAN_FILTER_TO_RXFIFO0;
+  /* If there is a RX FIFO1, it takes the frames with extended ids. */
+  sFilterConfig.FilterConfig = (is_extended_id && handle->Init.RxFifo1ElmtsNbr) ? FDCAN_FILTER_TO_RXFIFO1 : FDCAN_FILTER_TO_RXFIFO0;
   sFilterConfig.FilterID1 = is_extended_id ? (id & CAN_EFF_MASK) : (id & CAN_SFF_MASK);
   sFilterConfig.FilterID2 = is_extended_id ? (mask & CAN_EFF_MASK) : (mask & CAN_SFF_MASK);
 
@@ -223,9 +440,49 @@ uint32_t can_tx_fifo_available(FDCAN_HandleTypeDef * handle)
   return HAL_FDCAN_GetTxFifoFreeLevel(handle);
 }
 
-int can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const * data)
+/* Returns the number of bytes of received frames, not of frames. */
+uint32_t can_rx_fifo_available(FDCAN_HandleTypeDef * handle)
+{
+  return spsc_ring_buffer_num_items(&can_rx_ring_buffer[can_index(handle)]);
+}
+
+bool can_rx_overrun(FDCAN_HandleTypeDef * handle)
+{
+  uint8_t const index = can_index(handle);
+  uint32_t const lost = can_rx_lost[index];
+  bool const is_overrun = (lost != can_rx_lost_reported[index]);
+  can_rx_lost_reported[index] = lost;
+  return is_overrun;
+}
+
+/* Id, length and flags of the next frame can_read() returns, so that room
+ * for it can be made before it is taken out of the ring buffer.
+ */
+int can_rx_peek(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags)
+{
+  spsc_ring_buffer_t * rx = &can_rx_ring_buffer[can_index(handle)];
+
+  char header[X8H7_CANFD_HEADER_SIZE];
+  for (uint8_t i = 0; i < sizeof(header); i++)
+    if (!spsc_ring_buffer_peek(rx, &header[i], i))
+      return 0; // No message arrived
+
+  memcpy(id, header, sizeof(*id));
+  *len = header[sizeof(*id)];
+  *flags = header[sizeof(*id) + 1];
+  return 1;
+}
+
+/* CAN FD frames are sent with the next larger valid length, the data
+ * has to be padded up to it.
+ */
+int can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const flags, uint8_t const * data)
 {
   FDCAN_TxHeaderTypeDef TxHeader = {0};
+  bool const is_fd = (flags & CANFD_FDF);
+
+  if (is_fd && handle->Init.FrameFormat == FDCAN_FRAME_CLASSIC)
+    return -HAL_FDCAN_ERROR_NOT_SUPPORTED;
 
   if (id & CAN_EFF_FLAG)
   {
@@ -239,29 +496,13 @@ int can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len
   }
 
     TxHeader.TxFrameType = FDCAN_DATA_FRAME;
-    switch (len)
-    {
-      default:
-      case 0:  TxHeader.DataLength = FDCAN_DLC_BYTES_0;  break;
-      case 1:  TxHeader.DataLength = FDCAN_DLC_BYTES_1;  break;
-      case 2:  TxHeader.DataLength = FDCAN_DLC_BYTES_2;  break;
-      case 3:  TxHeader.DataLength = FDCAN_DLC_BYTES_3;  break;
-      case 4:  TxHeader.DataLength = FDCAN_DLC_BYTES_4;  break;
-      case 5:  TxHeader.DataLength = FDCAN_DLC_BYTES_5;  break;
-      case 6:  TxHeader.DataLength = FDCAN_DLC_BYTES_6;  break;
-      case 7:  TxHeader.DataLength = FDCAN_DLC_BYTES_7;  break;
-      case 8:  TxHeader.DataLength = FDCAN_DLC_BYTES_8;  break;
-      case 12: TxHeader.DataLength = FDCAN_DLC_BYTES_12; break;
-      case 16: TxHeader.DataLength = FDCAN_DLC_BYTES_16; break;
-      case 20: TxHeader.DataLength = FDCAN_DLC_BYTES_20; break;
-      case 24: TxHeader.DataLength = FDCAN_DLC_BYTES_24; break;
-      case 32: TxHeader.DataLength = FDCAN_DLC_BYTES_32; break;
-      case 48: TxHeader.DataLength = FDCAN_DLC_BYTES_48; break;
-      case 64: TxHeader.DataLength = FDCAN_DLC_BYTES_64; break;
-    }
-    TxHeader.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
-    TxHeader.BitRateSwitch = FDCAN_BRS_OFF;
-    TxHeader.FDFormat = FDCAN_CLASSIC_CAN;
+    uint32_t dlc = 0;
+    while (dlc < (is_fd ? 15 : 8) && DLCtoBytes[dlc] < len)
+      dlc++;
+    TxHeader.DataLength = dlc << 16; /* FDCAN_DLC_BYTES_x */
+    TxHeader.ErrorStateIndicator = (is_fd && (flags & CANFD_ESI)) ? FDCAN_ESI_PASSIVE : FDCAN_ESI_ACTIVE;
+    TxHeader.BitRateSwitch = (is_fd && (flags & CANFD_BRS)) ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+    TxHeader.FDFormat = is_fd ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
     TxHeader.TxEventFifoControl = FDCAN_STORE_TX_EVENTS;
     TxHeader.MessageMarker = 0;
 
@@ -274,35 +515,146 @@ int can_write(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len
     return 0;
 }
 
-int can_read(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * data)
+/* The cycle counter at the reception of a frame, from its RxTimestamp and
+ * the age that gives it. The timestamp counter wraps after 65536 bit
+ * times, e.g. 65 ms at 1 Mbit/s, a frame held back in the RX FIFO for
+ * longer would appear younger by a multiple of that, see can_rx_resume().
+ */
+static uint32_t can_rx_timestamp(FDCAN_HandleTypeDef * handle, uint32_t const rx_timestamp)
 {
-  static const uint8_t DLCtoBytes[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64};
+  uint32_t const now = cycle_counter_get();
+  uint16_t const age_bits = HAL_FDCAN_GetTimestampCounter(handle) - rx_timestamp;
+  return now - (uint32_t)((age_bits * can_rx_cycles_per_bit[can_index(handle)]) >> 16);
+}
 
-  if (HAL_FDCAN_GetRxFifoFillLevel(handle, FDCAN_RX_FIFO0) == 0)
-    return 0; // No message arrived
+/* Moves everything from a RX FIFO into can_rx_ring_buffer, so that a
+ * burst does not have to wait for the main loop. Once the ring buffer has
+ * no room for another frame the new message interrupts are masked, the
+ * frames wait in the RX FIFO until can_read() has made room again. Both
+ * FIFOs are drained from the same interrupt, i.e. there is a single
+ * producer.
+ */
+static void can_rx_fifo_drain(FDCAN_HandleTypeDef * handle, uint32_t const fifo)
+{
+  uint8_t const index = can_index(handle);
+  spsc_ring_buffer_t * rx = &can_rx_ring_buffer[index];
 
-  FDCAN_RxHeaderTypeDef RxHeader = {0};
-  uint8_t RxData[64] = {0};
-  if (HAL_FDCAN_GetRxMessage(handle, FDCAN_RX_FIFO0, &RxHeader, RxData) != HAL_OK)
+  while (HAL_FDCAN_GetRxFifoFillLevel(handle, fifo) > 0)
   {
-    Error_Handler("HAL_FDCAN_GetRxMessage Error_Handler\n"); // Should not occur as previous HAL_FDCAN_GetRxFifoFillLevel call reported some data
-    return 0;
+    if (rx->mask + 1 - spsc_ring_buffer_num_items(rx) < can_rx_frame_max_size(handle))
+    {
+      can_rx_is_paused[index] = true;
+      can_rx_pause_cycles[index] = cycle_counter_get();
+      HAL_FDCAN_DeactivateNotification(handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_NEW_MESSAGE);
+      return;
+    }
+
+    FDCAN_RxHeaderTypeDef RxHeader = {0};
+    uint8_t RxData[64] = {0};
+    if (HAL_FDCAN_GetRxMessage(handle, fifo, &RxHeader, RxData) != HAL_OK)
+      break;
+
+    uint32_t id;
+    if (RxHeader.IdType == FDCAN_EXTENDED_ID)
+      id = CAN_EFF_FLAG | (RxHeader.Identifier & CAN_EFF_MASK);
+    else
+      id =                (RxHeader.Identifier & CAN_SFF_MASK);
+
+    if (RxHeader.RxFrameType == FDCAN_REMOTE_FRAME)
+      id |= CAN_RTR_FLAG;
+
+    uint8_t flags = 0;
+    if (RxHeader.FDFormat == FDCAN_FD_CAN)
+      flags |= CANFD_FDF;
+    if (RxHeader.BitRateSwitch == FDCAN_BRS_ON)
+      flags |= CANFD_BRS;
+    if (RxHeader.ErrorStateIndicator == FDCAN_ESI_PASSIVE)
+      flags |= CANFD_ESI;
+
+    uint8_t len = DLCtoBytes[RxHeader.DataLength >> 16];
+    if (!(flags & CANFD_FDF) && len > X8H7_CAN_FRAME_MAX_DATA_LEN)
+      len = X8H7_CAN_FRAME_MAX_DATA_LEN;
+
+    uint32_t const timestamp = can_rx_is_timestamp_clamped[index] ? can_rx_pause_cycles[index]
+                                                                  : can_rx_timestamp(handle, RxHeader.RxTimestamp);
+
+    /* A frame is queued as a whole or not at all. */
+    char frame[CAN_RX_FRAME_OVERHEAD + X8H7_CANFD_FRAME_MAX_DATA_LEN];
+    memcpy(frame, &id, sizeof(id));
+    frame[sizeof(id)] = len;
+    frame[sizeof(id) + 1] = flags;
+    memcpy(frame + X8H7_CANFD_HEADER_SIZE, &timestamp, sizeof(timestamp));
+    memcpy(frame + CAN_RX_FRAME_OVERHEAD, RxData, len);
+
+    spsc_ring_buffer_queue_arr(rx, frame, CAN_RX_FRAME_OVERHEAD + len);
   }
+}
 
-  if (RxHeader.IdType == FDCAN_EXTENDED_ID)
-    *id = CAN_EFF_FLAG | (RxHeader.Identifier & CAN_EFF_MASK);
-  else
-    *id =                (RxHeader.Identifier & CAN_SFF_MASK);
+/* Called by the consumer once it has taken a frame out of
+ * can_rx_ring_buffer. The frames which have arrived meanwhile raised no
+ * interrupt, they are drained here with the interrupt line masked, so
+ * that there still is a single producer. If the pause lasted for a period
+ * of the timestamp counter or more, the age of these frames is not known,
+ * they get the time the pause began. That keeps them in order and no
+ * later than they have been received.
+ */
+static void can_rx_resume(FDCAN_HandleTypeDef * handle)
+{
+  uint8_t const index = can_index(handle);
+  spsc_ring_buffer_t * rx = &can_rx_ring_buffer[index];
+
+  if (!can_rx_is_paused[index] || rx->mask + 1 - spsc_ring_buffer_num_items(rx) < can_rx_frame_max_size(handle))
+    return;
+
+  IRQn_Type const irqn = can_rx_irqn(handle);
+  HAL_NVIC_DisableIRQ(irqn);
+
+  uint64_t const period_cycles = (65536 * can_rx_cycles_per_bit[index]) >> 16;
+  can_rx_is_timestamp_clamped[index] = (cycle_counter_get() - can_rx_pause_cycles[index]) >= period_cycles;
 
-  if (RxHeader.RxFrameType == FDCAN_REMOTE_FRAME)
-    *id |= CAN_RTR_FLAG;
+  can_rx_is_paused[index] = false;
+  HAL_FDCAN_ActivateNotification(handle, FDCAN_IT_RX_FIFO0_NEW_MESSAGE | FDCAN_IT_RX_FIFO1_NEW_MESSAGE, 0);
+  can_rx_fifo_drain(handle, FDCAN_RX_FIFO0);
+  can_rx_fifo_drain(handle, FDCAN_RX_FIFO1);
+  can_rx_is_timestamp_clamped[index] = false;
 
-  *len = DLCtoBytes[RxHeader.DataLength >> 16];
-  if (*len > X8H7_CAN_FRAME_MAX_DATA_LEN)
-    *len = X8H7_CAN_FRAME_MAX_DATA_LEN;
+  HAL_NVIC_EnableIRQ(irqn);
+}
+
+void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef * handle, uint32_t RxFifo0ITs)
+{
+  if (RxFifo0ITs & FDCAN_IT_RX_FIFO0_MESSAGE_LOST)
+    can_rx_lost[can_index(handle)]++;
+
+  can_rx_fifo_drain(handle, FDCAN_RX_FIFO0);
+}
+
+void HAL_FDCAN_RxFifo1Callback(FDCAN_HandleTypeDef * handle, uint32_t RxFifo1ITs)
+{
+  if (RxFifo1ITs & FDCAN_IT_RX_FIFO1_MESSAGE_LOST)
+    can_rx_lost[can_index(handle)]++;
+
+  can_rx_fifo_drain(handle, FDCAN_RX_FIFO1);
+}
+
+/* timestamp is the cycle counter at the reception of the frame, see
+ * can_rx_timestamp().
+ */
+int can_read(FDCAN_HandleTypeDef * handle, uint32_t * id, uint8_t * len, uint8_t * flags, uint32_t * timestamp, uint8_t * data)
+{
+  spsc_ring_buffer_t * rx = &can_rx_ring_buffer[can_index(handle)];
+
+  char header[CAN_RX_FRAME_OVERHEAD];
+  if (spsc_ring_buffer_dequeue_arr(rx, header, sizeof(header)) != sizeof(header))
+    return 0; // No message arrived
 
-  memcpy(data, RxData, *len);
+  memcpy(id, header, sizeof(*id));
+  *len = header[sizeof(*id)];
+  *flags = header[sizeof(*id) + 1];
+  memcpy(timestamp, header + X8H7_CANFD_HEADER_SIZE, sizeof(*timestamp));
+  spsc_ring_buffer_dequeue_arr(rx, (char *)data, *len);
 
+  can_rx_resume(handle);
   return 1;
 }
 
@@ -49,6 +49,38 @@
 #define X8H7_CAN_STS_INT_RX      0x02
 #define X8H7_CAN_STS_INT_ERR     0x04
 
+/* CAN_INIT and CAN_SET_BITTIMING without the data phase bit timing, and
+ * CAN_INIT without the message RAM profile.
+ */
+#define X8H7_CAN_NOMINAL_BITTIMING_SIZE  (4 * sizeof(uint32_t))
+#define X8H7_CAN_BITTIMING_SIZE          (8 * sizeof(uint32_t))
+
+/* Frames of a CAN_TX_BATCH beyond this are not looked at. */
+#define X8H7_CAN_TX_BATCH_MAX_FRAMES     64
+/* No CAN_TX_BATCH_STATUS if all frames of the batch have been queued. */
+#define X8H7_CAN_TX_BATCH_FLG_NO_ACK     0x01
+
+/* How received frames are sent to the AP, see CAN_RX_CONFIG. */
+#define X8H7_CAN_RX_FORMAT_FRAME         0  // One CAN_RX_FRAME or CAN_RX_FD_FRAME per frame
+#define X8H7_CAN_RX_FORMAT_BATCH         1  // CAN_RX_BATCH
+/* Every frame of a CAN_RX_BATCH carries the time since the previous one. */
+#define X8H7_CAN_RX_FLG_TIMESTAMP        0x01
+
+/* Per frame header of a CAN_RX_BATCH, the DLC is in the lower 4 bits. */
+#define X8H7_CAN_RX_BATCH_DLC_MASK       0x0F
+#define X8H7_CAN_RX_BATCH_RTR            0x10  // Remote frame, classic CAN only
+#define X8H7_CAN_RX_BATCH_BRS            0x10  // CANFD_BRS, CAN FD only
+#define X8H7_CAN_RX_BATCH_ESI            0x20  // CANFD_ESI
+#define X8H7_CAN_RX_BATCH_FDF            0x40  // CAN FD frame
+#define X8H7_CAN_RX_BATCH_EFF            0x80  // 29 bit id, otherwise 11 bit
+#define X8H7_CAN_RX_BATCH_MAX_FRAMES     255
+/* Time since the previous frame is unknown or does not fit. */
+#define X8H7_CAN_RX_BATCH_DELTA_MAX      0xFFFF
+/* Pauses shorter than this are timed with the cycle counter, which wraps
+ * after 2^32 / SystemCoreClock, i.e. 8.9 s at 480 MHz.
+ */
+#define CAN_RX_TICK_VALID_ms             1000
+
 /**************************************************************************************
  * TYPEDEF
  **************************************************************************************/
@@ -61,8 +93,15 @@ union x8h7_can_init_message
     uint32_t time_segment_1;
     uint32_t time_segment_2;
     uint32_t sync_jump_width;
+    uint32_t data_baud_rate_prescaler;     // 0 for classic CAN
+    uint32_t data_time_segment_1;
+    uint32_t data_time_segment_2;
+    uint32_t data_sync_jump_width;
+    struct can_ram_profile ram_profile;   // Optional
   } field;
-  uint8_t buf[sizeof(uint32_t) /* can_bitrate_Hz */ + sizeof(uint32_t) /* time_segment_1 */ + sizeof(uint32_t) /* time_segment_2 */ + sizeof(uint32_t) /* sync_jump_width */];
+  uint8_t buf[sizeof(uint32_t) /* can_bitrate_Hz */ + sizeof(uint32_t) /* time_segment_1 */ + sizeof(uint32_t) /* time_segment_2 */ + sizeof(uint32_t) /* sync_jump_width */ +
+              sizeof(uint32_t) /* data_baud_rate_prescaler */ + sizeof(uint32_t) /* data_time_segment_1 */ + sizeof(uint32_t) /* data_time_segment_2 */ + sizeof(uint32_t) /* data_sync_jump_width */ +
+              sizeof(struct can_ram_profile) /* ram_profile */];
 };
 
 union x8h7_can_bittiming_message
@@ -73,8 +112,13 @@ union x8h7_can_bittiming_message
     uint32_t time_segment_1;
     uint32_t time_segment_2;
     uint32_t sync_jump_width;
+    uint32_t data_baud_rate_prescaler;     // 0 for classic CAN
+    uint32_t data_time_segment_1;
+    uint32_t data_time_segment_2;
+    uint32_t data_sync_jump_width;
   } field;
-  uint8_t buf[sizeof(uint32_t) /* can_bitrate_Hz */ + sizeof(uint32_t) /* time_segment_1 */ + sizeof(uint32_t) /* time_segment_2 */ + sizeof(uint32_t) /* sync_jump_width */];
+  uint8_t buf[sizeof(uint32_t) /* can_bitrate_Hz */ + sizeof(uint32_t) /* time_segment_1 */ + sizeof(uint32_t) /* time_segment_2 */ + sizeof(uint32_t) /* sync_jump_width */ +
+              sizeof(uint32_t) /* data_baud_rate_prescaler */ + sizeof(uint32_t) /* data_time_segment_1 */ + sizeof(uint32_t) /* data_time_segment_2 */ + sizeof(uint32_t) /* data_sync_jump_width */];
 };
 
 union x8h7_can_filter_message
@@ -99,6 +143,36 @@ union x8h7_can_frame_message
   uint8_t buf[X8H7_CAN_HEADER_SIZE + X8H7_CAN_FRAME_MAX_DATA_LEN];
 };
 
+union x8h7_canfd_frame_message
+{
+  struct __attribute__((packed))
+  {
+    uint32_t id;                           // 29 bit identifier
+    uint8_t  len;                          // Length of data field in bytes
+    uint8_t  flags;                        // CANFD_BRS, CANFD_ESI
+    uint8_t  data[X8H7_CANFD_FRAME_MAX_DATA_LEN]; // Data field
+  } field;
+  uint8_t buf[X8H7_CANFD_HEADER_SIZE + X8H7_CANFD_FRAME_MAX_DATA_LEN];
+};
+
+union x8h7_can_rx_config_message
+{
+  struct __attribute__((packed))
+  {
+    uint8_t format;                        // X8H7_CAN_RX_FORMAT_*
+    uint8_t flags;                         // X8H7_CAN_RX_FLG_*
+  } field;
+  uint8_t buf[sizeof(uint8_t) /* format */ + sizeof(uint8_t) /* flags */];
+};
+
+struct __attribute__((packed)) x8h7_can_tx_batch_status
+{
+  uint8_t accepted;                        // Frames taken from the start of the batch
+  uint8_t queued;                          // ... and put into the TX FIFO
+  uint8_t rejected;                        // ... and refused
+  uint8_t bitmap[X8H7_CAN_TX_BATCH_MAX_FRAMES / 8]; // Bit i is set if frame i was queued
+};
+
 /**************************************************************************************
  * GLOBAL VARIABLES
  **************************************************************************************/
@@ -109,65 +183,255 @@ extern FDCAN_HandleTypeDef fdcan_2;
 static bool is_can1_init = false;
 static bool is_can2_init = false;
 
+/* Negotiated with CAN_RX_CONFIG, and the cycle counter of the last frame
+ * sent in a CAN_RX_BATCH, which the time of the next one is relative to.
+ * The tick of that frame tells whether the cycle counter has wrapped since.
+ */
+struct can_rx_state
+{
+  union x8h7_can_rx_config_message config;
+  bool is_timestamp_valid;
+  uint32_t timestamp;
+  uint32_t tick;
+};
+
+static struct can_rx_state can1_rx_state = {0};
+static struct can_rx_state can2_rx_state = {0};
+
 /**************************************************************************************
  * FUNCTION DECLARATION
  **************************************************************************************/
 
+static int can_handle_rx_batch(FDCAN_HandleTypeDef * handle, uint8_t const peripheral, uint16_t const max_bytes);
+static int can_handle_rx(FDCAN_HandleTypeDef * handle, uint8_t const peripheral, uint16_t const max_bytes);
 static int fdcan_handler(FDCAN_HandleTypeDef * handle, uint8_t const opcode, uint8_t const * data, uint16_t const size);
-static int on_CAN_INIT_Request(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width);
+static int on_CAN_INIT_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_init_message const * msg, bool const has_ram_profile);
 static int on_CAN_DEINIT_Request(FDCAN_HandleTypeDef * handle);
-static int on_CAN_SET_BITTIMING_Request(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width);
+static int on_CAN_SET_BITTIMING_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_bittiming_message const * msg);
+static int on_CAN_RX_CONFIG_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_rx_config_message const * msg);
 static int on_CAN_FILTER_Request(FDCAN_HandleTypeDef * handle, uint32_t const filter_index, uint32_t const id, uint32_t const mask);
-static int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_frame_message const * msg);
+static int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const flags, uint8_t const * data);
+static int on_CAN_TX_BATCH_Request(FDCAN_HandleTypeDef * handle, uint8_t const batch_flags, uint8_t const * frames, uint16_t const size);
 
 /**************************************************************************************
  * FUNCTION DEFINITION
  **************************************************************************************/
 
-int can_handle_data()
+static inline struct can_rx_state * can_rx_state_of(FDCAN_HandleTypeDef const * handle)
 {
-  int bytes_enqueued = 0;
+  return (handle == &fdcan_1) ? &can1_rx_state : &can2_rx_state;
+}
+
+static uint8_t can_rx_batch_header_size(struct can_rx_state const * state, uint32_t const id)
+{
+  return sizeof(uint8_t) /* info */ +
+         ((id & CAN_EFF_FLAG) ? sizeof(uint32_t) : sizeof(uint16_t)) /* id */ +
+         ((state->config.field.flags & X8H7_CAN_RX_FLG_TIMESTAMP) ? sizeof(uint16_t) : 0) /* delta_us */;
+}
+
+static uint8_t can_len_to_dlc(uint8_t const len)
+{
+  static const uint8_t FD_LENS[] = {12, 16, 20, 24, 32, 48, 64};
+
+  if (len <= X8H7_CAN_FRAME_MAX_DATA_LEN)
+    return len;
+
+  uint8_t dlc = X8H7_CAN_FRAME_MAX_DATA_LEN + 1;
+  for (uint8_t i = 0; i < sizeof(FD_LENS) - 1 && FD_LENS[i] < len; i++)
+    dlc++;
+  return dlc;
+}
+
+/* Packs as many frames as fit into a single CAN_RX_BATCH: their number,
+ * then each frame with a compact header of its own, see PROTOCOL.md.
+ */
+int can_handle_rx_batch(FDCAN_HandleTypeDef * handle, uint8_t const peripheral, uint16_t const max_bytes)
+{
+  struct can_rx_state * state = can_rx_state_of(handle);
+
+  if (max_bytes <= 4 /* sizeof(subpacket.header) */ + sizeof(uint8_t) /* count */)
+    return 0;
+  uint16_t const max_size = max_bytes - 4 /* sizeof(subpacket.header) */;
+
   uint32_t can_id = 0;
   uint8_t can_len = 0;
-  uint8_t can_data[X8H7_CAN_FRAME_MAX_DATA_LEN] = {0};
+  uint8_t can_flags = 0;
+  if (!can_rx_peek(handle, &can_id, &can_len, &can_flags) ||
+      (sizeof(uint8_t) /* count */ + can_rx_batch_header_size(state, can_id) + can_len) > max_size)
+    return 0;
 
-  /* Note: the last read package is lost in this implementation. We need to fix this by
-   * implementing some peek method or by buffering messages in a ringbuffer.
-   */
+  /* A frame takes less room in the batch than in the RX ring buffer. */
+  uint32_t const available = sizeof(uint8_t) /* count */ + can_rx_fifo_available(handle);
+  struct tx_handle const tx = tx_reserve(peripheral, CAN_RX_BATCH, (available < max_size) ? available : max_size);
+  if (!tx.data)
+    return 0;
 
-  if (is_can1_init)
+  uint8_t count = 0;
+  uint16_t size = sizeof(count);
+  while (count < X8H7_CAN_RX_BATCH_MAX_FRAMES && can_rx_peek(handle, &can_id, &can_len, &can_flags))
   {
-    for (int rc_enq = 0; can_read(&fdcan_1, &can_id, &can_len, can_data); bytes_enqueued += rc_enq)
+    uint8_t const header_size = can_rx_batch_header_size(state, can_id);
+    if ((size + header_size + can_len) > tx.max_size)
+      break;
+
+    uint8_t * frame = tx.data + size;
+    uint32_t timestamp = 0;
+    can_read(handle, &can_id, &can_len, &can_flags, &timestamp, frame + header_size);
+
+    uint8_t info = can_len_to_dlc(can_len);
+    if (can_flags & CANFD_FDF)
     {
-      union x8h7_can_frame_message x8h7_msg;
+      info |= X8H7_CAN_RX_BATCH_FDF;
+      if (can_flags & CANFD_BRS) info |= X8H7_CAN_RX_BATCH_BRS;
+      if (can_flags & CANFD_ESI) info |= X8H7_CAN_RX_BATCH_ESI;
+    }
+    else if (can_id & CAN_RTR_FLAG)
+      info |= X8H7_CAN_RX_BATCH_RTR;
 
-      x8h7_msg.field.id = can_id;
-      x8h7_msg.field.len = can_len;
-      memcpy(x8h7_msg.field.data, can_data, x8h7_msg.field.len);
+    uint8_t offset = 0;
+    if (can_id & CAN_EFF_FLAG)
+    {
+      frame[offset++] = info | X8H7_CAN_RX_BATCH_EFF;
+      uint32_t const id = can_id & CAN_EFF_MASK;
+      memcpy(frame + offset, &id, sizeof(id));
+      offset += sizeof(id);
+    }
+    else
+    {
+      frame[offset++] = info;
+      uint16_t const id = can_id & CAN_SFF_MASK;
+      memcpy(frame + offset, &id, sizeof(id));
+      offset += sizeof(id);
+    }
 
-      rc_enq = enqueue_packet(PERIPH_FDCAN1, CAN_RX_FRAME, X8H7_CAN_HEADER_SIZE + x8h7_msg.field.len, x8h7_msg.buf);
-      if (!rc_enq) return bytes_enqueued;
+    if (state->config.field.flags & X8H7_CAN_RX_FLG_TIMESTAMP)
+    {
+      /* The reference is advanced by whole microseconds only, so that the
+       * remainders do not add up to a drift over many frames. The cycle
+       * counter wraps after a few seconds, so the millisecond tick of each
+       * frame is tracked as well and a pause of CAN_RX_TICK_VALID_ms or more
+       * is reported as long. Anything above 65535 us is only known to be
+       * long.
+       */
+      uint32_t const cycles_per_us = SystemCoreClock / 1000000;
+      uint32_t const tick = HAL_GetTick() - cycle_counter_to_us(cycle_counter_get() - timestamp) / 1000;
+      uint16_t delta_us = X8H7_CAN_RX_BATCH_DELTA_MAX;
+      uint32_t const elapsed_us = cycle_counter_to_us(timestamp - state->timestamp);
+      if (state->is_timestamp_valid && (tick - state->tick) < CAN_RX_TICK_VALID_ms &&
+          elapsed_us < X8H7_CAN_RX_BATCH_DELTA_MAX)
+      {
+        delta_us = elapsed_us;
+        state->timestamp += elapsed_us * cycles_per_us;
+      }
+      else
+        state->timestamp = timestamp;
+      state->tick = tick;
+      state->is_timestamp_valid = true;
+
+      memcpy(frame + offset, &delta_us, sizeof(delta_us));
     }
+
+    size += header_size + can_len;
+    count++;
   }
 
-  if (is_can2_init)
+  /* The reservation is bounded by the bytes in the ring buffer, which may
+   * be less than the first frame takes within the batch.
+   */
+  if (count == 0)
   {
-    for (int rc_enq = 0; can_read(&fdcan_2, &can_id, &can_len, can_data); bytes_enqueued += rc_enq)
-    {
-      union x8h7_can_frame_message x8h7_msg;
+    tx_cancel(&tx);
+    return 0;
+  }
+
+  tx.data[0] = count;
+  return tx_commit(&tx, size);
+}
 
-      x8h7_msg.field.id = can_id;
-      x8h7_msg.field.len = can_len;
-      memcpy(x8h7_msg.field.data, can_data, x8h7_msg.field.len);
+int can_handle_rx(FDCAN_HandleTypeDef * handle, uint8_t const peripheral, uint16_t const max_bytes)
+{
+  int bytes_enqueued = 0;
+
+  /* Frames have been lost since the last call. */
+  if (can_rx_overrun(handle))
+  {
+    uint8_t x8_msg[2] = {X8H7_CAN_STS_INT_ERR, X8H7_CAN_STS_FLG_RX_OVR};
+    bytes_enqueued += enqueue_packet(peripheral, CAN_STATUS, sizeof(x8_msg), x8_msg);
+  }
+
+  if (can_rx_state_of(handle)->config.field.format == X8H7_CAN_RX_FORMAT_BATCH)
+  {
+    if (bytes_enqueued < max_bytes)
+      bytes_enqueued += can_handle_rx_batch(handle, peripheral, max_bytes - bytes_enqueued);
+    return bytes_enqueued;
+  }
 
-      rc_enq = enqueue_packet(PERIPH_FDCAN2, CAN_RX_FRAME, X8H7_CAN_HEADER_SIZE + x8h7_msg.field.len, x8h7_msg.buf);
-      if (!rc_enq) return bytes_enqueued;
+  uint32_t can_id = 0;
+  uint8_t can_len = 0;
+  uint8_t can_flags = 0;
+  while (can_rx_peek(handle, &can_id, &can_len, &can_flags))
+  {
+    /* Classic frames keep the CAN_RX_FRAME layout, CAN FD frames carry
+     * their flags in addition.
+     */
+    bool const is_fd = (can_flags & CANFD_FDF);
+    uint16_t const size = (is_fd ? X8H7_CANFD_HEADER_SIZE : X8H7_CAN_HEADER_SIZE) + can_len;
+    if ((bytes_enqueued + 4 /* sizeof(subpacket.header) */ + size) > max_bytes)
+      break;
+
+    /* Reserve room for the frame within the TX superframe first so that
+     * the frame is only removed from the RX ring buffer once there is
+     * space for it. Otherwise it remains there until the next superframe.
+     */
+    struct tx_handle const tx = tx_reserve(peripheral, is_fd ? CAN_RX_FD_FRAME : CAN_RX_FRAME, size);
+    if (!tx.data)
+      break;
+
+    uint32_t timestamp = 0;
+    if (is_fd)
+    {
+      union x8h7_canfd_frame_message * x8h7_msg = (union x8h7_canfd_frame_message *)tx.data;
+      can_read(handle, &can_id, &can_len, &can_flags, &timestamp, x8h7_msg->field.data);
+      x8h7_msg->field.id = can_id;
+      x8h7_msg->field.len = can_len;
+      x8h7_msg->field.flags = can_flags & ~CANFD_FDF;
     }
+    else
+    {
+      union x8h7_can_frame_message * x8h7_msg = (union x8h7_can_frame_message *)tx.data;
+      can_read(handle, &can_id, &can_len, &can_flags, &timestamp, x8h7_msg->field.data);
+      x8h7_msg->field.id = can_id;
+      x8h7_msg->field.len = can_len;
+    }
+
+    bytes_enqueued += tx_commit(&tx, size);
   }
 
   return bytes_enqueued;
 }
 
+int fdcan1_data_available()
+{
+  return is_can1_init && can_rx_fifo_available(&fdcan_1);
+}
+
+int fdcan2_data_available()
+{
+  return is_can2_init && can_rx_fifo_available(&fdcan_2);
+}
+
+int fdcan1_handle_data(uint16_t const max_bytes)
+{
+  if (!is_can1_init) return 0;
+  else return can_handle_rx(&fdcan_1, PERIPH_FDCAN1, max_bytes);
+}
+
+int fdcan2_handle_data(uint16_t const max_bytes)
+{
+  if (!is_can2_init) return 0;
+  else return can_handle_rx(&fdcan_2, PERIPH_FDCAN2, max_bytes);
+}
+
 int fdcan1_handler(uint8_t const opcode, uint8_t const * data, uint16_t const size)
 {
   dbg_printf("fdcan1_handler\n");
@@ -187,14 +451,14 @@ int fdcan_handler(FDCAN_HandleTypeDef * handle, uint8_t const opcode, uint8_t co
   if (opcode == CAN_INIT)
   {
     dbg_printf("fdcan_handler: CAN_INIT\n");
-    union x8h7_can_init_message x8h7_msg;
-    memcpy(x8h7_msg.buf, data, sizeof(x8h7_msg.buf));
+    union x8h7_can_init_message x8h7_msg = {0};
+    if (size != X8H7_CAN_NOMINAL_BITTIMING_SIZE && size != X8H7_CAN_BITTIMING_SIZE && size != sizeof(x8h7_msg.buf)) {
+      dbg_printf("fdcan_handler: invalid CAN_INIT size (:%d)\n", size);
+      return 0;
+    }
+    memcpy(x8h7_msg.buf, data, size);
 
-    return on_CAN_INIT_Request(handle,
-                               x8h7_msg.field.baud_rate_prescaler,
-                               x8h7_msg.field.time_segment_1,
-                               x8h7_msg.field.time_segment_2,
-                               x8h7_msg.field.sync_jump_width);
+    return on_CAN_INIT_Request(handle, &x8h7_msg, size == sizeof(x8h7_msg.buf));
   }
   else if (opcode == CAN_DEINIT)
   {
@@ -204,14 +468,26 @@ int fdcan_handler(FDCAN_HandleTypeDef * handle, uint8_t const opcode, uint8_t co
   else if (opcode == CAN_SET_BITTIMING)
   {
     dbg_printf("fdcan_handler: CAN_SET_BITTIMING\n");
-    union x8h7_can_bittiming_message x8h7_msg;
-    memcpy(x8h7_msg.buf, data, sizeof(x8h7_msg.buf));
+    union x8h7_can_bittiming_message x8h7_msg = {0};
+    if (size != X8H7_CAN_NOMINAL_BITTIMING_SIZE && size != X8H7_CAN_BITTIMING_SIZE) {
+      dbg_printf("fdcan_handler: invalid CAN_SET_BITTIMING size (:%d)\n", size);
+      return 0;
+    }
+    memcpy(x8h7_msg.buf, data, size);
 
-    return on_CAN_SET_BITTIMING_Request(handle,
-                                        x8h7_msg.field.baud_rate_prescaler,
-                                        x8h7_msg.field.time_segment_1,
-                                        x8h7_msg.field.time_segment_2,
-                                        x8h7_msg.field.sync_jump_width);
+    return on_CAN_SET_BITTIMING_Request(handle, &x8h7_msg);
+  }
+  else if (opcode == CAN_RX_CONFIG)
+  {
+    dbg_printf("fdcan_handler: CAN_RX_CONFIG\n");
+    union x8h7_can_rx_config_message x8h7_msg = {0};
+    if (size != sizeof(x8h7_msg.buf)) {
+      dbg_printf("fdcan_handler: invalid CAN_RX_CONFIG size (:%d)\n", size);
+      return 0;
+    }
+    memcpy(x8h7_msg.buf, data, size);
+
+    return on_CAN_RX_CONFIG_Request(handle, &x8h7_msg);
   }
   else if (opcode == CAN_FILTER)
   {
@@ -225,10 +501,34 @@ int fdcan_handler(FDCAN_HandleTypeDef * handle, uint8_t const opcode, uint8_t co
   }
   else if (opcode == CAN_TX_FRAME)
   {
-    union x8h7_can_frame_message msg;
-    memcpy(&msg, data, size);
+    union x8h7_can_frame_message msg = {0};
+    if (size < X8H7_CAN_HEADER_SIZE || size > sizeof(msg.buf)) {
+      dbg_printf("fdcan_handler: invalid CAN_TX_FRAME size (:%d)\n", size);
+      return 0;
+    }
+    memcpy(msg.buf, data, size);
     dbg_printf("fdcan_handler: sending CAN message to %lx, size %d, content[0]=0x%02X\n", msg.field.id, msg.field.len, msg.field.data[0]);
-    return on_CAN_TX_FRAME_Request(handle, &msg);
+    return on_CAN_TX_FRAME_Request(handle, msg.field.id, msg.field.len, 0, msg.field.data);
+  }
+  else if (opcode == CAN_TX_FD_FRAME)
+  {
+    union x8h7_canfd_frame_message msg = {0};
+    if (size < X8H7_CANFD_HEADER_SIZE || size > sizeof(msg.buf)) {
+      dbg_printf("fdcan_handler: invalid CAN_TX_FD_FRAME size (:%d)\n", size);
+      return 0;
+    }
+    memcpy(msg.buf, data, size);
+    dbg_printf("fdcan_handler: sending CAN FD message to %lx, size %d, flags 0x%02X\n", msg.field.id, msg.field.len, msg.field.flags);
+    return on_CAN_TX_FRAME_Request(handle, msg.field.id, msg.field.len, CANFD_FDF | msg.field.flags, msg.field.data);
+  }
+  else if (opcode == CAN_TX_BATCH)
+  {
+    if (size < 1) {
+      dbg_printf("fdcan_handler: invalid CAN_TX_BATCH size (:%d)\n", size);
+      return 0;
+    }
+    dbg_printf("fdcan_handler: CAN_TX_BATCH, size %d\n", size);
+    return on_CAN_TX_BATCH_Request(handle, data[0], data + 1, size - 1);
   }
   else
   {
@@ -241,18 +541,33 @@ int fdcan_handler(FDCAN_HandleTypeDef * handle, uint8_t const opcode, uint8_t co
  * FUNCTION DEFINITION
  **************************************************************************************/
 
-int on_CAN_INIT_Request(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width)
+int on_CAN_INIT_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_init_message const * msg, bool const has_ram_profile)
 {
-  can_init(handle,
-           (handle == &fdcan_1) ? CAN_1 : CAN_2,
-           baud_rate_prescaler,
-           time_segment_1,
-           time_segment_2,
-           sync_jump_width);
+  /* The bus keeps running as before if the profile does not fit. */
+  if (!can_init(handle,
+                (handle == &fdcan_1) ? CAN_1 : CAN_2,
+                msg->field.baud_rate_prescaler,
+                msg->field.time_segment_1,
+                msg->field.time_segment_2,
+                msg->field.sync_jump_width,
+                msg->field.data_baud_rate_prescaler,
+                msg->field.data_time_segment_1,
+                msg->field.data_time_segment_2,
+                msg->field.data_sync_jump_width,
+                has_ram_profile ? &msg->field.ram_profile : NULL))
+  {
+    dbg_printf("on_CAN_INIT_Request: message RAM profile does not fit\n");
+    uint8_t x8_msg[2] = {X8H7_CAN_STS_INT_ERR, 0};
+    return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_STATUS, sizeof(x8_msg), x8_msg);
+  }
 
   if      (handle == &fdcan_1) is_can1_init = true;
   else if (handle == &fdcan_2) is_can2_init = true;
 
+  /* Received frames go out one by one until the AP asks otherwise. */
+  struct can_rx_state * state = can_rx_state_of(handle);
+  memset(state, 0, sizeof(*state));
+
   return 0;
 }
 
@@ -266,13 +581,41 @@ int on_CAN_DEINIT_Request(FDCAN_HandleTypeDef * handle)
   return 0;
 }
 
-int on_CAN_SET_BITTIMING_Request(FDCAN_HandleTypeDef * handle, uint32_t const baud_rate_prescaler, uint32_t const time_segment_1, uint32_t const time_segment_2, uint32_t const sync_jump_width)
+int on_CAN_SET_BITTIMING_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_bittiming_message const * msg)
 {
-  return can_set_bittiming(handle,
-                           baud_rate_prescaler,
-                           time_segment_1,
-                           time_segment_2,
-                           sync_jump_width);
+  /* Switching to CAN FD takes more message RAM, which may not be there. */
+  if (!can_set_bittiming(handle,
+                         msg->field.baud_rate_prescaler,
+                         msg->field.time_segment_1,
+                         msg->field.time_segment_2,
+                         msg->field.sync_jump_width,
+                         msg->field.data_baud_rate_prescaler,
+                         msg->field.data_time_segment_1,
+                         msg->field.data_time_segment_2,
+                         msg->field.data_sync_jump_width))
+  {
+    dbg_printf("on_CAN_SET_BITTIMING_Request: message RAM profile does not fit\n");
+    uint8_t x8_msg[2] = {X8H7_CAN_STS_INT_ERR, 0};
+    return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_STATUS, sizeof(x8_msg), x8_msg);
+  }
+  return 0;
+}
+
+/* The configuration in effect is sent back, so that an AP can tell whether
+ * the firmware knows about CAN_RX_BATCH at all.
+ */
+int on_CAN_RX_CONFIG_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_rx_config_message const * msg)
+{
+  struct can_rx_state * state = can_rx_state_of(handle);
+  memset(state, 0, sizeof(*state));
+
+  if (msg->field.format == X8H7_CAN_RX_FORMAT_BATCH)
+  {
+    state->config.field.format = X8H7_CAN_RX_FORMAT_BATCH;
+    state->config.field.flags = msg->field.flags & X8H7_CAN_RX_FLG_TIMESTAMP;
+  }
+
+  return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_RX_CONFIG, sizeof(state->config.buf), state->config.buf);
 }
 
 int on_CAN_FILTER_Request(FDCAN_HandleTypeDef * handle, uint32_t const filter_index, uint32_t const id, uint32_t const mask)
@@ -282,7 +625,7 @@ int on_CAN_FILTER_Request(FDCAN_HandleTypeDef * handle, uint32_t const filter_in
   return 0;
 }
 
-int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_frame_message const * msg)
+int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, uint32_t const id, uint8_t const len, uint8_t const flags, uint8_t const * data)
 {
   if (!can_tx_fifo_available(handle))
   {
@@ -290,7 +633,7 @@ int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_frame_m
     return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_STATUS, sizeof(x8_msg), x8_msg);
   }
 
-  int const rc = can_write(handle, msg->field.id, msg->field.len, msg->field.data);
+  int const rc = can_write(handle, id, len, flags, data);
   if (rc < 0)
   {
     uint8_t x8_msg[2] = {X8H7_CAN_STS_INT_ERR, X8H7_CAN_STS_FLG_TX_EP};
@@ -300,3 +643,50 @@ int on_CAN_TX_FRAME_Request(FDCAN_HandleTypeDef * handle, union x8h7_can_frame_m
   uint8_t x8_msg[2] = {X8H7_CAN_STS_INT_TX, 0};
   return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_STATUS, sizeof(x8_msg), x8_msg);
 }
+
+/* The frames of a batch are packed back to back, each one with the header
+ * of CAN_TX_FD_FRAME and CANFD_FDF in its flags for a CAN FD frame. They
+ * are queued in order until the TX FIFO is full, the rest is left to the
+ * AP to send again. Either way there is a single status for the batch.
+ */
+int on_CAN_TX_BATCH_Request(FDCAN_HandleTypeDef * handle, uint8_t const batch_flags, uint8_t const * frames, uint16_t const size)
+{
+  struct x8h7_can_tx_batch_status status = {0};
+  uint16_t offset = 0;
+
+  while ((offset + X8H7_CANFD_HEADER_SIZE) <= size && status.accepted < X8H7_CAN_TX_BATCH_MAX_FRAMES)
+  {
+    union x8h7_canfd_frame_message msg = {0};
+    memcpy(msg.buf, frames + offset, X8H7_CANFD_HEADER_SIZE);
+
+    uint16_t const frame_size = X8H7_CANFD_HEADER_SIZE + msg.field.len;
+    if ((offset + frame_size) > size)
+      break;
+
+    uint8_t const max_len = (msg.field.flags & CANFD_FDF) ? X8H7_CANFD_FRAME_MAX_DATA_LEN : X8H7_CAN_FRAME_MAX_DATA_LEN;
+    bool const is_valid = (msg.field.len <= max_len);
+    if (is_valid && !can_tx_fifo_available(handle))
+      break;
+
+    uint8_t const i = status.accepted++;
+    int rc = -1;
+    if (is_valid)
+    {
+      memcpy(msg.field.data, frames + offset + X8H7_CANFD_HEADER_SIZE, msg.field.len);
+      rc = can_write(handle, msg.field.id, msg.field.len, msg.field.flags, msg.field.data);
+    }
+    offset += frame_size;
+
+    if (rc < 0) {
+      status.rejected++;
+    } else {
+      status.queued++;
+      status.bitmap[i / 8] |= (1 << (i % 8));
+    }
+  }
+
+  if ((batch_flags & X8H7_CAN_TX_BATCH_FLG_NO_ACK) && offset == size && status.rejected == 0)
+    return 0;
+
+  return enqueue_packet(handle == &fdcan_1 ? PERIPH_FDCAN1 : PERIPH_FDCAN2, CAN_TX_BATCH_STATUS, sizeof(status), &status);
+}
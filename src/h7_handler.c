@@ -29,6 +29,7 @@
 #include "opcodes.h"
 #include "m4_util.h"
 #include "peripherals.h"
+#include "tx_scheduler.h"
 
 #include "stm32h7xx_ll_utils.h"
 
@@ -51,6 +52,16 @@ char const __attribute__((section (".fw_version_section"))) REAL_VERSION_FLASH[]
  **************************************************************************************/
 
 static int on_H7_GET_UID_Request();
+static int on_H7_DISPATCH_CONFIG_Request(uint8_t const * data, uint16_t const size);
+static int on_H7_DISPATCH_STATS_Request();
+static int on_H7_RX_QUEUE_STATS_Request();
+static int on_H7_IRQ_COALESCE_CONFIG_Request(uint8_t const * data, uint16_t const size);
+static int on_H7_IRQ_COALESCE_STATS_Request();
+static int on_H7_TX_LANE_STATS_Request();
+static int on_H7_TX_SCHED_CONFIG_Request(uint8_t const * data, uint16_t const size);
+static int on_H7_TX_SCHED_STATS_Request();
+static int on_H7_TX_DROP_STATS_Request();
+static int on_H7_SPI_TRANSFER_MODE_Request(uint8_t const * data, uint16_t const size);
 
 /**************************************************************************************
  * TYPEDEF
@@ -67,6 +78,26 @@ union x8h7_h7_uid_message
   uint8_t buf[sizeof(uint32_t) /* word0 */ + sizeof(uint32_t) /* word1 */ + sizeof(uint32_t) /* word2 */];
 };
 
+union x8h7_h7_dispatch_config_message
+{
+  struct __attribute__((packed))
+  {
+    uint16_t max_subpackets;
+    uint16_t max_time_us;
+  } field;
+  uint8_t buf[sizeof(uint16_t) /* max_subpackets */ + sizeof(uint16_t) /* max_time_us */];
+};
+
+union x8h7_h7_tx_sched_weight_message
+{
+  struct __attribute__((packed))
+  {
+    uint8_t peripheral;
+    uint8_t weight;
+  } field;
+  uint8_t buf[sizeof(uint8_t) /* peripheral */ + sizeof(uint8_t) /* weight */];
+};
+
 /**************************************************************************************
  * FUNCTION DEFINITION
  **************************************************************************************/
@@ -87,6 +118,46 @@ int h7_handler(uint8_t const opcode, uint8_t const * data, uint16_t const size)
   {
     return on_H7_GET_UID_Request();
   }
+  else if (opcode == H7_DISPATCH_CONFIG)
+  {
+    return on_H7_DISPATCH_CONFIG_Request(data, size);
+  }
+  else if (opcode == H7_DISPATCH_STATS)
+  {
+    return on_H7_DISPATCH_STATS_Request();
+  }
+  else if (opcode == H7_RX_QUEUE_STATS)
+  {
+    return on_H7_RX_QUEUE_STATS_Request();
+  }
+  else if (opcode == H7_IRQ_COALESCE_CONFIG)
+  {
+    return on_H7_IRQ_COALESCE_CONFIG_Request(data, size);
+  }
+  else if (opcode == H7_IRQ_COALESCE_STATS)
+  {
+    return on_H7_IRQ_COALESCE_STATS_Request();
+  }
+  else if (opcode == H7_TX_LANE_STATS)
+  {
+    return on_H7_TX_LANE_STATS_Request();
+  }
+  else if (opcode == H7_TX_SCHED_CONFIG)
+  {
+    return on_H7_TX_SCHED_CONFIG_Request(data, size);
+  }
+  else if (opcode == H7_TX_SCHED_STATS)
+  {
+    return on_H7_TX_SCHED_STATS_Request();
+  }
+  else if (opcode == H7_TX_DROP_STATS)
+  {
+    return on_H7_TX_DROP_STATS_Request();
+  }
+  else if (opcode == H7_SPI_TRANSFER_MODE)
+  {
+    return on_H7_SPI_TRANSFER_MODE_Request(data, size);
+  }
   else {
     dbg_printf("h7_handler: error invalid opcode (:%d)\n", opcode);
     return 0;
@@ -107,3 +178,104 @@ int on_H7_GET_UID_Request()
 
   return enqueue_packet(PERIPH_H7, H7_GET_UID_RSP, sizeof(msg.buf), msg.buf);
 }
+
+int on_H7_DISPATCH_CONFIG_Request(uint8_t const * data, uint16_t const size)
+{
+  union x8h7_h7_dispatch_config_message msg;
+
+  if (size < sizeof(msg.buf)) {
+    dbg_printf("h7_handler: invalid H7_DISPATCH_CONFIG size (:%d)\n", size);
+    return -1;
+  }
+
+  memcpy(msg.buf, data, sizeof(msg.buf));
+  dma_set_dispatch_budget(msg.field.max_subpackets, msg.field.max_time_us);
+  return 0;
+}
+
+int on_H7_DISPATCH_STATS_Request()
+{
+  struct dispatch_stats stats;
+  dma_get_dispatch_stats(&stats);
+  return enqueue_packet(PERIPH_H7, H7_DISPATCH_STATS, sizeof(stats), &stats);
+}
+
+int on_H7_RX_QUEUE_STATS_Request()
+{
+  struct rx_queue_stats stats;
+  dma_get_rx_queue_stats(&stats);
+  return enqueue_packet(PERIPH_H7, H7_RX_QUEUE_STATS, sizeof(stats), &stats);
+}
+
+int on_H7_IRQ_COALESCE_CONFIG_Request(uint8_t const * data, uint16_t const size)
+{
+  struct irq_coalesce_config config;
+
+  if (size < sizeof(config)) {
+    dbg_printf("h7_handler: invalid H7_IRQ_COALESCE_CONFIG size (:%d)\n", size);
+    return -1;
+  }
+
+  memcpy(&config, data, sizeof(config));
+  irq_coalesce_set_config(&config);
+  return 0;
+}
+
+int on_H7_IRQ_COALESCE_STATS_Request()
+{
+  struct irq_coalesce_stats stats;
+  irq_coalesce_get_stats(&stats);
+  return enqueue_packet(PERIPH_H7, H7_IRQ_COALESCE_STATS, sizeof(stats), &stats);
+}
+
+int on_H7_TX_LANE_STATS_Request()
+{
+  struct tx_lane_stats stats[TX_LANES];
+  tx_get_lane_stats(stats);
+  return enqueue_packet(PERIPH_H7, H7_TX_LANE_STATS, sizeof(stats), stats);
+}
+
+int on_H7_TX_SCHED_CONFIG_Request(uint8_t const * data, uint16_t const size)
+{
+  union x8h7_h7_tx_sched_weight_message msg;
+
+  if (size == 0 || (size % sizeof(msg.buf)) != 0) {
+    dbg_printf("h7_handler: invalid H7_TX_SCHED_CONFIG size (:%d)\n", size);
+    return -1;
+  }
+
+  for (uint16_t offset = 0; offset < size; offset += sizeof(msg.buf))
+  {
+    memcpy(msg.buf, data + offset, sizeof(msg.buf));
+    tx_scheduler_set_weight(msg.field.peripheral, msg.field.weight);
+  }
+  return 0;
+}
+
+int on_H7_TX_SCHED_STATS_Request()
+{
+  struct tx_scheduler_stats stats[TX_SCHEDULER_MAX_SOURCES];
+  int const num = tx_scheduler_get_stats(stats);
+  return enqueue_packet(PERIPH_H7, H7_TX_SCHED_STATS, num * sizeof(stats[0]), stats);
+}
+
+int on_H7_TX_DROP_STATS_Request()
+{
+  struct tx_drop_stats stats;
+  tx_get_drop_stats(&stats);
+  return enqueue_packet(PERIPH_H7, H7_TX_DROP_STATS, sizeof(stats), &stats);
+}
+
+int on_H7_SPI_TRANSFER_MODE_Request(uint8_t const * data, uint16_t const size)
+{
+  if (size < 1) {
+    dbg_printf("h7_handler: invalid H7_SPI_TRANSFER_MODE size (:%d)\n", size);
+    return -1;
+  }
+
+  if (dma_set_transfer_mode(data[0]) < 0) {
+    dbg_printf("h7_handler: invalid SPI transfer mode (:%d)\n", data[0]);
+    return -1;
+  }
+  return 0;
+}
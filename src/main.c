@@ -43,7 +43,9 @@
 #include "system.h"
 #include "h7_handler.h"
 #include "watchdog.h"
+#include "tx_scheduler.h"
 #include "m4_util.h"
+#include "bench.h"
 
 /**************************************************************************************
  * FUNCTION DEFINITION
@@ -79,6 +81,11 @@ void peripheral_init()
 
   peripheral_register_callback(PERIPH_FDCAN1, &fdcan1_handler);
   peripheral_register_callback(PERIPH_FDCAN2, &fdcan2_handler);
+
+  tx_scheduler_register(PERIPH_UART, &uart_data_available, &uart_handle_data);
+  tx_scheduler_register(PERIPH_VIRTUAL_UART, &virtual_uart_data_available, &virtual_uart_handle_data);
+  tx_scheduler_register(PERIPH_FDCAN1, &fdcan1_data_available, &fdcan1_handle_data);
+  tx_scheduler_register(PERIPH_FDCAN2, &fdcan2_data_available, &fdcan2_handle_data);
 }
 
 void handle_data()
@@ -87,17 +94,12 @@ void handle_data()
 
   watchdog_refresh();
 
-  if (uart_data_available())
-    uart_handle_data();
-
-  if (virtual_uart_data_available())
-    virtual_uart_handle_data();
-
-  can_handle_data();
+  tx_spill_handle_data();
+  tx_scheduler_run();
   gpio_handle_data();
   dma_handle_data();
 
-  if (is_dma_transfer_complete() && (get_tx_packet_size() > 0))
+  if (is_dma_transfer_complete() && is_tx_packet_due())
     set_nirq_low();
 }
 
@@ -118,6 +120,10 @@ int main(void) {
   extern char const REAL_VERSION_FLASH[];
   printf("Portenta X8 - STM32H7 companion fw - %s\n", REAL_VERSION_FLASH);
 
+#ifdef BENCH
+  bench_run();
+#endif
+
   try_execute_m4_app();
 
   watchdog_init(IWDG_PRESCALER_16);
@@ -18,12 +18,24 @@
 
 #include "ringbuffer.h"
 
+#include <string.h>
+
 /**
  * @file
  * Implementation of ring buffer functions.
  */
 
-void ring_buffer_init(ring_buffer_t *buffer) {
+/* Largest power of two not above size, the indices are masked with it. */
+static ring_buffer_size_t ring_buffer_mask(ring_buffer_size_t size) {
+  while(size & (size - 1)) {
+    size &= size - 1;
+  }
+  return size - 1;
+}
+
+void ring_buffer_init(ring_buffer_t *buffer, char *memory, ring_buffer_size_t size) {
+  buffer->buffer = memory;
+  buffer->mask = ring_buffer_mask(size);
   buffer->tail_index = 0;
   buffer->head_index = 0;
 }
@@ -33,19 +45,35 @@ void ring_buffer_queue(ring_buffer_t *buffer, char data) {
   if(ring_buffer_is_full(buffer)) {
     /* Is going to overwrite the oldest byte */
     /* Increase tail index */
-    buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK);
+    buffer->tail_index = ((buffer->tail_index + 1) & buffer->mask);
   }
 
   /* Place data in buffer */
   buffer->buffer[buffer->head_index] = data;
-  buffer->head_index = ((buffer->head_index + 1) & RING_BUFFER_MASK);
+  buffer->head_index = ((buffer->head_index + 1) & buffer->mask);
 }
 
 void ring_buffer_queue_arr(ring_buffer_t *buffer, const char *data, ring_buffer_size_t size) {
-  /* Add bytes; one by one */
-  ring_buffer_size_t i;
-  for(i = 0; i < size; i++) {
-    ring_buffer_queue(buffer, data[i]);
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  /* Only the newest buffer->mask bytes can be held */
+  if(size > buffer->mask) {
+    buffer->head_index = ((buffer->head_index + size - buffer->mask) & buffer->mask);
+    data += size - buffer->mask;
+    size = buffer->mask;
+  }
+
+  uint8_t const is_overwrite = size > (buffer->mask - ring_buffer_num_items(buffer));
+
+  /* Place data in buffer; in two blocks if it wraps around */
+  ring_buffer_size_t const head_index = buffer->head_index;
+  ring_buffer_size_t const first = (size < buffer_size - head_index) ? size : (buffer_size - head_index);
+  memcpy(&buffer->buffer[head_index], data, first);
+  memcpy(buffer->buffer, data + first, size - first);
+  buffer->head_index = ((head_index + size) & buffer->mask);
+
+  if(is_overwrite) {
+    /* Oldest bytes have been overwritten, the buffer is full now */
+    buffer->tail_index = ((buffer->head_index + 1) & buffer->mask);
   }
 }
 
@@ -56,22 +84,21 @@ uint8_t ring_buffer_dequeue(ring_buffer_t *buffer, char *data) {
   }
   
   *data = buffer->buffer[buffer->tail_index];
-  buffer->tail_index = ((buffer->tail_index + 1) & RING_BUFFER_MASK);
+  buffer->tail_index = ((buffer->tail_index + 1) & buffer->mask);
   return 1;
 }
 
 ring_buffer_size_t ring_buffer_dequeue_arr(ring_buffer_t *buffer, char *data, ring_buffer_size_t len) {
-  if(ring_buffer_is_empty(buffer)) {
-    /* No items */
-    return 0;
-  }
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  ring_buffer_size_t const num_items = ring_buffer_num_items(buffer);
+  ring_buffer_size_t const cnt = (len < num_items) ? len : num_items;
 
-  char *data_ptr = data;
-  ring_buffer_size_t cnt = 0;
-  while((cnt < len) && ring_buffer_dequeue(buffer, data_ptr)) {
-    cnt++;
-    data_ptr++;
-  }
+  /* Copy data out of the buffer; in two blocks if it wraps around */
+  ring_buffer_size_t const tail_index = buffer->tail_index;
+  ring_buffer_size_t const first = (cnt < buffer_size - tail_index) ? cnt : (buffer_size - tail_index);
+  memcpy(data, &buffer->buffer[tail_index], first);
+  memcpy(data + first, buffer->buffer, cnt - first);
+  buffer->tail_index = ((tail_index + cnt) & buffer->mask);
   return cnt;
 }
 
@@ -82,11 +109,182 @@ uint8_t ring_buffer_peek(ring_buffer_t *buffer, char *data, ring_buffer_size_t i
   }
   
   /* Add index to pointer */
-  ring_buffer_size_t data_index = ((buffer->tail_index + index) & RING_BUFFER_MASK);
+  ring_buffer_size_t data_index = ((buffer->tail_index + index) & buffer->mask);
   *data = buffer->buffer[data_index];
   return 1;
 }
 
+ring_buffer_size_t ring_buffer_peek_span(ring_buffer_t *buffer, const char **data) {
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  ring_buffer_size_t const num_items = ring_buffer_num_items(buffer);
+  ring_buffer_size_t const to_end = buffer_size - buffer->tail_index;
+
+  *data = &buffer->buffer[buffer->tail_index];
+  return (num_items < to_end) ? num_items : to_end;
+}
+
+ring_buffer_size_t ring_buffer_discard(ring_buffer_t *buffer, ring_buffer_size_t len) {
+  ring_buffer_size_t const num_items = ring_buffer_num_items(buffer);
+  if(len > num_items) {
+    len = num_items;
+  }
+
+  buffer->tail_index = ((buffer->tail_index + len) & buffer->mask);
+  return len;
+}
+
+void spsc_ring_buffer_init(spsc_ring_buffer_t *buffer, char *memory, ring_buffer_size_t size, enum spsc_ring_buffer_overflow overflow) {
+  buffer->buffer = memory;
+  buffer->mask = ring_buffer_mask(size);
+  buffer->head = 0;
+  buffer->tail = 0;
+  buffer->overflow = overflow;
+  buffer->lead = 0;
+  buffer->dropped = 0;
+  buffer->overwritten = 0;
+}
+
+ring_buffer_size_t spsc_ring_buffer_queue_arr(spsc_ring_buffer_t *buffer, const char *data, ring_buffer_size_t size) {
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  /* Only the producer writes head */
+  uint32_t head = buffer->head;
+  ring_buffer_size_t const queued = size;
+
+  if(buffer->overflow == SPSC_RING_BUFFER_DROP_NEW) {
+    uint32_t const space = buffer_size - (head - __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE));
+    if(size > space) {
+      buffer->dropped += size - space;
+      size = space;
+    }
+  }
+  else if(size > buffer_size) {
+    /* Only the newest buffer_size bytes can be held, the consumer
+     * accounts for the skipped ones as overwritten */
+    head += size - buffer_size;
+    data += size - buffer_size;
+    size = buffer_size;
+  }
+
+  /* Place data in buffer; in two blocks if it wraps around */
+  ring_buffer_size_t const head_index = head & buffer->mask;
+  ring_buffer_size_t const first = (size < buffer_size - head_index) ? size : (buffer_size - head_index);
+  memcpy(&buffer->buffer[head_index], data, first);
+  memcpy(buffer->buffer, data + first, size - first);
+
+  /* Publish the data to the consumer */
+  __atomic_store_n(&buffer->head, head + size, __ATOMIC_RELEASE);
+  return (buffer->overflow == SPSC_RING_BUFFER_DROP_NEW) ? size : queued;
+}
+
+void spsc_ring_buffer_commit(spsc_ring_buffer_t *buffer, ring_buffer_size_t size) {
+  /* The data is in place already, only publish it */
+  __atomic_store_n(&buffer->head, buffer->head + size, __ATOMIC_RELEASE);
+}
+
+void spsc_ring_buffer_set_lead(spsc_ring_buffer_t *buffer, ring_buffer_size_t lead) {
+  buffer->lead = (lead <= buffer->mask) ? lead : buffer->mask;
+}
+
+void spsc_ring_buffer_align_head(spsc_ring_buffer_t *buffer) {
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  uint32_t const shift = (buffer_size - (buffer->head & buffer->mask)) & buffer->mask;
+  uint32_t num_items = buffer->head - buffer->tail;
+  if(num_items > buffer_size - shift) {
+    /* The oldest bytes would be moved onto the ones still to be moved */
+    buffer->overwritten += num_items - (buffer_size - shift);
+    num_items = buffer_size - shift;
+  }
+
+  /* Moving towards the head, so start with the newest byte */
+  for(uint32_t i = buffer->head; i != buffer->head - num_items; i--) {
+    buffer->buffer[(i - 1 + shift) & buffer->mask] = buffer->buffer[(i - 1) & buffer->mask];
+  }
+  buffer->head += shift;
+  buffer->tail = buffer->head - num_items;
+}
+
+/* Returns the tail after skipping what the producer has overwritten. */
+static uint32_t spsc_ring_buffer_tail(spsc_ring_buffer_t *buffer, uint32_t head) {
+  ring_buffer_size_t const valid = buffer->mask + 1 - buffer->lead;
+  /* Only the consumer writes tail */
+  uint32_t const tail = buffer->tail;
+  if(head - tail <= valid) {
+    return tail;
+  }
+
+  buffer->overwritten += head - valid - tail;
+  return head - valid;
+}
+
+ring_buffer_size_t spsc_ring_buffer_dequeue_arr(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t len) {
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  uint32_t const head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = spsc_ring_buffer_tail(buffer, head);
+  ring_buffer_size_t cnt = (len < head - tail) ? len : (head - tail);
+
+  /* Copy data out of the buffer; in two blocks if it wraps around */
+  ring_buffer_size_t const tail_index = tail & buffer->mask;
+  ring_buffer_size_t const first = (cnt < buffer_size - tail_index) ? cnt : (buffer_size - tail_index);
+  memcpy(data, &buffer->buffer[tail_index], first);
+  memcpy(data + first, buffer->buffer, cnt - first);
+
+  if(buffer->overflow == SPSC_RING_BUFFER_OVERWRITE) {
+    /* The producer may have lapped us while copying, whatever lies
+     * before its new head minus the buffer size is not valid anymore */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint32_t const lapped = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE) + buffer->lead - buffer_size - tail;
+    if((int32_t)lapped > 0) {
+      ring_buffer_size_t const lost = (lapped < cnt) ? lapped : cnt;
+      memmove(data, data + lost, cnt - lost);
+      buffer->overwritten += lost;
+      tail += lost;
+      cnt -= lost;
+    }
+  }
+
+  /* Hand the space back to the producer */
+  __atomic_store_n(&buffer->tail, tail + cnt, __ATOMIC_RELEASE);
+  return cnt;
+}
+
+uint8_t spsc_ring_buffer_peek(spsc_ring_buffer_t *buffer, char *data, ring_buffer_size_t index) {
+  uint32_t const head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  /* Only the consumer writes tail */
+  uint32_t const tail = buffer->tail;
+  if(index >= head - tail) {
+    /* No items at index */
+    return 0;
+  }
+
+  *data = buffer->buffer[(tail + index) & buffer->mask];
+  return 1;
+}
+
+ring_buffer_size_t spsc_ring_buffer_peek_span(spsc_ring_buffer_t *buffer, const char **data) {
+  ring_buffer_size_t const buffer_size = buffer->mask + 1;
+  uint32_t const head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  uint32_t const tail = spsc_ring_buffer_tail(buffer, head);
+  ring_buffer_size_t const tail_index = tail & buffer->mask;
+  ring_buffer_size_t const to_end = buffer_size - tail_index;
+
+  __atomic_store_n(&buffer->tail, tail, __ATOMIC_RELEASE);
+  *data = &buffer->buffer[tail_index];
+  return (head - tail < to_end) ? (head - tail) : to_end;
+}
+
+ring_buffer_size_t spsc_ring_buffer_discard(spsc_ring_buffer_t *buffer, ring_buffer_size_t len) {
+  uint32_t const head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE);
+  uint32_t const tail = spsc_ring_buffer_tail(buffer, head);
+  if(len > head - tail) {
+    len = head - tail;
+  }
+
+  __atomic_store_n(&buffer->tail, tail + len, __ATOMIC_RELEASE);
+  return len;
+}
+
 extern inline uint8_t ring_buffer_is_empty(ring_buffer_t *buffer);
 extern inline uint8_t ring_buffer_is_full(ring_buffer_t *buffer);
 extern inline ring_buffer_size_t ring_buffer_num_items(ring_buffer_t *buffer);
+extern inline ring_buffer_size_t spsc_ring_buffer_num_items(spsc_ring_buffer_t *buffer);
+extern inline uint8_t spsc_ring_buffer_is_empty(spsc_ring_buffer_t *buffer);
@@ -41,7 +41,7 @@ enum endpoints_t {
  **************************************************************************************/
 
 static struct rpmsg_endpoint rp_endpoints[4];
-extern ring_buffer_t virtual_uart_ring_buffer;
+extern spsc_ring_buffer_t virtual_uart_ring_buffer;
 
 /**************************************************************************************
  * FUNCTION DEFINITION
@@ -50,7 +50,7 @@ extern ring_buffer_t virtual_uart_ring_buffer;
 int rpmsg_recv_raw_callback(struct rpmsg_endpoint *ept, void *data,
                                        size_t len, uint32_t src, void *priv)
 {
-  ring_buffer_queue_arr(&virtual_uart_ring_buffer, (const char *)data, len);
+  spsc_ring_buffer_queue_arr(&virtual_uart_ring_buffer, (const char *)data, len);
 
   return 0;
 }
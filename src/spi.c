@@ -185,3 +185,8 @@ void spi_transmit_receive(uint8_t *tx_buf, uint8_t *rx_buf, uint16_t size)
 {
   HAL_SPI_TransmitReceive_DMA(&hspi3, tx_buf, rx_buf, size);
 }
+
+uint16_t spi_rx_remaining()
+{
+  return __HAL_DMA_GET_COUNTER(hspi3.hdmarx);
+}
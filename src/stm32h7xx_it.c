@@ -20,12 +20,15 @@
 /* Includes ------------------------------------------------------------------*/
 #include "stm32h7xx_it.h"
 #include "stm32h7xx_hal.h"
+#include "uart.h"
 
 /* External variables --------------------------------------------------------*/
 extern FDCAN_HandleTypeDef fdcan_1;
 extern FDCAN_HandleTypeDef fdcan_2;
 extern DMA_HandleTypeDef hdma_spi3_tx;
 extern DMA_HandleTypeDef hdma_spi3_rx;
+extern DMA_HandleTypeDef hdma_usart2_rx;
+extern DMA_HandleTypeDef hdma_usart2_tx;
 extern SPI_HandleTypeDef hspi3;
 extern UART_HandleTypeDef huart2;
 
@@ -144,6 +147,20 @@ void DMA1_Stream1_IRQHandler(void) {
   HAL_DMA_IRQHandler(&hdma_spi3_rx);
 }
 
+/**
+ * @brief This function handles DMA1 stream2 global interrupt.
+ */
+void DMA1_Stream2_IRQHandler(void) {
+  HAL_DMA_IRQHandler(&hdma_usart2_rx);
+}
+
+/**
+ * @brief This function handles DMA1 stream3 global interrupt.
+ */
+void DMA1_Stream3_IRQHandler(void) {
+  HAL_DMA_IRQHandler(&hdma_usart2_tx);
+}
+
 /**
  * @brief This function handles FDCAN1 interrupt 0.
  */
@@ -162,6 +179,7 @@ void FDCAN2_IT0_IRQHandler(void) {
  * @brief This function handles USART2 global interrupt.
  */
 void USART2_IRQHandler(void) {
+  uart_rx_timeout_irq();
   HAL_UART_IRQHandler(&huart2);
 }
 
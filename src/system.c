@@ -28,27 +28,111 @@
 #include <string.h>
 #include "rpc.h"
 #include "spi.h"
+#include "uart.h"
+#include "opcodes.h"
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* Layout of the reservation word kept for each TX buffer. */
+#define TX_RESERVATION_SIZE_Msk     0x0000FFFFUL /* Bytes reserved within the normal lane. */
+#define TX_RESERVATION_WRITER       0x00010000UL /* One reservation not yet committed. */
+#define TX_RESERVATION_WRITER_Msk   0x003F0000UL
+#define TX_RESERVATION_HIGH_Pos     22
+#define TX_RESERVATION_HIGH_Msk     0x7FC00000UL /* Bytes reserved within the high priority lane. */
+#define TX_RESERVATION_CLOSED       0x80000000UL /* Buffer has been handed over to the SPI transfer. */
 
 /**************************************************************************************
  * GLOBAL VARIABLES
  **************************************************************************************/
 
-__attribute__((section("dma"), aligned(2048))) volatile uint8_t TX_Buffer_1[SPI_DMA_BUFFER_SIZE];
-__attribute__((section("dma"), aligned(2048))) volatile uint8_t TX_Buffer_2[SPI_DMA_BUFFER_SIZE];
-__attribute__((section("dma"), aligned(2048))) volatile uint8_t RX_Buffer          [SPI_DMA_BUFFER_SIZE];
-__attribute__((section("dma"), aligned(2048))) volatile uint8_t RX_Buffer_userspace[SPI_DMA_BUFFER_SIZE];
+/* Each buffer and each RX slot is covered by a MPU region of its own, whose
+ * base has to be aligned to the region size.
+ */
+__attribute__((section("dma"), aligned(SPI_DMA_BUFFER_SIZE))) volatile uint8_t TX_Buffer_1[SPI_DMA_BUFFER_SIZE];
+__attribute__((section("dma"), aligned(SPI_DMA_BUFFER_SIZE))) volatile uint8_t TX_Buffer_2[SPI_DMA_BUFFER_SIZE];
+__attribute__((section("dma"), aligned(SPI_DMA_BUFFER_SIZE))) volatile uint8_t RX_Buffer[RX_SUPERFRAME_QUEUE_DEPTH][SPI_DMA_BUFFER_SIZE];
 
 typedef enum
 {
-  Idle, Header, Data, Complete, Error
+  Idle, Header, Data, Complete, Error, SinglePhase
 } eTransferState;
 volatile eTransferState transaction_state = Idle;
 
-volatile bool is_rx_buf_userspace_processed = false;
+static volatile uint8_t spi_transfer_mode = SPI_TRANSFER_TWO_PHASE;
+/* Mode switch requested by the AP, it takes effect once the TX buffer
+ * carrying the confirmation has been transferred.
+ */
+static volatile uint8_t spi_transfer_mode_pending = SPI_TRANSFER_TWO_PHASE;
+static volatile int8_t spi_transfer_mode_pending_buf = -1;
+/* Mode whose confirmation did not fit into the active TX buffer yet, it is
+ * retried from the main loop before the spill queue is drained.
+ */
+static int8_t spi_transfer_mode_unconfirmed = -1;
+static uint16_t single_phase_len = 0;
 
 volatile uint8_t * p_tx_buf_active   = TX_Buffer_1;
 volatile uint8_t * p_tx_buf_transfer = TX_Buffer_1;
-volatile struct subpacket * rx_pkt_userspace = (struct subpacket *)RX_Buffer_userspace;
+/* Producers append to the active TX buffer by atomically advancing its
+ * reservation word with LDREX/STREX, no interrupts are masked while the
+ * payload is serialized. The superframe header is only written once the
+ * buffer is closed in EXTI15_10_IRQHandler.
+ *
+ * Each TX buffer is split into two lanes behind the superframe header:
+ * TX_HIGH_PRIORITY_LANE_SIZE bytes for the high priority lane followed
+ * by the normal lane. Before the data phase the high priority lane is
+ * moved up against the normal one so that the superframe is contiguous.
+ */
+static volatile uint32_t tx_reservation[2] = {0};
+static volatile bool tx_high_lane_moved = false;
+
+/* Per TX buffer: whether a high priority subpacket or one of an urgent
+ * peripheral has been committed, to either lane, and when the first subpacket of each lane has been reserved.
+ */
+static volatile bool tx_urgent[2] = {false};
+static volatile uint32_t tx_first_cycles[2][TX_LANES] = {{0}};
+
+static struct tx_lane_stats tx_lane_stats[TX_LANES] = {{0}};
+static volatile uint32_t tx_lane_full[TX_LANES] = {0};
+static uint64_t tx_lane_delay_sum_us[TX_LANES] = {0};
+
+/* Complete subpackets (header and payload) which did not fit into the TX
+ * superframe. Appended from any context, drained by the main loop. Once
+ * everything has been moved out both offsets are rewound.
+ */
+static uint8_t tx_spill_queue[TX_SPILL_QUEUE_SIZE];
+static volatile uint16_t tx_spill_used = 0;
+static uint16_t tx_spill_read = 0;
+/* Subpackets waiting in the spill queue per peripheral, see tx_reserve(). */
+static volatile uint16_t tx_spill_pending[TX_STATS_NUM_PERIPHERALS] = {0};
+static struct tx_drop_stats tx_drop_stats = {0};
+
+static struct irq_coalesce_config irq_coalesce = {
+  IRQ_COALESCE_THRESHOLD_BYTES_DEFAULT,
+  IRQ_COALESCE_MAX_DELAY_us_DEFAULT,
+  IRQ_COALESCE_URGENT_MASK_DEFAULT
+};
+static struct irq_coalesce_stats irq_coalesce_stats = {0};
+static uint64_t irq_coalesce_bytes_sum = 0;
+
+volatile struct subpacket * rx_pkt_userspace = (struct subpacket *)&(((struct complete_packet *)RX_Buffer[0])->data);
+
+/* Receive superframe queue: the SPI RX DMA writes into slot rx_slot_head
+ * while the main loop dispatches slot rx_slot_tail.
+ */
+static volatile uint8_t rx_slot_head = 0;
+static volatile uint8_t rx_slot_tail = 0;
+static volatile uint8_t rx_slot_count = 0;
+static volatile uint16_t rx_slot_size[RX_SUPERFRAME_QUEUE_DEPTH] = {0};
+static volatile uint32_t rx_slot_cycles[RX_SUPERFRAME_QUEUE_DEPTH] = {0};
+static struct rx_queue_stats rx_queue_stats = {0};
+
+static uint16_t dispatch_max_subpackets = DMA_DISPATCH_MAX_SUBPACKETS_DEFAULT;
+static uint16_t dispatch_max_time_us    = DMA_DISPATCH_MAX_TIME_us_DEFAULT;
+
+static struct dispatch_stats dispatch_stats = {0};
+static uint64_t dispatch_latency_sum_us = 0;
 
 /**************************************************************************************
  * FUNCTION DEFINITION
@@ -152,13 +236,14 @@ static void MPU_Config(void)
   MPU_InitStruct.Number = MPU_REGION_NUMBER1;
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
-  MPU_InitStruct.BaseAddress = (uint32_t)RX_Buffer;
-  MPU_InitStruct.Number = MPU_REGION_NUMBER2;
-  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+  _Static_assert(MPU_REGION_NUMBER4 + RX_SUPERFRAME_QUEUE_DEPTH <= MPU_REGION_NUMBER15, "MPU regions exhausted, lower RX_SUPERFRAME_QUEUE_DEPTH");
 
-  MPU_InitStruct.BaseAddress = (uint32_t)RX_Buffer_userspace;
-  MPU_InitStruct.Number = MPU_REGION_NUMBER3;
-  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+  for (int i = 0; i < RX_SUPERFRAME_QUEUE_DEPTH; i++)
+  {
+    MPU_InitStruct.BaseAddress = (uint32_t)RX_Buffer[i];
+    MPU_InitStruct.Number = MPU_REGION_NUMBER2 + i;
+    HAL_MPU_ConfigRegion(&MPU_InitStruct);
+  }
 
   MPU_InitStruct.BaseAddress = D3_SRAM_BASE;
   MPU_InitStruct.Size = MPU_REGION_SIZE_64KB;
@@ -166,13 +251,25 @@ static void MPU_Config(void)
   MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
   MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
   MPU_InitStruct.IsShareable = MPU_ACCESS_NOT_SHAREABLE;
-  MPU_InitStruct.Number = MPU_REGION_NUMBER3;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER2 + RX_SUPERFRAME_QUEUE_DEPTH;
   MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
   MPU_InitStruct.SubRegionDisable = 0x00;
   MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_ENABLE;
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
+  /* The UART DMA reads and writes behind the cache's back. */
+  MPU_InitStruct.BaseAddress = (uint32_t)uart_ring_buffer_memory;
+  MPU_InitStruct.Size = __builtin_ctz(UART_RX_RING_BUFFER_SIZE) - 1;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_SHAREABLE;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER3 + RX_SUPERFRAME_QUEUE_DEPTH;
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
+  MPU_InitStruct.BaseAddress = (uint32_t)uart_tx_ring_buffer_memory;
+  MPU_InitStruct.Size = __builtin_ctz(UART_TX_RING_BUFFER_SIZE) - 1;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER4 + RX_SUPERFRAME_QUEUE_DEPTH;
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+
   /* Enable MPU */
   HAL_MPU_Enable(MPU_PRIVILEGED_DEFAULT);
 }
@@ -188,11 +285,7 @@ static void MX_DMA_Init(void)
   HAL_NVIC_SetPriority(DMA1_Stream1_IRQn, 0, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream1_IRQn);
 
-  HAL_NVIC_SetPriority(DMA1_Stream2_IRQn, 0, 0);
-  HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
-
-  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 0, 0);
-  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+  /* DMA1_Stream2 and DMA1_Stream3 are the USART2 RX and TX DMA, see HAL_UART_MspInit(). */
 }
 
 void clean_dma_buffer()
@@ -200,37 +293,218 @@ void clean_dma_buffer()
   memset((uint8_t*)TX_Buffer_1, 0, sizeof(TX_Buffer_1));
   memset((uint8_t*)TX_Buffer_2, 0, sizeof(TX_Buffer_2));
   memset((uint8_t*)RX_Buffer, 0, sizeof(RX_Buffer));
-  memset((uint8_t*)RX_Buffer_userspace, 0, sizeof(RX_Buffer_userspace));
 }
 
-int enqueue_packet(uint8_t const peripheral, uint8_t const opcode, uint16_t const size, void * data)
+static inline uint8_t tx_buf_index(volatile uint8_t const * buf)
 {
-  /* Enter critical section: Since this function is called both from inside
-   * interrupt context (handle_irq/gpio.c) as well as from normal execution
-   * context it is necessary not only to blindly re-enable interrupts, but
-   * to store the current interrupt situation and restore it at the end of
-   * the critical section.
-   */
-  volatile uint32_t primask_bit = __get_PRIMASK();
-  /*
-   * PRIMASK - Typically configured in code using the CMSIS __disable_irq() and
-   * __enable_irq() routines or the cpsid i and cpsie i assembly instructions
-   * directly. Setting the PRIMASK to 1 disables all exceptions of configurable
-   * priority. This means, only NMI, Hardfault, & Reset exceptions can still occur.
-   *
-   * Source: https://interrupt.memfault.com/blog/arm-cortex-m-exceptions-and-nvic
-   */
-  __set_PRIMASK(1) ;
+  return (buf == TX_Buffer_1) ? 0 : 1;
+}
+
+static inline volatile uint8_t * tx_buf(uint8_t const index)
+{
+  return (index == 0) ? TX_Buffer_1 : TX_Buffer_2;
+}
 
-  int bytes_enqueued = 0;
+static inline uint16_t tx_reservation_size(uint32_t const reservation, uint8_t const lane)
+{
+  if (lane == TX_LANE_HIGH)
+    return (reservation & TX_RESERVATION_HIGH_Msk) >> TX_RESERVATION_HIGH_Pos;
+  else
+    return reservation & TX_RESERVATION_SIZE_Msk;
+}
 
-  /* complete_packet:
-   * - uint16_t size;      |
-   * - uint16_t checksum;  | sizeof(complete_packet.header) = 4 Bytes
+static inline uint32_t tx_reservation_unit(uint8_t const lane)
+{
+  return (lane == TX_LANE_HIGH) ? (1UL << TX_RESERVATION_HIGH_Pos) : 1UL;
+}
+
+static inline uint16_t tx_lane_capacity(uint8_t const lane)
+{
+  return (lane == TX_LANE_HIGH) ? TX_HIGH_PRIORITY_LANE_SIZE : (TX_SUPERFRAME_MAX_SIZE - TX_HIGH_PRIORITY_LANE_SIZE);
+}
+
+static inline uint8_t * tx_lane_base(uint8_t const buf, uint8_t const lane)
+{
+  struct complete_packet * pkt = (struct complete_packet *)tx_buf(buf);
+  return (uint8_t *)&(pkt->data) + ((lane == TX_LANE_HIGH) ? 0 : TX_HIGH_PRIORITY_LANE_SIZE);
+}
+
+static uint8_t tx_lane_of(uint8_t const peripheral, uint8_t const opcode)
+{
+  if (peripheral == PERIPH_GPIO && opcode == IRQ_SIGNAL)
+    return TX_LANE_HIGH;
+  if ((peripheral == PERIPH_FDCAN1 || peripheral == PERIPH_FDCAN2) && (opcode == CAN_STATUS || opcode == CAN_TX_BATCH_STATUS))
+    return TX_LANE_HIGH;
+  return TX_LANE_NORMAL;
+}
+
+static void atomic_increment(volatile uint32_t * value)
+{
+  do {
+  } while (__STREXW(__LDREXW(value) + 1, value));
+}
+
+/* Marks the TX buffer as handed over to the SPI transfer and returns its
+ * reservation word from right before that.
+ */
+static uint32_t tx_reservation_close(uint8_t const buf)
+{
+  uint32_t reservation;
+  do {
+    reservation = __LDREXW(&tx_reservation[buf]);
+  } while (__STREXW(reservation | TX_RESERVATION_CLOSED, &tx_reservation[buf]));
+  return reservation;
+}
+
+/* Closes the TX buffer only if all reservations have been committed. */
+static bool tx_reservation_try_close(uint8_t const buf, uint32_t * reservation)
+{
+  do {
+    *reservation = __LDREXW(&tx_reservation[buf]);
+    if (*reservation & TX_RESERVATION_WRITER_Msk)
+    {
+      __CLREX();
+      return false;
+    }
+  } while (__STREXW(*reservation | TX_RESERVATION_CLOSED, &tx_reservation[buf]));
+  return true;
+}
+
+static void spi_transfer_mode_apply(uint8_t const mode)
+{
+  spi_transfer_mode = mode;
+
+  /* Single-phase transfers end on the rising edge of CS. */
+  if (mode == SPI_TRANSFER_SINGLE_PHASE)
+    EXTI->RTSR1 |= EXTI_RTSR1_TR15;
+  else
+    EXTI->RTSR1 &= ~EXTI_RTSR1_TR15;
+}
+
+/* Resets the transfer buffer once its content has been sent. */
+static void tx_reservation_release()
+{
+  uint8_t const buf = tx_buf_index(p_tx_buf_transfer);
+  struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
+
+  if (spi_transfer_mode_pending_buf == buf)
+  {
+    spi_transfer_mode_pending_buf = -1;
+    spi_transfer_mode_apply(spi_transfer_mode_pending);
+  }
+
+  tx_pkt->header.size = 0;
+  tx_pkt->header.checksum = 0;
+  tx_urgent[buf] = false;
+  tx_high_lane_moved = false;
+  tx_reservation[buf] = 0;
+}
+
+/* Records the queueing delay of the oldest subpacket of each priority
+ * class within the transfer buffer once it has been sent.
+ */
+static void tx_lane_update_stats()
+{
+  uint8_t const buf = tx_buf_index(p_tx_buf_transfer);
+  uint32_t const reservation = tx_reservation[buf];
+  uint32_t const now = cycle_counter_get();
+
+  for (uint8_t lane = 0; lane < TX_LANES; lane++)
+  {
+    if (tx_reservation_size(reservation, lane) == 0)
+      continue;
+
+    struct tx_lane_stats * stats = &tx_lane_stats[lane];
+    uint32_t const delay_us = cycle_counter_to_us(now - tx_first_cycles[buf][lane]);
+
+    stats->superframes++;
+    stats->delay_last_us = delay_us;
+    if (delay_us > stats->delay_max_us)
+      stats->delay_max_us = delay_us;
+    tx_lane_delay_sum_us[lane] += delay_us;
+  }
+}
+
+/* Gives back the last unused bytes of a reservation. Whatever has been reserved
+ * behind it belongs to interrupts which preempted the producer and have
+ * committed by now, it is moved up against the subpacket. The buffer can't
+ * be swapped out meanwhile, tx_buf_swap() only closes it once all
+ * reservations have been committed.
+ */
+static void tx_reservation_shrink(struct tx_handle const * handle, uint16_t const unused)
+{
+  uint8_t * const lane_base = tx_lane_base(handle->buf, handle->lane);
+  uint16_t moved = handle->offset + sizeof(handle->subpkt->header) + handle->max_size;
+
+  if (unused == 0)
+    return;
+
+  for (;;)
+  {
+    uint32_t const reservation = __LDREXW(&tx_reservation[handle->buf]);
+    uint16_t const end = tx_reservation_size(reservation, handle->lane);
+
+    /* Another interrupt may reserve while the tail is moved, its subpacket
+     * is picked up by the next iteration.
+     */
+    if (end != moved)
+    {
+      __CLREX();
+      memmove(lane_base + moved - unused, lane_base + moved, end - moved);
+      moved = end;
+      continue;
+    }
+    if (__STREXW(reservation - unused * tx_reservation_unit(handle->lane), &tx_reservation[handle->buf]) == 0)
+      return;
+  }
+}
+
+static struct tx_handle tx_reserve_any(uint8_t const peripheral, uint8_t const opcode, uint16_t const max_size)
+{
+  struct tx_handle handle = {0};
+  uint32_t const bytes = sizeof(handle.subpkt->header) + max_size;
+  uint32_t reservation = 0;
+  uint8_t buf = 0;
+  uint8_t lane = tx_lane_of(peripheral, opcode);
+
+  /* Claim room at the end of the lane within the active superframe. This
+   * function is called from interrupt context (handle_irq/gpio.c, PWM capture)
+   * as well as from the main loop. Any exception taken between LDREX and STREX
+   * clears the exclusive monitor, so if another producer or the buffer swap in
+   * EXTI15_10_IRQHandler gets in between the STREX fails and the reservation
+   * is retried against the then active buffer.
    */
-  struct complete_packet * pkt = (struct complete_packet *)p_tx_buf_active;
-  if ((pkt->header.size + size) > SPI_DMA_BUFFER_SIZE)
-    goto cleanup;
+  for (;;)
+  {
+    buf = tx_buf_index(p_tx_buf_active);
+    reservation = __LDREXW(&tx_reservation[buf]);
+
+    if ((reservation & TX_RESERVATION_CLOSED) || buf != tx_buf_index(p_tx_buf_active))
+    {
+      __CLREX();
+      continue;
+    }
+
+    /* complete_packet:
+     * - uint16_t size;      |
+     * - uint16_t checksum;  | sizeof(complete_packet.header) = 4 Bytes
+     */
+    if (tx_reservation_size(reservation, lane) + bytes > tx_lane_capacity(lane))
+    {
+      __CLREX();
+      atomic_increment(&tx_lane_full[lane]);
+      /* A full high priority lane overflows into the normal one. */
+      if (lane == TX_LANE_HIGH)
+      {
+        lane = TX_LANE_NORMAL;
+        continue;
+      }
+      return handle;
+    }
+
+    if (__STREXW(reservation + bytes * tx_reservation_unit(lane) + TX_RESERVATION_WRITER, &tx_reservation[buf]) == 0)
+      break;
+  }
 
   /* subpacket:
    * - uint8_t peripheral; |
@@ -238,38 +512,259 @@ int enqueue_packet(uint8_t const peripheral, uint8_t const opcode, uint16_t cons
    * - uint16_t size;      | sizeof(subpacket.header) = 4 Bytes
    * - uint8_t raw_data;
    */
-  struct subpacket subpkt;
-  subpkt.header.peripheral = peripheral;
-  subpkt.header.opcode = opcode;
-  subpkt.header.size = size;
-  /* Copy subpacket.header at the end of the current complete_packet superframe. */
-  memcpy((uint8_t*)&(pkt->data) + pkt->header.size, &subpkt, sizeof(subpkt.header));
-  pkt->header.size += sizeof(subpkt.header);
-  /* Copy subpacket.raw_data at after subpacket.header. */
-  memcpy((uint8_t*)&(pkt->data) + pkt->header.size, data, size);
-  pkt->header.size += size;
-  /* Calculate a simple checksum to ensure bit flips in the length field can be recognized. */
-  pkt->header.checksum = pkt->header.size ^ 0x5555;
-  /* Update internal status variable of how many bytes have been enqueued. */
-  bytes_enqueued += sizeof(subpkt.header) + size;
+  handle.buf = buf;
+  handle.lane = lane;
+  handle.offset = tx_reservation_size(reservation, lane);
+  if (handle.offset == 0)
+    tx_first_cycles[buf][lane] = cycle_counter_get();
+  handle.subpkt = (struct subpacket *)(tx_lane_base(buf, lane) + handle.offset);
+  handle.subpkt->header.peripheral = peripheral;
+  handle.subpkt->header.opcode = opcode;
+  handle.subpkt->header.size = max_size;
+  handle.data = &(handle.subpkt->raw_data);
+  handle.max_size = max_size;
+
+  return handle;
+}
+
+struct tx_handle tx_reserve(uint8_t const peripheral, uint8_t const opcode, uint16_t const max_size)
+{
+  /* Subpackets of a peripheral which wait in the spill queue have to go out
+   * first, e.g. a CAN_STATUS reporting an overrun ahead of the frames which
+   * have been received afterwards.
+   */
+  if (peripheral < TX_STATS_NUM_PERIPHERALS && tx_spill_pending[peripheral] > 0)
+  {
+    struct tx_handle const handle = {0};
+    return handle;
+  }
+
+  return tx_reserve_any(peripheral, opcode, max_size);
+}
+
+int tx_commit(struct tx_handle const * handle, uint16_t const actual_size)
+{
+  if (!handle->data)
+    return 0;
+
+  uint16_t const size = (actual_size < handle->max_size) ? actual_size : handle->max_size;
+
+  tx_reservation_shrink(handle, handle->max_size - size);
+  handle->subpkt->header.size = size;
+
+  /* A high priority subpacket stays urgent when it has overflowed into
+   * the normal lane.
+   */
+  uint8_t const peripheral = handle->subpkt->header.peripheral;
+  if (tx_lane_of(peripheral, handle->subpkt->header.opcode) == TX_LANE_HIGH ||
+      (peripheral < IRQ_COALESCE_NUM_PERIPHERALS && (irq_coalesce.urgent_mask & (1 << peripheral))))
+    tx_urgent[handle->buf] = true;
+
+  /* The subpacket has to be complete before the reservation is released,
+   * afterwards it may be picked up by the SPI DMA at any time.
+   */
+  __DMB();
+
+  uint32_t reservation;
+  do {
+    reservation = __LDREXW(&tx_reservation[handle->buf]) - TX_RESERVATION_WRITER;
+  } while (__STREXW(reservation, &tx_reservation[handle->buf]));
 
 #ifdef DEBUG
   dbg_printf("Enqueued packet for peripheral: %s Opcode: %X Size: %X\n  data: ",
-      peripheral_to_string(peripheral), opcode, size);
+      peripheral_to_string(handle->subpkt->header.peripheral), handle->subpkt->header.opcode, size);
 
   for (int i = 0; i < size; i++)
-    dbg_printf("0x%02X ", *(((uint8_t*)data) + i));
+    dbg_printf("0x%02X ", handle->data[i]);
 
   dbg_printf("\n");
 #endif
 
-cleanup:
-  /* Exit critical section: restore previous priority mask */
+  /* Return how many bytes have been enqueued. */
+  return sizeof(handle->subpkt->header) + size;
+}
+
+/* Gives back a reservation entirely, nothing is sent. */
+void tx_cancel(struct tx_handle const * handle)
+{
+  if (!handle->data)
+    return;
+
+  tx_reservation_shrink(handle, sizeof(handle->subpkt->header) + handle->max_size);
+
+  uint32_t reservation;
+  do {
+    reservation = __LDREXW(&tx_reservation[handle->buf]) - TX_RESERVATION_WRITER;
+  } while (__STREXW(reservation, &tx_reservation[handle->buf]));
+}
+
+static int tx_spill(uint8_t const peripheral, uint8_t const opcode, uint16_t const size, void * data)
+{
+  struct subpacket subpkt;
+  uint32_t const bytes = sizeof(subpkt.header) + size;
+  int bytes_spilled = 0;
+
+  subpkt.header.peripheral = peripheral;
+  subpkt.header.opcode = opcode;
+  subpkt.header.size = size;
+
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  if ((tx_spill_used + bytes) <= TX_SPILL_QUEUE_SIZE)
+  {
+    memcpy(tx_spill_queue + tx_spill_used, &subpkt, sizeof(subpkt.header));
+    memcpy(tx_spill_queue + tx_spill_used + sizeof(subpkt.header), data, size);
+    tx_spill_used += bytes;
+
+    if (tx_spill_used > tx_drop_stats.spill_used_max)
+      tx_drop_stats.spill_used_max = tx_spill_used;
+    if (peripheral < TX_STATS_NUM_PERIPHERALS)
+    {
+      tx_drop_stats.spilled[peripheral]++;
+      tx_spill_pending[peripheral]++;
+    }
+    bytes_spilled = bytes;
+  }
+  else if (peripheral < TX_STATS_NUM_PERIPHERALS)
+  {
+    tx_drop_stats.dropped[peripheral]++;
+  }
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+
+  if (!bytes_spilled)
+    dbg_printf("enqueue_packet: dropped packet for peripheral: %s Opcode: %X Size: %X\n",
+               peripheral_to_string(peripheral), opcode, size);
+
+  return bytes_spilled;
+}
+
+int enqueue_packet(uint8_t const peripheral, uint8_t const opcode, uint16_t const size, void * data)
+{
+  /* As long as subpackets are waiting in the spill queue new ones are
+   * queued behind them, otherwise they could overtake each other. High
+   * priority subpackets are sent ahead of everything else anyway, they
+   * only end up in the spill queue if there is no room at all or if their
+   * peripheral has subpackets waiting there.
+   */
+  if (tx_spill_used == 0 || tx_lane_of(peripheral, opcode) == TX_LANE_HIGH)
+  {
+    struct tx_handle const handle = tx_reserve(peripheral, opcode, size);
+    if (handle.data)
+    {
+      memcpy(handle.data, data, size);
+      return tx_commit(&handle, size);
+    }
+  }
+
+  return tx_spill(peripheral, opcode, size, data);
+}
+
+/* Sends the confirmation of a pending transfer mode switch. The switch is
+ * bound to the TX buffer carrying it, therefore it is not queued in the
+ * spill queue but reserved again until it fits.
+ */
+static int spi_transfer_mode_confirm()
+{
+  if (spi_transfer_mode_unconfirmed < 0)
+    return 0;
+
+  uint8_t const mode = spi_transfer_mode_unconfirmed;
+  struct tx_handle const handle = tx_reserve(PERIPH_H7, H7_SPI_TRANSFER_MODE, sizeof(mode));
+  if (!handle.data)
+    return 0;
+
+  handle.data[0] = mode;
+  spi_transfer_mode_pending = mode;
+  spi_transfer_mode_pending_buf = handle.buf;
+  spi_transfer_mode_unconfirmed = -1;
+
+  return tx_commit(&handle, sizeof(mode));
+}
+
+int tx_spill_handle_data()
+{
+  int bytes_enqueued = spi_transfer_mode_confirm();
+  uint16_t const spill_used = tx_spill_used;
+
+  /* Only the main loop consumes the spill queue and producers only append
+   * behind spill_used, so the subpackets can be copied without locking.
+   */
+  while (tx_spill_read < spill_used)
+  {
+    struct subpacket subpkt;
+    memcpy(&subpkt, tx_spill_queue + tx_spill_read, sizeof(subpkt.header));
+
+    struct tx_handle const handle = tx_reserve_any(subpkt.header.peripheral, subpkt.header.opcode, subpkt.header.size);
+    if (!handle.data)
+      break;
+
+    memcpy(handle.data, tx_spill_queue + tx_spill_read + sizeof(subpkt.header), subpkt.header.size);
+    bytes_enqueued += tx_commit(&handle, subpkt.header.size);
+    tx_spill_read += sizeof(subpkt.header) + subpkt.header.size;
+
+    if (subpkt.header.peripheral < TX_STATS_NUM_PERIPHERALS)
+    {
+      /* Enter critical section. */
+      volatile uint32_t primask_bit = __get_PRIMASK();
+      __set_PRIMASK(1) ;
+
+      tx_spill_pending[subpkt.header.peripheral]--;
+
+      /* Leave critical section. */
+      __set_PRIMASK(primask_bit);
+    }
+  }
+
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  /* Move what is left to the front, so that interrupts which keep
+   * appending don't run the queue full while it is never empty.
+   */
+  if (tx_spill_read > 0)
+  {
+    memmove(tx_spill_queue, tx_spill_queue + tx_spill_read, tx_spill_used - tx_spill_read);
+    tx_spill_used -= tx_spill_read;
+    tx_spill_read = 0;
+  }
+
+  /* Leave critical section. */
   __set_PRIMASK(primask_bit);
 
   return bytes_enqueued;
 }
 
+int dma_set_transfer_mode(uint8_t const mode)
+{
+  if (mode != SPI_TRANSFER_TWO_PHASE && mode != SPI_TRANSFER_SINGLE_PHASE)
+    return -1;
+
+  /* The AP switches once it has received the confirmation, the H7 once it
+   * has sent it.
+   */
+  spi_transfer_mode_unconfirmed = mode;
+
+  return spi_transfer_mode_confirm();
+}
+
+void tx_get_drop_stats(struct tx_drop_stats * stats)
+{
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  *stats = tx_drop_stats;
+  stats->spill_used = tx_spill_used - tx_spill_read;
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+}
+
 void set_nirq_low()
 {
   /* Trigger transfer. */
@@ -283,18 +778,90 @@ void set_nirq_high()
 }
 
 uint16_t get_tx_packet_size()
+{
+  uint32_t const reservation = tx_reservation[tx_buf_index(p_tx_buf_active)];
+
+  /* A closed buffer means it has just been swapped out, the active one is empty. */
+  if (reservation & TX_RESERVATION_CLOSED)
+    return 0;
+
+  return tx_reservation_size(reservation, TX_LANE_HIGH) + tx_reservation_size(reservation, TX_LANE_NORMAL);
+}
+
+bool is_tx_packet_due()
+{
+  uint8_t const buf = tx_buf_index(p_tx_buf_active);
+  uint16_t const tx_packet_size = get_tx_packet_size();
+
+  if (tx_packet_size == 0)
+    return false;
+
+  bool is_due = false;
+
+  if (irq_coalesce.threshold_bytes == 0)
+    is_due = true;
+  else if (tx_urgent[buf])
+  {
+    is_due = true;
+    irq_coalesce_stats.urgent++;
+  }
+  else if (tx_packet_size >= irq_coalesce.threshold_bytes)
+  {
+    is_due = true;
+    irq_coalesce_stats.threshold++;
+  }
+  /* The delay is checked once per main loop pass, which runs at least once
+   * per SysTick, i.e. with a resolution of 1 ms.
+   */
+  else if (irq_coalesce.max_delay_us &&
+           cycle_counter_to_us(cycle_counter_get() - tx_first_cycles[buf][TX_LANE_NORMAL]) >= irq_coalesce.max_delay_us)
+  {
+    is_due = true;
+    irq_coalesce_stats.timeout++;
+  }
+
+  if (is_due)
+  {
+    irq_coalesce_stats.signals++;
+    irq_coalesce_bytes_sum += tx_packet_size;
+  }
+
+  return is_due;
+}
+
+void irq_coalesce_set_config(struct irq_coalesce_config const * config)
+{
+  irq_coalesce = *config;
+}
+
+void irq_coalesce_get_stats(struct irq_coalesce_stats * stats)
 {
   /* Enter critical section. */
-  uint32_t primask_bit = __get_PRIMASK();
+  volatile uint32_t primask_bit = __get_PRIMASK();
   __set_PRIMASK(1) ;
 
-  struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_active;
-  uint16_t const tx_packet_size = tx_pkt->header.size;
+  *stats = irq_coalesce_stats;
+  stats->bytes_avg = irq_coalesce_stats.signals ? (uint32_t)(irq_coalesce_bytes_sum / irq_coalesce_stats.signals) : 0;
 
-  /* Exit critical section: restore previous priority mask */
+  /* Leave critical section. */
   __set_PRIMASK(primask_bit);
+}
 
-  return tx_packet_size;
+void tx_get_lane_stats(struct tx_lane_stats stats[TX_LANES])
+{
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  for (uint8_t lane = 0; lane < TX_LANES; lane++)
+  {
+    stats[lane] = tx_lane_stats[lane];
+    stats[lane].lane_full = tx_lane_full[lane];
+    stats[lane].delay_avg_us = tx_lane_stats[lane].superframes ? (uint32_t)(tx_lane_delay_sum_us[lane] / tx_lane_stats[lane].superframes) : 0;
+  }
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
 }
 
 void system_init() {
@@ -309,6 +876,8 @@ void system_init() {
   SystemClock_Config();
 
   PeriphCommonClock_Config();
+
+  cycle_counter_init();
 }
 
 void dma_init()
@@ -317,82 +886,249 @@ void dma_init()
   clean_dma_buffer();
 }
 
+/* Swaps the active TX buffer out for the transfer and writes the header
+ * of the superframe. The size sent to the AP has to be final, so if a
+ * reservation is in flight the buffers are swapped back and the other one,
+ * which normally is empty, is sent instead. The producer gives back what
+ * it did not use and its subpacket goes out with the next transfer.
+ */
+static void tx_buf_swap()
+{
+  uint8_t const active = tx_buf_index(p_tx_buf_active);
+  uint8_t const other = (active == 0) ? 1 : 0;
+  uint32_t reservation;
+
+  /* Perform the switch from active buffer pointer to
+   * processing buffer pointer. This allows the application
+   * to continue feeding data into the second transmit
+   * buffer.
+   */
+  p_tx_buf_transfer = p_tx_buf_active;
+  p_tx_buf_active = tx_buf(other);
+
+  if (!tx_reservation_try_close(active, &reservation))
+  {
+    p_tx_buf_active = p_tx_buf_transfer;
+    p_tx_buf_transfer = tx_buf(other);
+    reservation = tx_reservation_close(other);
+  }
+
+  struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
+  tx_pkt->header.size = tx_reservation_size(reservation, TX_LANE_HIGH) + tx_reservation_size(reservation, TX_LANE_NORMAL);
+  /* Calculate a simple checksum to ensure bit flips in the length field can be recognized. */
+  tx_pkt->header.checksum = tx_pkt->header.size ? (tx_pkt->header.size ^ 0x5555) : 0;
+}
+
+/* Returns the start of the subpackets within the transfer buffer. Must
+ * only be called once all its reservations have been committed, the high
+ * priority lane is moved up against the normal lane so that it is sent
+ * first.
+ */
+static uint8_t * tx_buf_data()
+{
+  uint8_t const buf = tx_buf_index(p_tx_buf_transfer);
+  uint16_t const high_size = tx_reservation_size(tx_reservation[buf], TX_LANE_HIGH);
+  uint8_t * tx_data = tx_lane_base(buf, TX_LANE_NORMAL) - high_size;
+
+  if (high_size > 0 && high_size < TX_HIGH_PRIORITY_LANE_SIZE)
+  {
+    memmove(tx_data, tx_lane_base(buf, TX_LANE_HIGH), high_size);
+    tx_high_lane_moved = true;
+  }
+
+  return tx_data;
+}
+
+/* Selects the receive slot for the next transfer. If all slots are still
+ * waiting to be dispatched the most recently received superframe is
+ * dropped and its slot is reused.
+ */
+static struct complete_packet * rx_slot_select()
+{
+  if (rx_slot_count == RX_SUPERFRAME_QUEUE_DEPTH)
+  {
+    rx_slot_head = (rx_slot_head + RX_SUPERFRAME_QUEUE_DEPTH - 1) % RX_SUPERFRAME_QUEUE_DEPTH;
+    rx_slot_count--;
+    rx_queue_stats.overflows++;
+  }
+
+  return (struct complete_packet *)RX_Buffer[rx_slot_head];
+}
+
+/* Hands the receive slot over to the main loop and advances to the next one. */
+static void rx_slot_complete()
+{
+  struct complete_packet *rx_pkt = (struct complete_packet *)RX_Buffer[rx_slot_head];
+
+  /* Mark the next packet as invalid. */
+  *((uint32_t*)((uint8_t *)&(rx_pkt->data) + rx_pkt->header.size)) = 0xFFFFFFFF;
+
+  rx_slot_size[rx_slot_head] = rx_pkt->header.size;
+  rx_slot_cycles[rx_slot_head] = cycle_counter_get();
+  rx_slot_head = (rx_slot_head + 1) % RX_SUPERFRAME_QUEUE_DEPTH;
+  rx_slot_count++;
+
+  rx_queue_stats.superframes++;
+  if (rx_slot_count > rx_queue_stats.used_max)
+    rx_queue_stats.used_max = rx_slot_count;
+}
+
+/* The SPI transfer is complete, passes on the receive slot and releases
+ * the transfer buffer.
+ */
+static void dma_transfer_complete()
+{
+  rx_slot_complete();
+
+  tx_lane_update_stats();
+
+  /* Clean the transfer buffer size to restart. */
+  tx_reservation_release();
+
+  transaction_state = Complete;
+
+  set_nirq_high();
+}
+
+/* Single-phase transfer: header and payload are clocked within one CS
+ * cycle, the length is not known in advance. The DMA is armed for as
+ * much as fits into the buffers and stopped on the rising edge of CS.
+ */
+static void dma_start_single_phase()
+{
+  tx_buf_swap();
+
+  struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
+  struct complete_packet * rx_pkt = rx_slot_select();
+
+  /* Place a copy of the header right in front of the subpackets. */
+  uint8_t * tx_start = tx_buf_data() - sizeof(tx_pkt->header);
+  if (tx_start != (uint8_t *)&(tx_pkt->header))
+    memmove(tx_start, &(tx_pkt->header), sizeof(tx_pkt->header));
+
+  /* The end-of-superframe marker is only written once the transfer is
+   * complete, so the receive slot may be filled up entirely. The DMA
+   * counter is 16 bit wide, see TX_SUPERFRAME_MAX_SIZE.
+   */
+  uint32_t const len = SPI_DMA_BUFFER_SIZE - (tx_start - (uint8_t *)p_tx_buf_transfer);
+  single_phase_len = (len > UINT16_MAX) ? UINT16_MAX : len;
+
+  spi_transmit_receive(tx_start, (uint8_t *)&(rx_pkt->header), single_phase_len);
+
+  transaction_state = SinglePhase;
+}
+
+static void dma_finish_single_phase()
+{
+  struct complete_packet * rx_pkt = (struct complete_packet *)RX_Buffer[rx_slot_head];
+  uint16_t const received = single_phase_len - spi_rx_remaining();
+
+  spi_end();
+
+  if (received < sizeof(rx_pkt->header))
+    rx_pkt->header.size = 0;
+  else if (rx_pkt->header.size > (received - sizeof(rx_pkt->header)))
+    rx_pkt->header.size = received - sizeof(rx_pkt->header);
+
+  if (rx_pkt->header.size > RX_SUPERFRAME_MAX_SIZE)
+    rx_pkt->header.size = RX_SUPERFRAME_MAX_SIZE;
+
+  dma_transfer_complete();
+}
+
 void EXTI15_10_IRQHandler(void)
 {
-  /* Step #1:
-   * This function is called when IMX8 is pulling CS -> LOW.
+  bool const is_single_phase = (spi_transfer_mode == SPI_TRANSFER_SINGLE_PHASE);
+
+  /* Clear the pending bit first so that an edge which arrives while the
+   * transfer is handled below raises the interrupt again.
+   */
+  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_15);
+
+  /* In single-phase mode both edges share one pending bit, the CS level read
+   * here may already belong to a later edge. Which edge fired is therefore
+   * derived from the transfer state: a single-phase transfer is only ever
+   * ended by CS -> HIGH.
    */
-  if (transaction_state == Idle || transaction_state == Complete)
+  if (is_single_phase && transaction_state == SinglePhase)
+    dma_finish_single_phase();
+
+  /* A short CS HIGH pulse may have coalesced the rising edge with the falling
+   * edge of the next transfer, start it right away if CS is LOW again.
+   */
+  if ((transaction_state == Idle || transaction_state == Complete) &&
+      (!is_single_phase || HAL_GPIO_ReadPin(GPIOA, GPIO_PIN_15) == GPIO_PIN_RESET))
   {
-    /* Perform the switch from active buffer pointer to
-     * processing buffer pointer. This allows the application
-     * to continue feeding data into the second transmit
-     * buffer.
+    /* Step #1:
+     * This function is called when IMX8 is pulling CS -> LOW.
      */
-    p_tx_buf_transfer = p_tx_buf_active;
-    p_tx_buf_active = (p_tx_buf_active == TX_Buffer_1) ? TX_Buffer_2 : TX_Buffer_1;
+    if (is_single_phase)
+    {
+      dma_start_single_phase();
+    }
+    else
+    {
+      tx_buf_swap();
 
-    struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
-    struct complete_packet * rx_pkt = (struct complete_packet *)RX_Buffer;
+      struct complete_packet * tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
+      struct complete_packet * rx_pkt = rx_slot_select();
 
-    spi_transmit_receive((uint8_t *)&(tx_pkt->header),
-                         (uint8_t *)&(rx_pkt->header),
-                         sizeof(tx_pkt->header));
+      spi_transmit_receive((uint8_t *)&(tx_pkt->header),
+                           (uint8_t *)&(rx_pkt->header),
+                           sizeof(tx_pkt->header));
 
-    transaction_state = Header;
+      transaction_state = Header;
+    }
   }
+}
 
-  HAL_GPIO_EXTI_IRQHandler(GPIO_PIN_15);
+static void dma_start_data_phase()
+{
+  struct complete_packet *tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
+  struct complete_packet *rx_pkt = (struct complete_packet *)RX_Buffer[rx_slot_head];
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+  uint16_t const bytes_to_transfer = max(tx_pkt->header.size, rx_pkt->header.size);
+#pragma GCC diagnostic pop
+
+  /* Nothing to transfer. */
+  if (bytes_to_transfer == 0)
+  {
+    /* Cleanup. */
+    tx_reservation_release();
+    /* Transition to Idle state. */
+    transaction_state = Idle;
+    return;
+  }
+
+  // reconfigure the DMA to actually receive the data
+  spi_transmit_receive(tx_buf_data(), (uint8_t*)&(rx_pkt->data), bytes_to_transfer);
+  transaction_state = Data;
 }
 
 void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
 {
-  struct complete_packet *tx_pkt = (struct complete_packet *)p_tx_buf_transfer;
-  struct complete_packet *rx_pkt = (struct complete_packet *)RX_Buffer;
+  struct complete_packet *rx_pkt = (struct complete_packet *)RX_Buffer[rx_slot_head];
 
   if (transaction_state == Header)
   {
     /* Step #2:
      * Task the system with the transport of the actual data.
      */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-    uint16_t const bytes_to_transfer = max(tx_pkt->header.size, rx_pkt->header.size);
-#pragma GCC diagnostic pop
 
-    /* Nothing to transfer. */
-    if (bytes_to_transfer == 0)
-    {
-      /* Cleanup. */
-      tx_pkt->header.size = 0;
-      tx_pkt->header.checksum = 0;
-      /* Transition to Idle state. */
-      transaction_state = Idle;
-      return;
-    }
+    /* Leave room for the end-of-superframe marker within the receive slot. */
+    if (rx_pkt->header.size > RX_SUPERFRAME_MAX_SIZE)
+      rx_pkt->header.size = RX_SUPERFRAME_MAX_SIZE;
 
-    // reconfigure the DMA to actually receive the data
-    spi_transmit_receive((uint8_t*)&(tx_pkt->data), (uint8_t*)&(rx_pkt->data), bytes_to_transfer);
-    transaction_state = Data;
+    dma_start_data_phase();
   }
   else if (transaction_state == Data)
   {
     /* Step #3:
-     * The SPI transfer is now complete, copy to userspace memory.
+     * The SPI transfer is now complete.
      */
-    memcpy((void *)rx_pkt_userspace, &(rx_pkt->data), rx_pkt->header.size);
-
-    /* Mark the next packet as invalid. */
-    *((uint32_t*)((uint8_t *)rx_pkt_userspace + rx_pkt->header.size)) = 0xFFFFFFFF;
-
-    /* Clean the transfer buffer size to restart. */
-    tx_pkt->header.size = 0;
-    tx_pkt->header.checksum = 0;
-
-    transaction_state = Complete;
-    is_rx_buf_userspace_processed = false;
-
-    set_nirq_high();
+    dma_transfer_complete();
   }
 }
 
@@ -402,6 +1138,68 @@ void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
   spi_end();
 }
 
+/* Dispatches the subpacket rx_pkt_userspace is pointing to and advances
+ * to the next one, releasing the receive slot once the end of the
+ * superframe has been reached. Returns the number of dispatched
+ * subpackets or -1 if no received superframe is pending. Must be called
+ * from within a critical section.
+ */
+static int dma_dispatch_subpacket()
+{
+  if (rx_slot_count == 0)
+    return -1;
+
+  uint8_t * const slot_data = (uint8_t *)&(((struct complete_packet *)RX_Buffer[rx_slot_tail])->data);
+  uint32_t const offset = (uint8_t *)rx_pkt_userspace - slot_data;
+
+  if (rx_pkt_userspace->header.peripheral == 0xFF ||
+      rx_pkt_userspace->header.peripheral == 0x00 ||
+      (offset + 4 /* sizeof(subpacket.header) */ + rx_pkt_userspace->header.size) > rx_slot_size[rx_slot_tail])
+  {
+    uint32_t const latency_us = cycle_counter_to_us(cycle_counter_get() - rx_slot_cycles[rx_slot_tail]);
+    dispatch_stats.superframes++;
+    dispatch_stats.latency_last_us = latency_us;
+    if (latency_us > dispatch_stats.latency_max_us)
+      dispatch_stats.latency_max_us = latency_us;
+    dispatch_latency_sum_us += latency_us;
+
+    /* Release the receive slot and continue with the next one. */
+    rx_slot_tail = (rx_slot_tail + 1) % RX_SUPERFRAME_QUEUE_DEPTH;
+    rx_slot_count--;
+    rx_pkt_userspace = (struct subpacket *)&(((struct complete_packet *)RX_Buffer[rx_slot_tail])->data);
+    return 0;
+  }
+
+#ifdef DEBUG
+  dbg_printf("Peripheral: %s Opcode: %X Size: %X\n  data: ",
+             peripheral_to_string(rx_pkt_userspace->header.peripheral),
+             rx_pkt_userspace->header.opcode,
+             rx_pkt_userspace->header.size);
+
+  for (int i = 0; i < rx_pkt_userspace->header.size; i++)
+    dbg_printf("0x%02X ", *((&rx_pkt_userspace->raw_data) + i));
+
+  dbg_printf("\n");
+#endif
+
+  /* Invoke the registered callback for the selected peripheral. */
+  int const rc = peripheral_invoke_callback(rx_pkt_userspace->header.peripheral,
+                                            rx_pkt_userspace->header.opcode,
+                                            (uint8_t *)(&(rx_pkt_userspace->raw_data)),
+                                            rx_pkt_userspace->header.size);
+
+  if (rc < 0) {
+    dbg_printf("dma_handle_data: %s callback error: %d",
+               peripheral_to_string(rx_pkt_userspace->header.peripheral) , rc);
+  }
+
+  dispatch_stats.subpackets++;
+
+  /* Advance to the next package. */
+  rx_pkt_userspace = (struct subpacket *)((uint8_t *)rx_pkt_userspace + 4 /* sizeof(subpacket.header) */ + rx_pkt_userspace->header.size);
+  return 1;
+}
+
 void dma_handle_data()
 {
   if (transaction_state == Error)
@@ -409,58 +1207,155 @@ void dma_handle_data()
     dbg_printf("dma_handle_data: got transfer error, recovering\n");
     HAL_GPIO_WritePin(GPIOA, GPIO_PIN_9, 0);
     HAL_GPIO_WritePin(GPIOA, GPIO_PIN_9, 1);
+
+    /* Reopen the transfer buffer, its content is sent again together with
+     * the next superframe.
+     */
+    uint8_t const buf = tx_buf_index(p_tx_buf_transfer);
+    if (tx_high_lane_moved)
+    {
+      uint16_t const high_size = tx_reservation_size(tx_reservation[buf], TX_LANE_HIGH);
+      memmove(tx_lane_base(buf, TX_LANE_HIGH), tx_lane_base(buf, TX_LANE_NORMAL) - high_size, high_size);
+      tx_high_lane_moved = false;
+    }
+
+    uint32_t reservation;
+    do {
+      reservation = __LDREXW(&tx_reservation[buf]);
+    } while (__STREXW(reservation & ~TX_RESERVATION_CLOSED, &tx_reservation[buf]));
+
     transaction_state = Idle;
     return;
   }
 
+  /* Walk the whole received superframe within a single pass instead of
+   * dispatching one subpacket per main loop iteration. Interrupts are
+   * re-enabled between subpackets and the pass is bounded by a configurable
+   * subpacket/time budget so that the watchdog and the other data handlers
+   * are not starved by a large superframe.
+   */
+  uint32_t const start_cycles = cycle_counter_get();
+  uint32_t const max_cycles = dispatch_max_time_us * (SystemCoreClock / 1000000);
+
+  for (uint16_t dispatched = 0; ; )
+  {
+    /* Enter critical section. */
+    volatile uint32_t primask_bit = __get_PRIMASK();
+    __set_PRIMASK(1) ;
+
+    bool const is_budget_exhausted = (rx_slot_count > 0) &&
+      ((dispatch_max_subpackets && dispatched >= dispatch_max_subpackets) ||
+       (dispatch_max_time_us && (cycle_counter_get() - start_cycles) >= max_cycles));
+
+    int const rc = is_budget_exhausted ? -1 : dma_dispatch_subpacket();
+
+    if (is_budget_exhausted)
+      dispatch_stats.budget_exhausted++;
+
+    /* Leave critical section. */
+    __set_PRIMASK(primask_bit);
+
+    if (rc < 0)
+      break;
+    dispatched += rc;
+  }
+}
+
+#ifdef BENCH
+/* The microbenchmarks in bench.c run without an AP. These take the place
+ * of the transfers, they must not be called while one is in progress.
+ */
+void dma_bench_discard_tx()
+{
   /* Enter critical section. */
   volatile uint32_t primask_bit = __get_PRIMASK();
   __set_PRIMASK(1) ;
 
-  if (transaction_state == Complete && !is_rx_buf_userspace_processed)
-  {
-    if (rx_pkt_userspace->header.peripheral != 0xFF &&
-        rx_pkt_userspace->header.peripheral != 0x00)
-    {
-#ifdef DEBUG
-      dbg_printf("Peripheral: %s Opcode: %X Size: %X\n  data: ",
-                 peripheral_to_string(rx_pkt_userspace->header.peripheral),
-                 rx_pkt_userspace->header.opcode,
-                 rx_pkt_userspace->header.size);
+  uint8_t const buf = tx_buf_index(p_tx_buf_active);
+  tx_urgent[buf] = false;
+  tx_reservation[buf] = 0;
+  tx_spill_read = 0;
+  tx_spill_used = 0;
+  memset((void *)tx_spill_pending, 0, sizeof(tx_spill_pending));
 
-      for (int i = 0; i < rx_pkt_userspace->header.size; i++)
-        dbg_printf("0x%02X ", *((&rx_pkt_userspace->raw_data) + i));
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+}
+
+int dma_bench_receive(uint8_t const * data, uint16_t const size)
+{
+  if (size > RX_SUPERFRAME_MAX_SIZE)
+    return -1;
 
-      dbg_printf("\n");
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  struct complete_packet * rx_pkt = rx_slot_select();
+  rx_pkt->header.size = size;
+  rx_pkt->header.checksum = size ? (size ^ 0x5555) : 0;
+  memcpy(&(rx_pkt->data), data, size);
+  rx_slot_complete();
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+
+  return size;
+}
 #endif
 
-      /* Invoke the registered callback for the selected peripheral. */
-      int const rc = peripheral_invoke_callback(rx_pkt_userspace->header.peripheral,
-                                                rx_pkt_userspace->header.opcode,
-                                                (uint8_t *)(&(rx_pkt_userspace->raw_data)),
-                                                rx_pkt_userspace->header.size);
+void dma_set_dispatch_budget(uint16_t const max_subpackets, uint16_t const max_time_us)
+{
+  dispatch_max_subpackets = max_subpackets;
+  dispatch_max_time_us = max_time_us;
+}
 
-      if (rc < 0) {
-        dbg_printf("dma_handle_data: %s callback error: %d",
-                   peripheral_to_string(rx_pkt_userspace->header.peripheral) , rc);
-      }
+void dma_get_dispatch_stats(struct dispatch_stats * stats)
+{
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
 
-      /* Advance to the next package. */
-      rx_pkt_userspace = (struct subpacket *)((uint8_t *)rx_pkt_userspace + 4 /* sizeof(subpacket.header) */ + rx_pkt_userspace->header.size);
-    }
-    else
-    {
-      /* Mark the receive buffer as having been processed. */
-      is_rx_buf_userspace_processed = true;
-      /* Make sure that the RX packet processing pointer is pointing to the start of the receive buffer. */
-      rx_pkt_userspace = (struct subpacket *)RX_Buffer_userspace;
-    }
-  }
+  *stats = dispatch_stats;
+  stats->latency_avg_us = dispatch_stats.superframes ? (uint32_t)(dispatch_latency_sum_us / dispatch_stats.superframes) : 0;
 
   /* Leave critical section. */
   __set_PRIMASK(primask_bit);
 }
 
+void dma_get_rx_queue_stats(struct rx_queue_stats * stats)
+{
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  *stats = rx_queue_stats;
+  stats->depth = RX_SUPERFRAME_QUEUE_DEPTH;
+  stats->used = rx_slot_count;
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+}
+
+void cycle_counter_init()
+{
+  /* Enable the DWT cycle counter, used for latency measurements. */
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->LAR = 0xC5ACCE55;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+uint32_t cycle_counter_get()
+{
+  return DWT->CYCCNT;
+}
+
+uint32_t cycle_counter_to_us(uint32_t const cycles)
+{
+  return cycles / (SystemCoreClock / 1000000);
+}
+
 bool is_dma_transfer_complete()
 {
   bool is_dma_transfer_complete_flag_temp = false;
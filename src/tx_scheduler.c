@@ -0,0 +1,157 @@
+/*
+ * Firmware for the Portenta X8 STM32H747AIIX/Cortex-M7 core.
+ * Copyright (C) 2022 Arduino (http://www.arduino.cc/)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/**************************************************************************************
+ * INCLUDE
+ **************************************************************************************/
+
+#include "tx_scheduler.h"
+
+#include <stdbool.h>
+
+#include "debug.h"
+
+/**************************************************************************************
+ * TYPEDEF
+ **************************************************************************************/
+
+struct tx_source
+{
+  uint8_t peripheral;
+  uint8_t weight;
+  TxSourcePendingFunc pending;
+  TxSourceDrainFunc drain;
+  uint32_t deficit;
+  uint32_t bytes;
+  uint32_t deferred;
+};
+
+/**************************************************************************************
+ * GLOBAL VARIABLES
+ **************************************************************************************/
+
+/* The bulk data producers (UART, virtual UART, FDCAN) keep their data in
+ * their own ring buffer/RX FIFO until it is moved into the TX superframe.
+ * Those act as the per-peripheral queues of a deficit round robin scheduler,
+ * so a chatty source can't fill up the superframe and starve the others.
+ */
+static struct tx_source tx_sources[TX_SCHEDULER_MAX_SOURCES];
+static uint8_t tx_sources_num = 0;
+static uint8_t tx_source_first = 0;
+
+/**************************************************************************************
+ * FUNCTION DEFINITION
+ **************************************************************************************/
+
+void tx_scheduler_register(uint8_t const peripheral, TxSourcePendingFunc const pending, TxSourceDrainFunc const drain)
+{
+  if (tx_sources_num >= TX_SCHEDULER_MAX_SOURCES) {
+    dbg_printf("tx_scheduler_register: too many sources, dropping peripheral %d\n", peripheral);
+    return;
+  }
+
+  struct tx_source * source = &tx_sources[tx_sources_num++];
+  source->peripheral = peripheral;
+  source->weight = TX_SCHEDULER_WEIGHT_DEFAULT;
+  source->pending = pending;
+  source->drain = drain;
+  source->deficit = 0;
+  source->bytes = 0;
+  source->deferred = 0;
+}
+
+void tx_scheduler_set_weight(uint8_t const peripheral, uint8_t const weight)
+{
+  for (uint8_t i = 0; i < tx_sources_num; i++)
+  {
+    if (tx_sources[i].peripheral == peripheral)
+      tx_sources[i].weight = (weight > 0) ? weight : 1;
+  }
+}
+
+void tx_scheduler_run()
+{
+  if (tx_sources_num == 0)
+    return;
+
+  /* Each round every backlogged source is granted TX_SCHEDULER_QUANTUM
+   * bytes per unit of weight on top of what it could not use before.
+   * Rounds continue as long as somebody makes progress, i.e. until all
+   * sources are drained or the superframe is full, but for at most
+   * TX_SCHEDULER_RUN_BUDGET bytes, so that the main loop gets back to
+   * dispatching received superframes and draining the spill queue.
+   */
+  uint32_t budget = TX_SCHEDULER_RUN_BUDGET;
+  bool is_progress;
+  do
+  {
+    is_progress = false;
+
+    for (uint8_t n = 0; n < tx_sources_num; n++)
+    {
+      struct tx_source * source = &tx_sources[(tx_source_first + n) % tx_sources_num];
+      uint32_t const quantum = TX_SCHEDULER_QUANTUM * source->weight;
+
+      if (!source->pending())
+      {
+        source->deficit = 0;
+        continue;
+      }
+
+      source->deficit += quantum;
+
+      int const bytes = source->drain((source->deficit > UINT16_MAX) ? UINT16_MAX : source->deficit);
+      if (bytes > 0)
+      {
+        source->deficit = ((uint32_t)bytes < source->deficit) ? (source->deficit - bytes) : 0;
+        source->bytes += bytes;
+        budget = ((uint32_t)bytes < budget) ? (budget - bytes) : 0;
+        is_progress = true;
+      }
+
+      /* An idle source does not save up credit and a source which is held
+       * back by a full superframe carries over at most one quantum.
+       */
+      if (!source->pending())
+        source->deficit = 0;
+      else if (source->deficit > quantum)
+        source->deficit = quantum;
+    }
+
+    /* Don't let the same source take the leftovers of every superframe. */
+    tx_source_first = (tx_source_first + 1) % tx_sources_num;
+  } while (is_progress && budget > 0);
+
+  for (uint8_t i = 0; i < tx_sources_num; i++)
+  {
+    if (tx_sources[i].pending())
+      tx_sources[i].deferred++;
+  }
+}
+
+int tx_scheduler_get_stats(struct tx_scheduler_stats stats[TX_SCHEDULER_MAX_SOURCES])
+{
+  for (uint8_t i = 0; i < tx_sources_num; i++)
+  {
+    stats[i].peripheral = tx_sources[i].peripheral;
+    stats[i].weight = tx_sources[i].weight;
+    stats[i].bytes = tx_sources[i].bytes;
+    stats[i].deferred = tx_sources[i].deferred;
+  }
+  return tx_sources_num;
+}
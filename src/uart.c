@@ -30,10 +30,42 @@
 #include "opcodes.h"
 #include "stm32h7xx_hal.h"
 
+#include <string.h>
+
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* The RX DMA counter as well as the event sizes reported by HAL are 16 bit. */
+#if UART_RX_RING_BUFFER_SIZE > 32768
+#error "UART_RX_RING_BUFFER_SIZE must fit the DMA counter"
+#endif
+
+/* The RX DMA reports its position on half transfer and transfer complete,
+ * i.e. it may run up to half the buffer ahead of its last event.
+ */
+#define UART_RX_DMA_LEAD        (UART_RX_RING_BUFFER_SIZE / 2)
+
+/* With flow control RTS is deasserted when the received data reaches the
+ * high water mark of what the ring buffer can hold without overwriting,
+ * and asserted again once the AP has read it down to the low water mark.
+ */
+#define UART_RX_RTS_HIGH_WATER  ((UART_RX_RING_BUFFER_SIZE - UART_RX_DMA_LEAD) * 3 / 4)
+#define UART_RX_RTS_LOW_WATER   ((UART_RX_RING_BUFFER_SIZE - UART_RX_DMA_LEAD) / 4)
+
+/* Frames received but not yet taken out of uart_ring_buffer. */
+#define UART_RX_FRAME_QUEUE_DEPTH (16)
+
 /**************************************************************************************
  * TYPEDEF
  **************************************************************************************/
 
+/* Sent to the AP when uart_write() refuses data and once there is room again. */
+struct __attribute__((packed)) uart_tx_status {
+  uint16_t refused;
+  uint16_t free;
+};
+
 struct __attribute__((packed, aligned(4))) uartPacket {
   uint8_t bits: 4;
   uint8_t stop_bits: 2;
@@ -47,36 +79,195 @@ struct __attribute__((packed, aligned(4))) uartPacket {
  **************************************************************************************/
 
 UART_HandleTypeDef huart2;
+DMA_HandleTypeDef hdma_usart2_rx;
+DMA_HandleTypeDef hdma_usart2_tx;
+
+/* Filled by the RX DMA in circular mode, emptied by the main loop. */
+spsc_ring_buffer_t uart_ring_buffer;
+__attribute__((aligned(UART_RX_RING_BUFFER_SIZE))) char uart_ring_buffer_memory[UART_RX_RING_BUFFER_SIZE];
+/* Position of the RX DMA in uart_ring_buffer_memory at its last event. */
+static volatile uint16_t uart_rx_dma_pos = 0;
+/* RTS as driven by uart_rx_poll() when flow control is enabled. */
+static bool uart_rx_is_rts_asserted = true;
+/* Reception errors as seen by uart_rx_poll(). */
+static uint32_t uart_rx_overrun = 0;
+static uint32_t uart_rx_framing = 0;
+static uint32_t uart_rx_parity = 0;
+/* Filled by _write(), emptied by the TX DMA straight out of the buffer. */
+spsc_ring_buffer_t uart_tx_ring_buffer;
+__attribute__((aligned(UART_TX_RING_BUFFER_SIZE))) char uart_tx_ring_buffer_memory[UART_TX_RING_BUFFER_SIZE];
+/* Bytes of uart_tx_ring_buffer currently being sent straight out of it. */
+static uint16_t uart_tx_in_flight = 0;
+/* Held by the producer of uart_tx_ring_buffer, see _write(). */
+static volatile uint32_t uart_tx_producer = 0;
+/* Held by whoever owns the transmitter, i.e. the consumer of uart_tx_ring_buffer. */
+static volatile uint32_t uart_tx_busy = 0;
+/* Set when uart_write() refused data, until the AP has been told to go on. */
+static volatile bool uart_tx_is_stalled = false;
+/* Set by uart_configure() until uart_set_line() has applied the new line
+ * settings, no transmission is started meanwhile.
+ */
+static volatile bool uart_line_is_pending = false;
 
-ring_buffer_t uart_ring_buffer;
-ring_buffer_t uart_tx_ring_buffer;
-
-static uint8_t uart_rxbuf[1024];
+static struct uart_rx_batch_config uart_rx_batch = {
+  UART_RX_BATCH_MIN_BYTES_DEFAULT,
+  UART_RX_BATCH_TIMEOUT_BITS_DEFAULT,
+  UART_RX_BATCH_MAX_LATENCY_us_DEFAULT
+};
+/* Set once a batch is due, until uart_ring_buffer has been emptied. */
+static bool uart_rx_is_due = false;
+/* Set while data is held back, since uart_rx_pending_cycles. */
+static bool uart_rx_is_pending = false;
+static uint32_t uart_rx_pending_cycles = 0;
+
+static struct uart_framing_config uart_framing = { FRAMING_NONE, 0, 0 };
+/* Ends of the received frames as positions in uart_ring_buffer, queued
+ * by uart_rx_timeout_irq() and dequeued by uart_handle_frame().
+ */
+static uint32_t uart_rx_frame_end[UART_RX_FRAME_QUEUE_DEPTH];
+static uint32_t uart_rx_frame_end_head = 0;
+static uint32_t uart_rx_frame_end_tail = 0;
+/* End of the last frame queued, and start of the next one to dequeue. */
+static uint32_t uart_rx_frame_last_end = 0;
+static uint32_t uart_rx_frame_start = 0;
+/* A validated frame waiting for room in a superframe. */
+static uint8_t uart_rx_frame[UART_RX_FRAME_MAX_SIZE];
+static uint16_t uart_rx_frame_size = 0;
+static uint32_t uart_rx_bad_frames = 0;
 
 /**************************************************************************************
  * FUNCTION DEFINITION
  **************************************************************************************/
 
+static bool uart_try_lock(volatile uint32_t * lock)
+{
+  do {
+    if (__LDREXW(lock)) {
+      __CLREX();
+      return false;
+    }
+  } while (__STREXW(1, lock));
+  __DMB();
+  return true;
+}
+
+static void uart_unlock(volatile uint32_t * lock)
+{
+  __DMB();
+  *lock = 0;
+}
+
+/* Starts sending the oldest data in uart_tx_ring_buffer unless the
+ * transmitter is busy already, in which case HAL_UART_TxCpltCallback
+ * picks the data up.
+ */
+static void uart_tx_start()
+{
+  if (uart_line_is_pending || spsc_ring_buffer_is_empty(&uart_tx_ring_buffer) || !uart_try_lock(&uart_tx_busy))
+    return;
+
+  /* Send the longest contiguous span, the next one is chained on completion. */
+  char const * data;
+  uint16_t const len = spsc_ring_buffer_peek_span(&uart_tx_ring_buffer, &data);
+  /* Set before starting, TxCplt may fire before HAL_UART_Transmit_DMA returns. */
+  uart_tx_in_flight = len;
+  if (HAL_OK == HAL_UART_Transmit_DMA(&huart2, (const uint8_t *)data, len))
+    return;
+
+  /* The UART is not ready, the next _write() retries. */
+  uart_tx_in_flight = 0;
+  uart_unlock(&uart_tx_busy);
+}
+
+static void uart_tx_status(uint16_t const refused)
+{
+  struct uart_tx_status const status = {
+    .refused = refused,
+    .free = UART_TX_RING_BUFFER_SIZE - spsc_ring_buffer_num_items(&uart_tx_ring_buffer),
+  };
+  enqueue_packet(PERIPH_UART, UART_TX_STATUS, sizeof(status), &status);
+}
+
+/* Hardware flow control asserts RTS for as long as the receive data
+ * register is read, which the DMA always does. RTS is therefore driven
+ * as a GPIO according to the fill level of uart_ring_buffer instead.
+ */
+static bool uart_is_rts_by_firmware()
+{
+  return huart2.Init.HwFlowCtl == UART_HWCONTROL_CTS;
+}
+
+static void uart_set_rts(bool const is_asserted)
+{
+  /* RTS is active low. */
+  HAL_GPIO_WritePin(GPIOD, GPIO_PIN_4, is_asserted ? GPIO_PIN_RESET : GPIO_PIN_SET);
+  uart_rx_is_rts_asserted = is_asserted;
+}
+
+/* Received bytes including those the RX DMA has not reported yet. The
+ * DMA position is sampled first, so a concurrent event can only make
+ * the result too large.
+ */
+static uint32_t uart_rx_fill_level()
+{
+  uint16_t const pos = uart_rx_dma_pos;
+  uint32_t const num_items = spsc_ring_buffer_num_items(&uart_ring_buffer);
+  uint16_t const dma_pos = (UART_RX_RING_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&hdma_usart2_rx)) & (UART_RX_RING_BUFFER_SIZE - 1);
+  return num_items + ((dma_pos - pos) & (UART_RX_RING_BUFFER_SIZE - 1));
+}
+
+/* Reception errors don't raise interrupts, see UART2_enable_rx_irq(),
+ * they are counted by the main loop and by uart_rx_timeout_irq(). Noise
+ * is counted as a framing error.
+ */
+static void uart_rx_count_errors()
+{
+  /* Enter critical section. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1) ;
+
+  uint32_t const isr = huart2.Instance->ISR;
+  if (isr & (USART_ISR_ORE | USART_ISR_FE | USART_ISR_NE | USART_ISR_PE)) {
+    uart_rx_overrun += (isr & USART_ISR_ORE) ? 1 : 0;
+    uart_rx_framing += (isr & (USART_ISR_FE | USART_ISR_NE)) ? 1 : 0;
+    uart_rx_parity  += (isr & USART_ISR_PE) ? 1 : 0;
+    __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_OREF | UART_CLEAR_FEF | UART_CLEAR_NEF | UART_CLEAR_PEF);
+  }
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+}
+
+/* Called from the main loop, which SysTick wakes up at least once per
+ * millisecond.
+ */
+static void uart_rx_poll()
+{
+  uart_rx_count_errors();
+
+  if (!uart_is_rts_by_firmware())
+    return;
+
+  uint32_t const fill_level = uart_rx_fill_level();
+  if (uart_rx_is_rts_asserted && fill_level >= UART_RX_RTS_HIGH_WATER)
+    uart_set_rts(false);
+  else if (!uart_rx_is_rts_asserted && fill_level <= UART_RX_RTS_LOW_WATER)
+    uart_set_rts(true);
+}
+
 int _write(int file, char *ptr, int len)
 {
-  /* Try to directly transmit the data. If currently
-   * a UART transmission is ongoing, this will return
-   * HAL_BUSY.
+  /* uart_tx_ring_buffer has a single producer, but dbg_printf() can be
+   * called from interrupts too. An interrupt which finds the producer
+   * side taken drops its output rather than waiting for it forever.
    */
-  if (HAL_OK == HAL_UART_Transmit_IT(&huart2, (const uint8_t *)ptr, len))
-    return len;
+  if (!uart_try_lock(&uart_tx_producer))
+    return 0;
+  int const cnt = spsc_ring_buffer_queue_arr(&uart_tx_ring_buffer, ptr, len);
+  uart_unlock(&uart_tx_producer);
 
-  /* Direct transmission did not work, let's store it
-   * in the ringbuffer instead. Start by disabling
-   * interrupts to avoid race conditions from accessing
-   * uart_tx_ring_buffer from both IRQ and normal context.
-   */
-  __disable_irq();
-  /* Enqueue data to write into ringbuffer. */
-  ring_buffer_queue_arr(&uart_tx_ring_buffer, ptr, len);
-  /* Re-enable interrupts. */
-  __enable_irq();
-  return len;
+  uart_tx_start();
+  return cnt;
 }
 
 int _read(int file, char *ptr, int len) {
@@ -85,19 +276,54 @@ int _read(int file, char *ptr, int len) {
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 {
-  if (ring_buffer_is_empty(&uart_tx_ring_buffer))
-    return;
+  /* The span which has just been sent is only released now. */
+  spsc_ring_buffer_discard(&uart_tx_ring_buffer, uart_tx_in_flight);
+  uart_tx_in_flight = 0;
+  uart_unlock(&uart_tx_busy);
+
+  /* Let the AP resend what has been refused once half the buffer is free. */
+  if (uart_tx_is_stalled &&
+      spsc_ring_buffer_num_items(&uart_tx_ring_buffer) <= UART_TX_RING_BUFFER_SIZE / 2)
+  {
+    uart_tx_is_stalled = false;
+    uart_tx_status(0);
+  }
 
-  /* Dequeue the oldest data byte. */
-  char data[16] = {0};
-  uint16_t const bytes_read = ring_buffer_dequeue_arr(&uart_tx_ring_buffer, data, sizeof(data));
-  /* Transmit data. */
-  HAL_UART_Transmit_IT(&huart2, (const uint8_t *)data, bytes_read);
+  /* Transmit the remaining data directly out of the ring buffer. */
+  uart_tx_start();
 }
 
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t Size) {
-  ring_buffer_queue_arr(&uart_ring_buffer, (char *)uart_rxbuf, Size);
-  HAL_UARTEx_ReceiveToIdle_IT(&huart2, uart_rxbuf, sizeof(uart_rxbuf));
+  /* Size is where the DMA is in uart_ring_buffer_memory, reported on half
+   * transfer, transfer complete and idle line. The data is in place already.
+   */
+  uint16_t const pos = Size & (UART_RX_RING_BUFFER_SIZE - 1);
+  spsc_ring_buffer_commit(&uart_ring_buffer, (pos - uart_rx_dma_pos) & (UART_RX_RING_BUFFER_SIZE - 1));
+  uart_rx_dma_pos = pos;
+}
+
+/* Publishes what the RX DMA has written since its last event and stops it. */
+static void uart_rx_stop()
+{
+  HAL_NVIC_DisableIRQ(USART2_IRQn);
+  HAL_NVIC_DisableIRQ(DMA1_Stream2_IRQn);
+  HAL_UARTEx_RxEventCallback(&huart2, UART_RX_RING_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&hdma_usart2_rx));
+  HAL_UART_AbortReceive(&huart2);
+}
+
+/* HAL_UART_Init() leaves the FIFO disabled. */
+static void uart_fifo_init(void) {
+  if (HAL_UARTEx_SetTxFifoThreshold(&huart2, UART_TXFIFO_THRESHOLD_1_2) !=
+      HAL_OK) {
+    Error_Handler("HAL_UARTEx_SetTxFifoThreshold failed.");
+  }
+  if (HAL_UARTEx_SetRxFifoThreshold(&huart2, UART_RXFIFO_THRESHOLD_1_2) !=
+      HAL_OK) {
+    Error_Handler("HAL_UARTEx_SetRxFifoThreshold failed.");
+  }
+  if (HAL_UARTEx_EnableFifoMode(&huart2) != HAL_OK) {
+    Error_Handler("HAL_UARTEx_EnableFifoMode failed.");
+  }
 }
 
 static void MX_USART2_UART_Init(void) {
@@ -117,17 +343,7 @@ static void MX_USART2_UART_Init(void) {
     Error_Handler("HAL_UART_Init failed.");
   }
 
-  if (HAL_UARTEx_SetTxFifoThreshold(&huart2, UART_TXFIFO_THRESHOLD_1_2) !=
-      HAL_OK) {
-    Error_Handler("HAL_UARTEx_SetTxFifoThreshold failed.");
-  }
-  if (HAL_UARTEx_SetRxFifoThreshold(&huart2, UART_RXFIFO_THRESHOLD_1_2) !=
-      HAL_OK) {
-    Error_Handler("HAL_UARTEx_SetRxFifoThreshold failed.");
-  }
-  if (HAL_UARTEx_EnableFifoMode(&huart2) != HAL_OK) {
-    Error_Handler("HAL_UARTEx_EnableFifoMode failed.");
-  }
+  uart_fifo_init();
 
 /*
   UART_WakeUpTypeDef event = 
@@ -170,16 +386,68 @@ void HAL_UART_MspInit(UART_HandleTypeDef *huart) {
     PD5     ------> USART2_TX
     PD4     ------> USART2_RTS
     */
-    GPIO_InitStruct.Pin = GPIO_PIN_3 | GPIO_PIN_6 | GPIO_PIN_5 | GPIO_PIN_4;
+    GPIO_InitStruct.Pin = GPIO_PIN_3 | GPIO_PIN_6 | GPIO_PIN_5;
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
     GPIO_InitStruct.Alternate = GPIO_AF7_USART2;
     HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
 
-    /* USART2 interrupt Init */
+    /* RTS starts out asserted, as a GPIO if driven by firmware. */
+    uart_set_rts(true);
+    if (uart_is_rts_by_firmware()) {
+      GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+      GPIO_InitStruct.Alternate = 0;
+    }
+    GPIO_InitStruct.Pin = GPIO_PIN_4;
+    HAL_GPIO_Init(GPIOD, &GPIO_InitStruct);
+
+    /* USART2 DMA Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    /* USART2_RX Init */
+    hdma_usart2_rx.Instance = DMA1_Stream2;
+    hdma_usart2_rx.Init.Request = DMA_REQUEST_USART2_RX;
+    hdma_usart2_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart2_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart2_rx.Init.Priority = DMA_PRIORITY_MEDIUM;
+    hdma_usart2_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart2_rx) != HAL_OK) {
+      Error_Handler("HAL_DMA_Init failed.");
+    }
+
+    __HAL_LINKDMA(huart, hdmarx, hdma_usart2_rx);
+
+    /* USART2_TX Init */
+    hdma_usart2_tx.Instance = DMA1_Stream3;
+    hdma_usart2_tx.Init.Request = DMA_REQUEST_USART2_TX;
+    hdma_usart2_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_usart2_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart2_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart2_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart2_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart2_tx.Init.Mode = DMA_NORMAL;
+    hdma_usart2_tx.Init.Priority = DMA_PRIORITY_MEDIUM;
+    hdma_usart2_tx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+    if (HAL_DMA_Init(&hdma_usart2_tx) != HAL_OK) {
+      Error_Handler("HAL_DMA_Init failed.");
+    }
+
+    __HAL_LINKDMA(huart, hdmatx, hdma_usart2_tx);
+
+    /* USART2 interrupt Init. The RX DMA interrupt reports to the same
+     * producer of uart_ring_buffer, so it must not preempt USART2_IRQn.
+     */
     HAL_NVIC_SetPriority(USART2_IRQn, 2, 0);
     HAL_NVIC_EnableIRQ(USART2_IRQn);
+    HAL_NVIC_SetPriority(DMA1_Stream2_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
+    HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 2, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
     /* USER CODE BEGIN USART2_MspInit 1 */
 
     /* USER CODE END USART2_MspInit 1 */
@@ -208,8 +476,14 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *huart) {
     */
     HAL_GPIO_DeInit(GPIOD, GPIO_PIN_3 | GPIO_PIN_6 | GPIO_PIN_5 | GPIO_PIN_4);
 
+    /* USART2 DMA DeInit */
+    HAL_DMA_DeInit(huart->hdmarx);
+    HAL_DMA_DeInit(huart->hdmatx);
+
     /* USART2 interrupt DeInit */
     HAL_NVIC_DisableIRQ(USART2_IRQn);
+    HAL_NVIC_DisableIRQ(DMA1_Stream2_IRQn);
+    HAL_NVIC_DisableIRQ(DMA1_Stream3_IRQn);
     /* USER CODE BEGIN USART2_MspDeInit 1 */
 
     /* USER CODE END USART2_MspDeInit 1 */
@@ -217,40 +491,345 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef *huart) {
 }
 
 void uart_init() {
-  MX_USART2_UART_Init();
+  /* Received data is overwritten if the AP does not keep up, data to
+   * send is dropped as it is still being read by the UART. With flow
+   * control RTS keeps received data from being overwritten.
+   */
+  spsc_ring_buffer_init(&uart_ring_buffer, uart_ring_buffer_memory, sizeof(uart_ring_buffer_memory), SPSC_RING_BUFFER_OVERWRITE);
+  spsc_ring_buffer_set_lead(&uart_ring_buffer, UART_RX_DMA_LEAD);
+  spsc_ring_buffer_init(&uart_tx_ring_buffer, uart_tx_ring_buffer_memory, sizeof(uart_tx_ring_buffer_memory), SPSC_RING_BUFFER_DROP_NEW);
 
-  ring_buffer_init(&uart_ring_buffer);
-  ring_buffer_init(&uart_tx_ring_buffer);
+  MX_USART2_UART_Init();
 }
 
 int uart_write(uint8_t const * data, uint16_t size) {
-  return _write(0, (char *)data, size);
+  int const cnt = _write(0, (char *)data, size);
+
+  /* Tell the AP how much has been refused instead of losing it silently. */
+  if (cnt < size) {
+    uart_tx_is_stalled = true;
+    uart_tx_status(size - cnt);
+  }
+  return cnt;
+}
+
+/* 3.5 characters of 11 bits, Modbus RTU fixes 1.75 ms above 19200 baud. */
+static uint32_t uart_rx_frame_gap_bits()
+{
+  if (uart_framing.gap_bits)
+    return uart_framing.gap_bits;
+  if (huart2.Init.BaudRate > 19200)
+    return (huart2.Init.BaudRate * 7 + 3999) / 4000;
+  return 39;
+}
+
+/* The receiver timeout either ends a batch or a frame. Batches are
+ * polled by uart_data_available(), frame ends are taken by interrupt
+ * in uart_rx_timeout_irq().
+ */
+static void uart_rx_timeout_apply()
+{
+  uint32_t const timeout_bits = (uart_framing.framing != FRAMING_NONE) ? uart_rx_frame_gap_bits() : uart_rx_batch.timeout_bits;
+
+  HAL_UART_ReceiverTimeout_Config(&huart2, timeout_bits);
+  if (timeout_bits)
+    ATOMIC_SET_BIT(huart2.Instance->CR2, USART_CR2_RTOEN);
+  else
+    ATOMIC_CLEAR_BIT(huart2.Instance->CR2, USART_CR2_RTOEN);
+  __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_RTOF);
+
+  if (uart_framing.framing != FRAMING_NONE)
+    __HAL_UART_ENABLE_IT(&huart2, UART_IT_RTO);
+  else
+    __HAL_UART_DISABLE_IT(&huart2, UART_IT_RTO);
+}
+
+/* Called by USART2_IRQHandler() ahead of HAL_UART_IRQHandler(), which
+ * would abort the RX DMA on a receiver timeout. By the time the line has
+ * been quiet for the gap the DMA has written the whole frame.
+ */
+void uart_rx_timeout_irq()
+{
+  /* With RTOIE enabled HAL_UART_IRQHandler() takes any reception error
+   * for one of its own interrupts, but neither clears it nor handles the
+   * idle line, which then keeps the interrupt pending forever.
+   */
+  uart_rx_count_errors();
+
+  if (!__HAL_UART_GET_FLAG(&huart2, UART_FLAG_RTOF) || !__HAL_UART_GET_IT_SOURCE(&huart2, UART_IT_RTO))
+    return;
+  __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_RTOF);
+
+  HAL_UARTEx_RxEventCallback(&huart2, UART_RX_RING_BUFFER_SIZE - __HAL_DMA_GET_COUNTER(&hdma_usart2_rx));
+  uint32_t const end = uart_ring_buffer.head;
+  if (end == uart_rx_frame_last_end)
+    return;
+
+  /* If the queue is full the frame merges with the next one, which then
+   * fails validation or exceeds UART_RX_FRAME_MAX_SIZE.
+   */
+  uint32_t const head = uart_rx_frame_end_head;
+  if (head - __atomic_load_n(&uart_rx_frame_end_tail, __ATOMIC_ACQUIRE) == UART_RX_FRAME_QUEUE_DEPTH)
+    return;
+  uart_rx_frame_end[head % UART_RX_FRAME_QUEUE_DEPTH] = end;
+  __atomic_store_n(&uart_rx_frame_end_head, head + 1, __ATOMIC_RELEASE);
+  uart_rx_frame_last_end = end;
+}
+
+static uint16_t uart_modbus_crc16(uint8_t const * data, uint16_t const size)
+{
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? ((crc >> 1) ^ 0xA001) : (crc >> 1);
+  }
+  return crc;
+}
+
+static bool uart_rx_frame_is_valid(uint16_t const size)
+{
+  /* Address, function code and the CRC sent low byte first, over which
+   * the CRC comes out as 0.
+   */
+  if (uart_framing.framing == FRAMING_MODBUS_RTU)
+    return size >= 4 && uart_modbus_crc16(uart_rx_frame, size) == 0;
+  return size > 0;
+}
+
+static bool uart_rx_frame_available()
+{
+  return uart_rx_frame_size || uart_rx_frame_end_tail != __atomic_load_n(&uart_rx_frame_end_head, __ATOMIC_ACQUIRE);
+}
+
+static int uart_handle_frame(uint16_t const max_bytes)
+{
+  /* Take the next valid frame out of uart_ring_buffer, unless one is
+   * still waiting for room in a superframe.
+   */
+  while (uart_rx_frame_size == 0 && uart_rx_frame_end_tail != __atomic_load_n(&uart_rx_frame_end_head, __ATOMIC_ACQUIRE))
+  {
+    uint32_t const end = uart_rx_frame_end[uart_rx_frame_end_tail % UART_RX_FRAME_QUEUE_DEPTH];
+    uint32_t const start = uart_rx_frame_start;
+    __atomic_store_n(&uart_rx_frame_end_tail, uart_rx_frame_end_tail + 1, __ATOMIC_RELEASE);
+    uart_rx_frame_start = end;
+
+    /* Skip what has been received ahead of the frame, e.g. before framing was enabled. */
+    if ((int32_t)(start - uart_ring_buffer.tail) > 0)
+      spsc_ring_buffer_discard(&uart_ring_buffer, start - uart_ring_buffer.tail);
+
+    if (end - start > UART_RX_FRAME_MAX_SIZE) {
+      if ((int32_t)(end - uart_ring_buffer.tail) > 0)
+        spsc_ring_buffer_discard(&uart_ring_buffer, end - uart_ring_buffer.tail);
+      uart_rx_bad_frames++;
+      continue;
+    }
+
+    uint16_t const size = spsc_ring_buffer_dequeue_arr(&uart_ring_buffer, (char *)uart_rx_frame, end - start);
+    /* If part of the frame has been overwritten the bytes read end somewhere else. */
+    if (uart_ring_buffer.tail != end || !uart_rx_frame_is_valid(size)) {
+      uart_rx_bad_frames++;
+      continue;
+    }
+    uart_rx_frame_size = size;
+  }
+
+  if (uart_rx_frame_size == 0 || max_bytes < 4 /* sizeof(subpacket.header) */ + uart_rx_frame_size)
+    return 0;
+
+  struct tx_handle const tx = tx_reserve(PERIPH_UART, DATA, uart_rx_frame_size);
+  if (!tx.data)
+    return 0;
+  memcpy(tx.data, uart_rx_frame, uart_rx_frame_size);
+  uart_rx_frame_size = 0;
+  return tx_commit(&tx, tx.max_size);
+}
+
+/* The divider for huart2.Init.BaudRate, 0 if out of range. */
+static uint32_t uart_line_usartdiv()
+{
+  uint32_t const usartdiv = UART_DIV_SAMPLING16(HAL_RCC_GetPCLK1Freq(), huart2.Init.BaudRate, huart2.Init.ClockPrescaler);
+  return (usartdiv < 16 || usartdiv > 0xFFFF) ? 0 : usartdiv;
+}
+
+/* Applies baud rate, word length, parity and stop bits of huart2.Init
+ * without reinitializing the UART. Called from the main loop until the
+ * transmitter is idle, the data still to send then goes out at the new
+ * rate. The RX DMA is stopped while the UART is disabled and starts over
+ * at the beginning of uart_ring_buffer, received data is kept apart from
+ * a character cut short.
+ */
+static void uart_set_line()
+{
+  if (!uart_try_lock(&uart_tx_busy))
+    return;
+
+  USART_TypeDef * const usart = huart2.Instance;
+  uart_rx_stop();
+
+  /* Enter critical section, CR1 is shared with the HAL interrupt handlers. */
+  volatile uint32_t primask_bit = __get_PRIMASK();
+  __set_PRIMASK(1);
+
+  CLEAR_BIT(usart->CR1, USART_CR1_UE);
+  MODIFY_REG(usart->CR1, USART_CR1_M | USART_CR1_PCE | USART_CR1_PS, huart2.Init.WordLength | huart2.Init.Parity);
+  MODIFY_REG(usart->CR2, USART_CR2_STOP, huart2.Init.StopBits);
+  usart->BRR = uart_line_usartdiv();
+  SET_BIT(usart->CR1, USART_CR1_UE);
+
+  /* Leave critical section. */
+  __set_PRIMASK(primask_bit);
+
+  UART_MASK_COMPUTATION(&huart2);
+  uart_line_is_pending = false;
+
+  UART2_enable_rx_irq();
+  /* The frame gap is counted in bit times of the new rate. */
+  uart_rx_timeout_apply();
+  HAL_NVIC_EnableIRQ(USART2_IRQn);
+  HAL_NVIC_EnableIRQ(DMA1_Stream2_IRQn);
+
+  uart_unlock(&uart_tx_busy);
+  uart_tx_start();
 }
 
 int uart_data_available() {
-  return !ring_buffer_is_empty(&uart_ring_buffer);
+  if (uart_line_is_pending)
+    uart_set_line();
+  uart_rx_poll();
+
+  if (uart_framing.framing != FRAMING_NONE)
+    return uart_rx_frame_available();
+
+  uint32_t const num_items = spsc_ring_buffer_num_items(&uart_ring_buffer);
+  if (num_items == 0)
+    return 0;
+  if (uart_rx_is_due)
+    return 1;
+
+  /* The age of the oldest byte is taken from the main loop pass which
+   * first sees it, i.e. with a resolution of one pass.
+   */
+  if (!uart_rx_is_pending) {
+    uart_rx_is_pending = true;
+    uart_rx_pending_cycles = cycle_counter_get();
+  }
+
+  if (num_items >= uart_rx_batch.min_bytes)
+    uart_rx_is_due = true;
+  else if (uart_rx_batch.timeout_bits && __HAL_UART_GET_FLAG(&huart2, UART_FLAG_RTOF))
+    uart_rx_is_due = true;
+  else if (uart_rx_batch.max_latency_us &&
+           cycle_counter_to_us(cycle_counter_get() - uart_rx_pending_cycles) >= uart_rx_batch.max_latency_us)
+    uart_rx_is_due = true;
+
+  return uart_rx_is_due;
+}
+
+int uart_handle_data(uint16_t const max_bytes) {
+  if (max_bytes <= 4 /* sizeof(subpacket.header) */)
+    return 0;
+
+  if (uart_framing.framing != FRAMING_NONE)
+    return uart_handle_frame(max_bytes);
+
+  /* Dequeue straight into the TX superframe. If the superframe is full
+   * the data is kept in the ring buffer until the next one.
+   */
+  uint32_t const num_items = spsc_ring_buffer_num_items(&uart_ring_buffer);
+  uint16_t const max_size = max_bytes - 4 /* sizeof(subpacket.header) */;
+  struct tx_handle const tx = tx_reserve(PERIPH_UART, DATA, (num_items < max_size) ? num_items : max_size);
+  if (!tx.data)
+    return 0;
+  int const cnt = spsc_ring_buffer_dequeue_arr(&uart_ring_buffer, (char *)tx.data, tx.max_size);
+
+  /* A due batch is forwarded completely, even across superframes. */
+  if (spsc_ring_buffer_is_empty(&uart_ring_buffer)) {
+    uart_rx_is_due = false;
+    uart_rx_is_pending = false;
+    __HAL_UART_CLEAR_FLAG(&huart2, UART_CLEAR_RTOF);
+  }
+  uart_rx_poll();
+  return tx_commit(&tx, cnt);
 }
 
-int uart_handle_data() {
-  uint8_t temp_buf[RING_BUFFER_SIZE];
-  __disable_irq();
-  int const cnt = ring_buffer_dequeue_arr(&uart_ring_buffer, (char *)temp_buf, ring_buffer_num_items(&uart_ring_buffer));
-  __enable_irq();
-  return enqueue_packet(PERIPH_UART, DATA, cnt, temp_buf);
+int uart_get_linestate() {
+  struct uart_linestate const linestate = {
+    .lines = (uart_rx_is_rts_asserted ? UART_LINESTATE_RTS : 0) |
+             ((HAL_GPIO_ReadPin(GPIOD, GPIO_PIN_3) == GPIO_PIN_RESET) ? UART_LINESTATE_CTS : 0),
+    .overrun = uart_rx_overrun,
+    .framing = uart_rx_framing,
+    .parity = uart_rx_parity,
+    .dropped = uart_ring_buffer.overwritten,
+    .bad_frames = uart_rx_bad_frames,
+  };
+  return enqueue_packet(PERIPH_UART, GET_LINESTATE, sizeof(linestate), &linestate);
 }
 
 void UART2_enable_rx_irq() {
-  //__HAL_UART_ENABLE_IT(&huart2, UART_IT_RXFNE);
-  //__HAL_UART_ENABLE_IT(&huart2, UART_IT_RXNE);
+  /* The circular DMA starts over at the beginning of the memory. */
+  spsc_ring_buffer_align_head(&uart_ring_buffer);
+  uart_rx_dma_pos = 0;
+
+  /* Frames cut short by the restart are dropped. */
+  uart_rx_frame_end_head = uart_rx_frame_end_tail = 0;
+  uart_rx_frame_last_end = uart_rx_frame_start = uart_ring_buffer.head;
+  uart_rx_frame_size = 0;
+
+  HAL_UARTEx_ReceiveToIdle_DMA(&huart2, (uint8_t *)uart_ring_buffer_memory, UART_RX_RING_BUFFER_SIZE);
+
+  /* HAL aborts the DMA on reception errors, keep receiving instead. */
+  ATOMIC_CLEAR_BIT(huart2.Instance->CR1, USART_CR1_PEIE);
+  ATOMIC_CLEAR_BIT(huart2.Instance->CR3, USART_CR3_EIE);
+}
+
+
+/* Applies huart2.Init and uart_framing, the receiver starts over with
+ * whatever has been received before still in uart_ring_buffer.
+ */
+static void uart_reinit()
+{
+  uart_line_is_pending = false;
+  uart_rx_stop();
+  HAL_UART_DeInit(&huart2);
+
+  if (uart_framing.flags & UART_FRAMING_RS485_DE) {
+    if (HAL_RS485Ex_Init(&huart2, UART_DE_POLARITY_HIGH, 0, 0) != HAL_OK) {
+      Error_Handler("HAL_RS485Ex_Init failed.");
+    }
+  }
+  else if (HAL_UART_Init(&huart2) != HAL_OK) {
+    Error_Handler("HAL_UART_Init failed.");
+  }
+  uart_fifo_init();
 
-  HAL_UARTEx_ReceiveToIdle_IT(&huart2, uart_rxbuf, sizeof(uart_rxbuf));
+  /* A transmission cut short by the reinitialization never completes,
+   * its span is dropped and the transmitter handed back.
+   */
+  spsc_ring_buffer_discard(&uart_tx_ring_buffer, uart_tx_in_flight);
+  uart_tx_in_flight = 0;
+  uart_unlock(&uart_tx_busy);
+
+  UART2_enable_rx_irq();
+  uart_rx_timeout_apply();
+  uart_tx_start();
 }
 
+void uart_configure(uint8_t const * data, uint16_t const size) {
 
-void uart_configure(uint8_t const * data) {
+  if (size < sizeof(struct uartPacket)) {
+    dbg_printf("uart_configure: invalid CONFIGURE size (:%d)\n", size);
+    return;
+  }
 
   struct uartPacket config = *((struct uartPacket*)data);
 
+  /* The RX batching configuration may follow the line configuration. */
+  if (size >= sizeof(struct uartPacket) + sizeof(struct uart_rx_batch_config)) {
+    memcpy(&uart_rx_batch, data + sizeof(struct uartPacket), sizeof(uart_rx_batch));
+    uart_rx_timeout_apply();
+  }
+
   //HAL_UART_DeInit(&huart2);
 
   uint32_t WordLength = UART_WORDLENGTH_8B;
@@ -307,8 +886,11 @@ void uart_configure(uint8_t const * data) {
       break;
   }
 
-  if (config.flow_control) {
-    HwFlowCtl = UART_HWCONTROL_RTS_CTS;
+  /* RTS is driven by uart_rx_poll(), see uart_is_rts_by_firmware().
+   * With RS-485 the pin is DE instead.
+   */
+  if (config.flow_control && !(uart_framing.flags & UART_FRAMING_RS485_DE)) {
+    HwFlowCtl = UART_HWCONTROL_CTS;
   }
 
   if (huart2.Init.BaudRate == config.baud &&
@@ -319,6 +901,9 @@ void uart_configure(uint8_t const * data) {
       return;
   }
 
+  /* A change of flow control reconfigures the RTS pin. */
+  bool const is_line_only = (huart2.Init.HwFlowCtl == HwFlowCtl);
+
   huart2.Init.BaudRate = config.baud;
   huart2.Init.WordLength = WordLength;
   huart2.Init.StopBits = StopBits;
@@ -333,11 +918,35 @@ void uart_configure(uint8_t const * data) {
   dbg_printf("Reconfiguring UART with %d baud, %d%c%d , %s flow control\n",
     config.baud, config.bits, parity_str, config.stop_bits, config.flow_control ? "" : "no");
 
-  HAL_UART_DeInit(&huart2);
+  if (is_line_only && uart_line_usartdiv()) {
+    uart_line_is_pending = true;
+    uart_set_line();
+    return;
+  }
+  uart_reinit();
+}
 
-  if (HAL_UART_Init(&huart2) != HAL_OK) {
-    Error_Handler("HAL_UART_Init failed.");
+void uart_configure_framing(uint8_t const * data, uint16_t const size) {
+
+  if (size != sizeof(struct uart_framing_config)) {
+    dbg_printf("uart_configure_framing: invalid UART_FRAMING_CONFIG size (:%d)\n", size);
+    return;
   }
 
-  UART2_enable_rx_irq();
+  struct uart_framing_config config;
+  memcpy(&config, data, sizeof(config));
+  if (config.framing > FRAMING_MODBUS_RTU) {
+    dbg_printf("uart_configure_framing: invalid framing (:%d)\n", config.framing);
+    return;
+  }
+  uart_framing = config;
+
+  /* DE is output on the RTS pin. */
+  if (uart_framing.flags & UART_FRAMING_RS485_DE)
+    huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+
+  dbg_printf("Reconfiguring UART framing %d, gap %d bits, %s RS-485\n",
+    uart_framing.framing, uart_rx_frame_gap_bits(), (uart_framing.flags & UART_FRAMING_RS485_DE) ? "" : "no");
+
+  uart_reinit();
 }
\ No newline at end of file
@@ -34,12 +34,20 @@ int uart_handler(uint8_t const opcode, uint8_t const * data, uint16_t const size
 {
   if (opcode == CONFIGURE)
   {
-    uart_configure(data);
+    uart_configure(data, size);
   }
   else if (opcode == DATA)
   {
     uart_write(data, size);
   }
+  else if (opcode == UART_FRAMING_CONFIG)
+  {
+    uart_configure_framing(data, size);
+  }
+  else if (opcode == GET_LINESTATE)
+  {
+    return uart_get_linestate();
+  }
   else
   {
     dbg_printf("uart_handler: error invalid opcode (:%d)\n", opcode);
@@ -29,11 +29,19 @@
 #include "ringbuffer.h"
 #include "peripherals.h"
 
+/**************************************************************************************
+ * DEFINE
+ **************************************************************************************/
+
+/* A few RPMSG_BUFFER_SIZE messages from the M4. */
+#define VIRTUAL_UART_RING_BUFFER_SIZE  (4 * 1024)
+
 /**************************************************************************************
  * GLOBAL VARIABLES
  **************************************************************************************/
 
-ring_buffer_t virtual_uart_ring_buffer; /* extern'ally referenced in rpc.c */
+spsc_ring_buffer_t virtual_uart_ring_buffer; /* extern'ally referenced in rpc.c */
+RING_BUFFER_MEMORY(virtual_uart_ring_buffer_memory, VIRTUAL_UART_RING_BUFFER_SIZE);
 
 /**************************************************************************************
  * FUNCTION DEFINITION
@@ -41,19 +49,25 @@ ring_buffer_t virtual_uart_ring_buffer; /* extern'ally referenced in rpc.c */
 
 void virtual_uart_init()
 {
-  ring_buffer_init(&virtual_uart_ring_buffer);
+  spsc_ring_buffer_init(&virtual_uart_ring_buffer, virtual_uart_ring_buffer_memory, sizeof(virtual_uart_ring_buffer_memory), SPSC_RING_BUFFER_OVERWRITE);
 }
 
 int virtual_uart_data_available()
 {
-  return !ring_buffer_is_empty(&virtual_uart_ring_buffer);
+  return !spsc_ring_buffer_is_empty(&virtual_uart_ring_buffer);
 }
 
-int virtual_uart_handle_data()
+int virtual_uart_handle_data(uint16_t const max_bytes)
 {
-  uint8_t temp_buf[RING_BUFFER_SIZE];
-  __disable_irq();
-  int const cnt = ring_buffer_dequeue_arr(&virtual_uart_ring_buffer, (char *)temp_buf, ring_buffer_num_items(&virtual_uart_ring_buffer));
-  __enable_irq();
-  return enqueue_packet(PERIPH_VIRTUAL_UART, DATA, cnt, temp_buf);
+  if (max_bytes <= 4 /* sizeof(subpacket.header) */)
+    return 0;
+
+  /* Dequeue straight into the TX superframe, see uart_handle_data. */
+  uint32_t const num_items = spsc_ring_buffer_num_items(&virtual_uart_ring_buffer);
+  uint16_t const max_size = max_bytes - 4 /* sizeof(subpacket.header) */;
+  struct tx_handle const tx = tx_reserve(PERIPH_VIRTUAL_UART, DATA, (num_items < max_size) ? num_items : max_size);
+  if (!tx.data)
+    return 0;
+  int const cnt = spsc_ring_buffer_dequeue_arr(&virtual_uart_ring_buffer, (char *)tx.data, tx.max_size);
+  return tx_commit(&tx, cnt);
 }